@@ -0,0 +1,125 @@
+#include <kpp_protocol.hpp>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+/*
+ * Side-by-side encode/decode throughput of the iostream codec path and the
+ * contiguous buffer::writer/reader path.
+ */
+
+using namespace kpp;
+using clock_type = std::chrono::steady_clock;
+
+static String make_string(const std::string & s) {
+  String str;
+  str.bytes.assign(s.begin(), s.end());
+  return str;
+}
+
+static OffsetCommitRequest make_commit(int topics, int partitions) {
+  OffsetCommitRequest ocr;
+  ocr.ConsumerGroup = make_string("bench-consumer-group");
+  ocr.Topics.contents.resize(topics);
+  for (int t = 0; t < topics; ++t) {
+    auto & topic = ocr.Topics.contents[t];
+    topic.TopicName = make_string("topic-" + std::to_string(t));
+    topic.Partitions.contents.resize(partitions);
+    for (int p = 0; p < partitions; ++p) {
+      auto & part = topic.Partitions.contents[p];
+      part.Partition.value = p;
+      part.Offset.value = 1000000 + p;
+      part.Timestamp.value = 1400000000000LL + p;
+      part.Metadata = make_string("m");
+    }
+  }
+  return ocr;
+}
+
+static OffsetFetchResponse make_fetch(int topics, int partitions) {
+  OffsetFetchResponse ofr;
+  ofr.Topics.contents.resize(topics);
+  for (int t = 0; t < topics; ++t) {
+    auto & topic = ofr.Topics.contents[t];
+    topic.TopicName = make_string("topic-" + std::to_string(t));
+    topic.Partitions.contents.resize(partitions);
+    for (int p = 0; p < partitions; ++p) {
+      auto & part = topic.Partitions.contents[p];
+      part.Partition.value = p;
+      part.Offset.value = 1000000 + p;
+      part.Metadata = make_string("");
+      part.ErrorCode.value = Error::NoError;
+    }
+  }
+  return ofr;
+}
+
+static void report(const char * name, size_t iterations, size_t bytes, clock_type::duration elapsed) {
+  double secs = std::chrono::duration<double>(elapsed).count();
+  std::cout << std::left << std::setw(40) << name
+            << std::right << std::setw(12) << std::fixed << std::setprecision(0) << iterations / secs << " msgs/s "
+            << std::setw(10) << std::setprecision(1) << (bytes * iterations) / secs / 1e6 << " MB/s" << std::endl;
+}
+
+template <typename Msg, typename View>
+static void bench(const char * name, const Msg & msg, size_t iterations) {
+  const size_t bytes = encoded_size(msg);
+  std::ostringstream encoded;
+  encoded << msg;
+  const std::string wire = encoded.str();
+  size_t sink = 0;
+
+  auto start = clock_type::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    std::ostringstream oStream;
+    oStream << msg;
+    sink += oStream.tellp();
+  }
+  report((std::string(name) + " encode iostream").c_str(), iterations, bytes, clock_type::now() - start);
+
+  std::vector<uint8_t> out(bytes);
+  start = clock_type::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer::writer oBuf(out);
+    oBuf << msg;
+    sink += oBuf.size();
+  }
+  report((std::string(name) + " encode buffer").c_str(), iterations, bytes, clock_type::now() - start);
+
+  start = clock_type::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    std::istringstream iStream(wire);
+    Msg decoded;
+    iStream >> decoded;
+    sink += decoded.Topics.contents.size();
+  }
+  report((std::string(name) + " decode iostream").c_str(), iterations, bytes, clock_type::now() - start);
+
+  start = clock_type::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer::reader iBuf(out);
+    Msg decoded;
+    iBuf >> decoded;
+    sink += decoded.Topics.contents.size();
+  }
+  report((std::string(name) + " decode buffer").c_str(), iterations, bytes, clock_type::now() - start);
+
+  start = clock_type::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer::reader iBuf(out);
+    View decoded;
+    iBuf >> decoded;
+    sink += decoded.Topics.contents.size();
+  }
+  report((std::string(name) + " decode buffer view").c_str(), iterations, bytes, clock_type::now() - start);
+
+  if (sink == 0)
+    std::cout << std::endl;
+}
+
+int main() {
+  bench<OffsetCommitRequest, OffsetCommitRequestView>("OffsetCommitRequest", make_commit(10, 100), 2000);
+  bench<OffsetFetchResponse, OffsetFetchResponseView>("OffsetFetchResponse", make_fetch(10, 100), 2000);
+}
@@ -0,0 +1,223 @@
+#include <kpp_broker.hpp>
+#include <kpp_client.hpp>
+#include <kpp_producer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * End-to-end produce and consume through a LoopbackBroker on localhost:
+ * messages go through the Accumulator and a pipelined Connection, then are
+ * fetched back partition by partition. Reports throughput and the latency
+ * distribution of Produce and Fetch round trips.
+ *
+ *   loopback_bench [messages] [message bytes] [partitions]
+ */
+
+using namespace kpp;
+using clock_type = std::chrono::steady_clock;
+
+struct Latencies {
+  std::mutex mutex;
+  std::vector<double> us;
+
+  void add(clock_type::time_point start)
+  {
+    const double d = std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+    std::lock_guard<std::mutex> lock(mutex);
+    us.push_back(d);
+  }
+
+  double percentile(double p)
+  {
+    if (us.empty())
+      return 0;
+    std::sort(us.begin(), us.end());
+    return us[std::min(us.size() - 1, static_cast<size_t>(p * us.size()))];
+  }
+};
+
+static void report(const char * name, size_t messages, size_t bytes, double seconds, Latencies & lat)
+{
+  std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(0)
+            << std::setw(12) << messages / seconds << " msg/s"
+            << std::setprecision(1) << std::setw(10) << bytes / seconds / (1 << 20) << " MB/s"
+            << "  p50 " << std::setw(8) << lat.percentile(0.50)
+            << "  p99 " << std::setw(8) << lat.percentile(0.99)
+            << "  p999 " << std::setw(8) << lat.percentile(0.999) << " us"
+            << "  (" << lat.us.size() << " round trips)\n";
+}
+
+int main(int argc, char ** argv)
+{
+  const size_t messages = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  const size_t message_size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+  const int32_t partitions = argc > 3 ? std::atoi(argv[3]) : 8;
+  const std::string topic = "bench";
+
+  LoopbackBroker broker;
+  broker.create_topic(topic, partitions);
+  if (!broker.start())
+  {
+    std::cerr << "cannot start broker\n";
+    return 1;
+  }
+
+  Connection conn;
+  Poller poller;
+  if (!conn.connect("127.0.0.1", broker.port()))
+  {
+    std::cerr << "cannot connect\n";
+    return 1;
+  }
+  poller.add(conn);
+  std::atomic<bool> running(true);
+  std::thread io([&] { while (running) poller.run_once(100); });
+
+  // Produce: keep at most 'window' requests outstanding.
+  Accumulator::Config config;
+  config.linger = std::chrono::milliseconds(1);
+  Accumulator accumulator(config, [](const std::string &, int32_t) { return 0; });
+  const size_t window = 16;
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t outstanding = 0;
+  std::atomic<size_t> failures(0);
+  Latencies produce_lat;
+
+  std::vector<uint8_t> payload(message_size, 'x');
+  const BytesView value = { payload.data(), payload.size() };
+  std::vector<ProduceBatch> drained;
+
+  auto send_drained = [&] {
+    for (auto itor = drained.begin(); itor != drained.end(); ++itor)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return outstanding < window; });
+        ++outstanding;
+      }
+      std::shared_ptr<ProduceBatch> batch = std::make_shared<ProduceBatch>(std::move(*itor));
+      const clock_type::time_point start = clock_type::now();
+      conn.send_gather(batch->request, [&, batch, start](int error, buffer::reader & body) {
+        ProduceResponseView response;
+        body >> response;
+        if (error || !body)
+          ++failures;
+        produce_lat.add(start);
+        accumulator.release(std::move(*batch));
+        std::lock_guard<std::mutex> lock(mutex);
+        --outstanding;
+        cond.notify_one();
+      });
+    }
+    drained.clear();
+  };
+
+  if (!accumulator.fits(BytesView{nullptr, 0}, value))
+  {
+    std::cerr << "messages of " << value.size << " bytes exceed the memory budget\n";
+    running = false;
+    poller.wake();
+    io.join();
+    return 1;
+  }
+  const clock_type::time_point produce_start = clock_type::now();
+  for (size_t i = 0; i < messages; ++i)
+  {
+    while (!accumulator.append(topic, static_cast<int32_t>(i % partitions), BytesView{nullptr, 0}, value))
+    {
+      accumulator.drain(clock_type::now(), drained, true);
+      send_drained();
+    }
+    if ((i & 1023) == 0)
+    {
+      accumulator.drain(clock_type::now(), drained);
+      send_drained();
+    }
+  }
+  accumulator.drain(clock_type::now(), drained, true);
+  send_drained();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return outstanding == 0; });
+  }
+  const double produce_seconds = std::chrono::duration<double>(clock_type::now() - produce_start).count();
+
+  // Consume: one Fetch at a time per partition, each resuming where the last stopped.
+  Latencies fetch_lat;
+  size_t consumed = 0;
+  const clock_type::time_point fetch_start = clock_type::now();
+  for (int32_t p = 0; p < partitions; ++p)
+  {
+    int64_t offset = 0;
+    for (;;)
+    {
+      FetchRequestView request;
+      request.ReplicaId.value = -1;
+      request.MaxWaitTime.value = 0;
+      request.MinBytes.value = 0;
+      request.Topics.contents.resize(1);
+      request.Topics.contents[0].TopicName = StringView{reinterpret_cast<const uint8_t *>(topic.data()), topic.size()};
+      request.Topics.contents[0].Partitions.contents.resize(1);
+      request.Topics.contents[0].Partitions.contents[0].Partition.value = p;
+      request.Topics.contents[0].Partitions.contents[0].FetchOffset.value = offset;
+      request.Topics.contents[0].Partitions.contents[0].MaxBytes.value = 1 << 20;
+
+      std::promise<int64_t> next;
+      std::future<int64_t> result = next.get_future();
+      const clock_type::time_point start = clock_type::now();
+      conn.send(request, [&](int error, buffer::reader & body) {
+        FetchResponseView response;
+        body >> response;
+        int64_t last = -1;
+        if (!error && body && !response.Topics.contents.empty() &&
+            !response.Topics.contents[0].Partitions.contents.empty())
+        {
+          const LazyMessageSet & set = response.Topics.contents[0].Partitions.contents[0].MessageSet;
+          for (auto entry = set.begin(); entry != set.end(); ++entry)
+          {
+            last = entry->offset;
+            ++consumed;
+          }
+        }
+        else
+          ++failures;
+        fetch_lat.add(start);
+        next.set_value(last);
+      });
+      const int64_t last = result.get();
+      if (last < 0)
+        break;
+      offset = last + 1;
+    }
+  }
+  const double fetch_seconds = std::chrono::duration<double>(clock_type::now() - fetch_start).count();
+
+  running = false;
+  poller.wake();
+  io.join();
+  poller.remove(conn);
+  broker.stop();
+
+  const size_t entry_size = sizeof(int64_t) + sizeof(int32_t) + 14 + message_size;
+  std::cout << messages << " messages of " << message_size << " bytes over " << partitions << " partitions\n";
+  report("produce", messages, messages * entry_size, produce_seconds, produce_lat);
+  report("fetch", consumed, consumed * entry_size, fetch_seconds, fetch_lat);
+  if (failures || consumed != messages)
+  {
+    std::cerr << failures << " failed round trips, " << consumed << " of " << messages << " messages fetched\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,347 @@
+#include <kpp_protocol.hpp>
+#include <kpp_template.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+/*
+ * Encode and decode throughput, and heap allocations per operation, for
+ * every message in kpp_protocol.hpp plus Message and MessageSet, at three
+ * sizes. Messages are filled generically through their schemas, so a new
+ * message type only needs a line in main().
+ *
+ * Output is one JSON object per line, for diffing and plotting runs:
+ *
+ *   message_bench [--min-time=SECONDS] [NAME-FILTER]
+ *
+ * Operations: "encode" (buffer::writer into a preallocated buffer),
+ * "decode" (owning types) and "decode_view" (Borrowed types pointing into
+ * the buffer; message sets stay lazy, so for Produce and Fetch this
+ * measures the walk over the frame, not the messages).
+ *
+ * FetchRequestTemplate compares two ways to send a consumer's next fetch
+ * over the same partitions: "encode_frame" fills a FetchRequest with new
+ * FetchOffsets and encodes it, "patch" sets them in a RequestTemplate and
+ * copies its frame, as Connection::send_template() does.
+ */
+
+using namespace kpp;
+using clock_type = std::chrono::steady_clock;
+
+/*
+ * Every form of operator new and delete is replaced, counting each
+ * allocation, and all of them go through one pair of helpers so that each
+ * new is matched by its own delete. counted_release stays out of line:
+ * inlined into a delete, its free() would look to GCC like the wrong way
+ * to release memory from operator new.
+ */
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+static void * counted_allocate(size_t n) noexcept
+{
+  ++allocations;
+  allocated_bytes += n;
+  return std::malloc(n ? n : 1);
+}
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void counted_release(void * p) noexcept
+{
+  std::free(p);
+}
+
+void * operator new (size_t n)
+{
+  if (void * p = counted_allocate(n))
+    return p;
+  throw std::bad_alloc();
+}
+void * operator new[] (size_t n)
+{
+  if (void * p = counted_allocate(n))
+    return p;
+  throw std::bad_alloc();
+}
+void * operator new (size_t n, const std::nothrow_t &) noexcept { return counted_allocate(n); }
+void * operator new[] (size_t n, const std::nothrow_t &) noexcept { return counted_allocate(n); }
+void operator delete (void * p) noexcept { counted_release(p); }
+void operator delete[] (void * p) noexcept { counted_release(p); }
+void operator delete (void * p, const std::nothrow_t &) noexcept { counted_release(p); }
+void operator delete[] (void * p, const std::nothrow_t &) noexcept { counted_release(p); }
+void operator delete (void * p, size_t) noexcept { counted_release(p); }
+void operator delete[] (void * p, size_t) noexcept { counted_release(p); }
+#if defined(__cpp_aligned_new)
+static void * counted_allocate(size_t n, std::align_val_t align) noexcept
+{
+  ++allocations;
+  allocated_bytes += n;
+  const size_t a = static_cast<size_t>(align);
+  return std::aligned_alloc(a, (n + a - 1) / a * a);
+}
+void * operator new (size_t n, std::align_val_t align)
+{
+  if (void * p = counted_allocate(n, align))
+    return p;
+  throw std::bad_alloc();
+}
+void * operator new[] (size_t n, std::align_val_t align)
+{
+  if (void * p = counted_allocate(n, align))
+    return p;
+  throw std::bad_alloc();
+}
+void * operator new (size_t n, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_allocate(n, align); }
+void * operator new[] (size_t n, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_allocate(n, align); }
+void operator delete (void * p, std::align_val_t) noexcept { counted_release(p); }
+void operator delete[] (void * p, std::align_val_t) noexcept { counted_release(p); }
+void operator delete (void * p, std::align_val_t, const std::nothrow_t &) noexcept { counted_release(p); }
+void operator delete[] (void * p, std::align_val_t, const std::nothrow_t &) noexcept { counted_release(p); }
+void operator delete (void * p, size_t, std::align_val_t) noexcept { counted_release(p); }
+void operator delete[] (void * p, size_t, std::align_val_t) noexcept { counted_release(p); }
+#endif
+
+/*
+ * Shape
+ * How big to make a generated message: every array gets 'fanout'
+ * elements, every string 'string_size' bytes, every Bytes and message
+ * Value 'payload' bytes, and every MessageSet 'messages' messages.
+ */
+struct Shape {
+  const char * name;
+  size_t fanout;
+  size_t string_size;
+  size_t payload;
+  size_t messages;
+};
+
+template <typename T>
+static void populate(BE<T> & v, const Shape &);
+template <typename Alloc>
+static void populate(basic_String<Alloc> & str, const Shape & shape);
+template <typename Alloc>
+static void populate(basic_Bytes<Alloc> & bytes, const Shape & shape);
+template <typename T, typename Alloc>
+static void populate(Array<T, Alloc> & array, const Shape & shape);
+static void populate(Message & msg, const Shape & shape);
+static void populate(MessageSet & ms, const Shape & shape);
+template <typename T>
+static typename std::enable_if<has_schema<T>::value>::type populate(T & t, const Shape & shape);
+
+template <typename T>
+static void populate(BE<T> & v, const Shape &) { v.value = 1; }
+
+template <typename Alloc>
+static void populate(basic_String<Alloc> & str, const Shape & shape) { str.bytes.assign(shape.string_size, 's'); }
+
+template <typename Alloc>
+static void populate(basic_Bytes<Alloc> & bytes, const Shape & shape) { bytes.bytes.assign(shape.payload, 'b'); }
+
+template <typename T, typename Alloc>
+static void populate(Array<T, Alloc> & array, const Shape & shape)
+{
+  array.contents.resize(shape.fanout);
+  for (auto itor = array.contents.begin(); itor != array.contents.end(); ++itor)
+    populate(*itor, shape);
+}
+
+static void populate(Message & msg, const Shape & shape)
+{
+  msg.Key.bytes.assign(shape.string_size, 'k');
+  msg.Value.bytes.assign(shape.payload, 'v');
+}
+
+static void populate(MessageSet & ms, const Shape & shape)
+{
+  ms.Messages.contents.resize(shape.messages);
+  for (size_t i = 0; i < shape.messages; ++i)
+  {
+    ms.Messages.contents[i].Offset.value = i;
+    populate(ms.Messages.contents[i].Message, shape);
+  }
+}
+
+template <typename C>
+static void populate_fields(C &, const Shape &, fields<>) { }
+template <typename C, typename F, typename... Fs>
+static void populate_fields(C & c, const Shape & shape, fields<F, Fs...>)
+{
+  populate(F::get(c), shape);
+  populate_fields(c, shape, fields<Fs...>());
+}
+
+template <typename T>
+static typename std::enable_if<has_schema<T>::value>::type populate(T & t, const Shape & shape)
+{
+  populate_fields(t, shape, typename T::schema());
+}
+
+static double min_time = 0.2;
+static size_t sink = 0;
+
+/*
+ * measure
+ * Run 'fn' in doubling batches until one batch takes min_time, then report
+ * that batch.
+ */
+template <typename Fn>
+static void measure(const char * type, const Shape & shape, const char * op, size_t wire_bytes, Fn fn)
+{
+  for (size_t iterations = 1; ; iterations *= 2)
+  {
+    const size_t allocs = allocations, bytes = allocated_bytes;
+    const clock_type::time_point start = clock_type::now();
+    for (size_t i = 0; i < iterations; ++i)
+      fn();
+    const double secs = std::chrono::duration<double>(clock_type::now() - start).count();
+    if (secs < min_time)
+      continue;
+    std::cout << std::fixed << std::setprecision(1)
+              << "{\"type\":\"" << type << "\",\"size\":\"" << shape.name << "\",\"op\":\"" << op << "\""
+              << ",\"wire_bytes\":" << wire_bytes
+              << ",\"iterations\":" << iterations
+              << ",\"ns_per_op\":" << secs * 1e9 / iterations
+              << ",\"msgs_per_sec\":" << iterations / secs
+              << ",\"bytes_per_sec\":" << wire_bytes * iterations / secs
+              << std::setprecision(2)
+              << ",\"allocs_per_op\":" << double(allocations - allocs) / iterations
+              << ",\"alloc_bytes_per_op\":" << double(allocated_bytes - bytes) / iterations
+              << "}" << std::endl;
+    return;
+  }
+}
+
+template <typename Msg, typename View>
+static void bench(const char * type, const Shape & shape)
+{
+  Msg msg;
+  populate(msg, shape);
+  std::vector<uint8_t> wire(encoded_size(msg));
+  {
+    buffer::writer oBuf(wire);
+    oBuf << msg;
+  }
+
+  measure(type, shape, "encode", wire.size(), [&] {
+    buffer::writer oBuf(wire);
+    oBuf << msg;
+    sink += oBuf.size();
+  });
+  measure(type, shape, "decode", wire.size(), [&] {
+    buffer::reader iBuf(wire);
+    Msg decoded;
+    iBuf >> decoded;
+    sink += iBuf.good();
+  });
+  measure(type, shape, "decode_view", wire.size(), [&] {
+    buffer::reader iBuf(wire);
+    View decoded;
+    iBuf >> decoded;
+    sink += iBuf.good();
+  });
+}
+
+static void bench_template(const Shape & shape, size_t topics, size_t partitions)
+{
+  RequestHeader header;
+  populate(header, shape);
+  FetchRequest request;
+  populate(request, shape);
+  request.Topics.contents.resize(topics, request.Topics.contents.front());
+  for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    t->Partitions.contents.resize(partitions, t->Partitions.contents.front());
+  RequestTemplate tmpl;
+  tmpl.encode(header, request);
+  std::vector<RequestTemplate::Field<int64_t>> offsets;
+  for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+    {
+      RequestTemplate::Field<int64_t> field;
+      if (tmpl.locate(p->FetchOffset, field))
+        offsets.push_back(field);
+    }
+
+  int64_t next = 0;
+  measure("FetchRequestTemplate", shape, "encode_frame", tmpl.size(), [&] {
+    ++next;
+    FetchRequest fetch;
+    fetch.Topics.contents.resize(request.Topics.contents.size());
+    for (size_t t = 0; t < fetch.Topics.contents.size(); ++t)
+    {
+      fetch.Topics.contents[t].TopicName = request.Topics.contents[t].TopicName;
+      fetch.Topics.contents[t].Partitions = request.Topics.contents[t].Partitions;
+      for (auto p = fetch.Topics.contents[t].Partitions.contents.begin(); p != fetch.Topics.contents[t].Partitions.contents.end(); ++p)
+        p->FetchOffset.value = next;
+    }
+    std::vector<uint8_t> frame;
+    encode_frame(frame, header, fetch);
+    sink += frame.size();
+  });
+  measure("FetchRequestTemplate", shape, "patch", tmpl.size(), [&] {
+    ++next;
+    for (auto itor = offsets.begin(); itor != offsets.end(); ++itor)
+      tmpl.set(*itor, next);
+    std::vector<uint8_t> frame(tmpl.frame());
+    sink += frame.size();
+  });
+}
+
+int main(int argc, char ** argv)
+{
+  const char * filter = "";
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strncmp(argv[i], "--min-time=", 11) == 0)
+      min_time = std::atof(argv[i] + 11);
+    else
+      filter = argv[i];
+  }
+
+  const Shape shapes[] = {
+    { "small",   1,  8,     16, 1 },
+    { "typical", 4, 16,    512, 8 },
+    { "large",   4, 64, 256 << 10, 4 },
+  };
+
+#define KPP_BENCH(Msg, View) \
+  if (std::strstr(#Msg, filter)) \
+    for (const Shape & shape : shapes) \
+      bench<Msg, View>(#Msg, shape);
+
+  KPP_BENCH(RequestHeader, RequestHeaderView)
+  KPP_BENCH(ResponseHeader, ResponseHeader)
+  KPP_BENCH(Message, MessageView)
+  KPP_BENCH(MessageSet, MessageSetView)
+  KPP_BENCH(MetadataRequest, MetadataRequestView)
+  KPP_BENCH(MetadataResponse, MetadataResponseView)
+  KPP_BENCH(ProduceRequest, ProduceRequestView)
+  KPP_BENCH(ProduceResponse, ProduceResponseView)
+  KPP_BENCH(FetchRequest, FetchRequestView)
+  KPP_BENCH(FetchResponse, FetchResponseView)
+  KPP_BENCH(OffsetRequest, OffsetRequestView)
+  KPP_BENCH(OffsetResponse, OffsetResponseView)
+  KPP_BENCH(OffsetCommitRequest, OffsetCommitRequestView)
+  KPP_BENCH(OffsetCommitResponse, OffsetCommitResponseView)
+  KPP_BENCH(OffsetFetchRequest, OffsetFetchRequestView)
+  KPP_BENCH(OffsetFetchResponse, OffsetFetchResponseView)
+  KPP_BENCH(ConsumerMetadataRequest, ConsumerMetadataRequestView)
+  KPP_BENCH(ConsumerMetadataResponse, ConsumerMetadataResponseView)
+
+#undef KPP_BENCH
+
+  // The typical shape, then a consumer of 2,000 partitions: 20 topics of 100.
+  const Shape consumer = { "2000_partitions", 1, 16, 0, 0 };
+  if (std::strstr("FetchRequestTemplate", filter))
+  {
+    bench_template(shapes[1], shapes[1].fanout, shapes[1].fanout);
+    bench_template(consumer, 20, 100);
+  }
+
+  if (sink == 0)
+    std::cout << std::endl;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+
+namespace arena {
+
+/*
+ * monotonic
+ * Bump-pointer arena. allocate() carves from the current chunk and moves
+ * on to a fresh one when it runs out; nothing is freed individually.
+ * reset() rewinds to the first chunk and keeps every chunk for reuse, so a
+ * recycled arena stops touching the heap once it has seen its largest
+ * response; release() hands the chunks back.
+ *
+ * Not thread-safe: one arena per decoding thread or per response.
+ */
+class monotonic {
+public:
+  static const size_t default_chunk_size = 16 << 10;
+  static const size_t max_chunk_size = 1 << 20;
+
+  explicit monotonic(size_t chunk_size = default_chunk_size)
+    : chunk_size_(std::max<size_t>(chunk_size, 64)), next_(0), cursor_(nullptr), end_(nullptr), used_(0) { }
+
+  monotonic(const monotonic &) = delete;
+  monotonic & operator = (const monotonic &) = delete;
+
+  ~monotonic() { release(); }
+
+  void * allocate(size_t n, size_t align)
+  {
+    uint8_t * p = aligned(cursor_, align);
+    if (!cursor_ || static_cast<size_t>(end_ - cursor_) < n + (p - cursor_))
+    {
+      next_chunk(n + align);
+      p = aligned(cursor_, align);
+    }
+    cursor_ = p + n;
+    used_ += n;
+    return p;
+  }
+
+  // Forget every allocation, keeping the chunks.
+  void reset()
+  {
+    next_ = 0;
+    cursor_ = end_ = nullptr;
+    used_ = 0;
+  }
+
+  // Forget every allocation and free the chunks.
+  void release()
+  {
+    for (auto itor = chunks_.begin(); itor != chunks_.end(); ++itor)
+      ::operator delete(itor->data);
+    chunks_.clear();
+    reset();
+  }
+
+  // Bytes handed out since the last reset.
+  size_t used() const { return used_; }
+
+  // Bytes held in chunks.
+  size_t capacity() const
+  {
+    size_t total = 0;
+    for (auto itor = chunks_.begin(); itor != chunks_.end(); ++itor)
+      total += itor->size;
+    return total;
+  }
+
+private:
+  struct chunk {
+    uint8_t * data;
+    size_t size;
+  };
+
+  static uint8_t * aligned(uint8_t * p, size_t align)
+  {
+    return reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(uintptr_t(align) - 1));
+  }
+
+  void next_chunk(size_t min)
+  {
+    while (next_ < chunks_.size() && chunks_[next_].size < min)
+      ++next_;
+    if (next_ == chunks_.size())
+    {
+      size_t size = chunks_.empty() ? chunk_size_ : std::min(chunks_.back().size * 2, max_chunk_size);
+      size = std::max(size, min);
+      chunk c = { static_cast<uint8_t *>(::operator new(size)), size };
+      chunks_.push_back(c);
+    }
+    cursor_ = chunks_[next_].data;
+    end_ = cursor_ + chunks_[next_].size;
+    ++next_;
+  }
+
+  size_t chunk_size_;
+  std::vector<chunk> chunks_;
+  size_t next_;
+  uint8_t * cursor_;
+  uint8_t * end_;
+  size_t used_;
+};
+
+/*
+ * scope
+ * Makes 'arena' the current arena of this thread for its lifetime; scopes
+ * nest. Default-constructed allocators pick up the current arena, which is
+ * how containers created deep inside a decode end up in it without the
+ * codec passing allocators around.
+ */
+class scope {
+public:
+  explicit scope(monotonic & arena) : previous_(slot()) { slot() = &arena; }
+  ~scope() { slot() = previous_; }
+
+  scope(const scope &) = delete;
+  scope & operator = (const scope &) = delete;
+
+  static monotonic * current() { return slot(); }
+
+private:
+  static monotonic *& slot()
+  {
+    static thread_local monotonic * current = nullptr;
+    return current;
+  }
+
+  monotonic * previous_;
+};
+
+/*
+ * allocator
+ * Standard allocator drawing from a monotonic arena: deallocate() is a
+ * no-op and the memory comes back when the arena is reset. Without an
+ * arena (none current at construction) it falls back to the heap.
+ */
+template <typename T>
+struct allocator {
+  using value_type = T;
+
+  monotonic * arena;
+
+  allocator() : arena(scope::current()) { }
+  explicit allocator(monotonic * a) : arena(a) { }
+  template <typename U>
+  allocator(const allocator<U> & other) : arena(other.arena) { }
+
+  T * allocate(size_t n)
+  {
+    if (!arena)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T * p, size_t)
+  {
+    if (!arena)
+      ::operator delete(p);
+  }
+};
+template <typename T, typename U>
+bool operator == (const allocator<T> & a, const allocator<U> & b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator != (const allocator<T> & a, const allocator<U> & b) { return a.arena != b.arena; }
+
+}
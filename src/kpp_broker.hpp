@@ -0,0 +1,594 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <kpp_frame.hpp>
+#include <kpp_compression.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace kpp {
+
+/*
+ * LoopbackBroker
+ * A single-node stand-in for a Kafka broker, built on kpp's own codecs,
+ * for end-to-end load tests on one machine. It listens on localhost, runs
+ * one thread, and keeps every partition log in memory.
+ *
+ * It answers Metadata, Produce, Fetch, Offset, OffsetCommit, OffsetFetch
+ * and ConsumerMetadata requests and names itself leader of every partition
+ * and coordinator of every group. Simplifications: Fetch answers at once
+ * (no MinBytes/MaxWaitTime long poll), Produce with RequiredAcks 0 gets no
+ * response, and unknown topics are created on first use when
+ * auto_create_partitions is non-zero.
+ */
+class LoopbackBroker {
+public:
+  struct Config {
+    int32_t node_id;
+    uint16_t port;                  // 0 picks a free port
+    int32_t auto_create_partitions; // 0 disables auto-creation
+    size_t max_frame_size;
+
+    Config()
+      : node_id(0), port(0), auto_create_partitions(1),
+        max_frame_size(FrameAssembler::default_max_frame_size) { }
+  };
+
+  explicit LoopbackBroker(const Config & config = Config())
+    : config_(config), listen_fd_(-1), epfd_(-1), wakefd_(-1), stop_(false) { }
+
+  LoopbackBroker(const LoopbackBroker &) = delete;
+  LoopbackBroker & operator = (const LoopbackBroker &) = delete;
+
+  ~LoopbackBroker() { stop(); }
+
+  /*
+   * start
+   * Bind 127.0.0.1:port and start serving. Returns false if the socket
+   * could not be set up.
+   */
+  bool start()
+  {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0)
+      return false;
+    const int one = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(config_.port);
+    socklen_t len = sizeof addr;
+    if (::bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0 ||
+        ::listen(listen_fd_, 64) != 0 ||
+        ::getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+    {
+      ::close(listen_fd_);
+      listen_fd_ = -1;
+      return false;
+    }
+    config_.port = ntohs(addr.sin_port);
+
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    wakefd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watch(listen_fd_, EPOLLIN, EPOLL_CTL_ADD);
+    watch(wakefd_, EPOLLIN, EPOLL_CTL_ADD);
+    stop_ = false;
+    thread_ = std::thread([this] { run(); });
+    return true;
+  }
+
+  // Stop serving and close every connection; the logs are kept.
+  void stop()
+  {
+    if (!thread_.joinable())
+      return;
+    stop_ = true;
+    const uint64_t one = 1;
+    ssize_t rc = ::write(wakefd_, &one, sizeof one);
+    (void)rc;
+    thread_.join();
+    for (auto itor = clients_.begin(); itor != clients_.end(); ++itor)
+      ::close(itor->first);
+    clients_.clear();
+    ::close(listen_fd_);
+    ::close(wakefd_);
+    ::close(epfd_);
+    listen_fd_ = epfd_ = wakefd_ = -1;
+  }
+
+  uint16_t port() const { return config_.port; }
+
+  // Create 'topic' with 'partitions' empty partitions if it does not exist.
+  // Only safe before start() or after stop().
+  void create_topic(const std::string & topic, int32_t partitions)
+  {
+    std::vector<Log> & logs = topics_[topic];
+    if (logs.size() < static_cast<size_t>(partitions))
+      logs.resize(partitions);
+  }
+
+private:
+  /*
+   * Log
+   * One partition: its entries back to back in wire form, with the offsets
+   * stamped by the broker, and where each offset's entry starts. A
+   * compressed wrapper takes as many offsets as it holds messages; all of
+   * them point at the wrapper.
+   */
+  struct Log {
+    std::vector<uint8_t> data;
+    std::vector<size_t> positions;
+
+    int64_t next_offset() const { return static_cast<int64_t>(positions.size()); }
+  };
+
+  struct Client {
+    FrameAssembler assembler;
+    std::vector<uint8_t> out;
+    size_t written;
+    bool writable;
+
+    explicit Client(size_t max_frame_size) : assembler(max_frame_size), written(0), writable(false) { }
+  };
+
+  struct CommittedOffset {
+    int64_t offset;
+    std::string metadata;
+  };
+
+  static std::string str(const StringView & s)
+  {
+    return std::string(reinterpret_cast<const char *>(s.data), s.size);
+  }
+
+  static StringView view(const std::string & s)
+  {
+    return StringView{reinterpret_cast<const uint8_t *>(s.data()), s.size()};
+  }
+
+  void watch(int fd, uint32_t events, int op)
+  {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.fd = fd;
+    ::epoll_ctl(epfd_, op, fd, &ev);
+  }
+
+  void run()
+  {
+    std::vector<uint8_t> chunk(64 << 10);
+    epoll_event events[64];
+    while (!stop_)
+    {
+      int n = ::epoll_wait(epfd_, events, 64, -1);
+      for (int i = 0; i < n; ++i)
+      {
+        const int fd = events[i].data.fd;
+        if (fd == wakefd_)
+          continue;
+        if (fd == listen_fd_)
+        {
+          accept_all();
+          continue;
+        }
+        auto found = clients_.find(fd);
+        if (found == clients_.end())
+          continue;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          if (!read_from(fd, *found->second, chunk))
+          {
+            drop(fd);
+            continue;
+          }
+        if (!flush(fd, *found->second))
+          drop(fd);
+      }
+    }
+  }
+
+  void accept_all()
+  {
+    for (;;)
+    {
+      int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        return;
+      const int one = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+      clients_[fd].reset(new Client(config_.max_frame_size));
+      watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+  }
+
+  void drop(int fd)
+  {
+    ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    clients_.erase(fd);
+  }
+
+  bool read_from(int fd, Client & client, std::vector<uint8_t> & chunk)
+  {
+    for (;;)
+    {
+      ssize_t rc = ::read(fd, chunk.data(), chunk.size());
+      if (rc == 0)
+        return false;
+      if (rc < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      bool ok = client.assembler.feed(chunk.data(), static_cast<size_t>(rc), [&](const uint8_t * body, size_t size) {
+        handle(body, size, client.out);
+      });
+      if (!ok)
+        return false;
+      if (static_cast<size_t>(rc) < chunk.size())
+        return true;
+    }
+  }
+
+  bool flush(int fd, Client & client)
+  {
+    while (client.written < client.out.size())
+    {
+      ssize_t rc = ::write(fd, client.out.data() + client.written, client.out.size() - client.written);
+      if (rc < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          return false;
+        break;
+      }
+      client.written += rc;
+    }
+    if (client.written == client.out.size())
+    {
+      client.out.clear();
+      client.written = 0;
+    }
+    const bool pending = !client.out.empty();
+    if (pending != client.writable)
+    {
+      watch(fd, EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u), EPOLL_CTL_MOD);
+      client.writable = pending;
+    }
+    return true;
+  }
+
+  // Decode one request frame and append its response frame, if any, to 'out'.
+  void handle(const uint8_t * body, size_t size, std::vector<uint8_t> & out)
+  {
+    buffer::reader iBuf(body, size);
+    RequestHeaderView header;
+    iBuf >> header;
+    RequestMessageView request;
+    if (!iBuf || !decode_message(header.ApiKey.value, iBuf, request))
+      return;
+
+    ResponseHeader response_header;
+    response_header.CorrelationId = header.CorrelationId;
+    responder respond = { *this, response_header, out };
+    request.visit(respond);
+  }
+
+  struct responder {
+    LoopbackBroker & broker;
+    const ResponseHeader & header;
+    std::vector<uint8_t> & out;
+
+    template <typename Request>
+    void operator () (const Request & request) const
+    {
+      broker.answer(header, request, out);
+    }
+  };
+
+  Log * find_log(const StringView & topic, int32_t partition, bool create)
+  {
+    auto found = topics_.find(str(topic));
+    if (found == topics_.end())
+    {
+      if (!create || config_.auto_create_partitions <= 0)
+        return nullptr;
+      found = topics_.insert(std::make_pair(str(topic), std::vector<Log>(config_.auto_create_partitions))).first;
+    }
+    if (partition < 0 || static_cast<size_t>(partition) >= found->second.size())
+      return nullptr;
+    return &found->second[partition];
+  }
+
+  void answer(const ResponseHeader & header, const MetadataRequestView & request, std::vector<uint8_t> & out)
+  {
+    const std::string host = "127.0.0.1";
+    MetadataResponseView response;
+    response.Brokers.contents.resize(1);
+    response.Brokers.contents[0].NodeId.value = config_.node_id;
+    response.Brokers.contents[0].Host = view(host);
+    response.Brokers.contents[0].Port.value = config_.port;
+
+    std::vector<std::string> names;
+    if (request.Topics.contents.empty())
+      for (auto itor = topics_.begin(); itor != topics_.end(); ++itor)
+        names.push_back(itor->first);
+    else
+      for (auto itor = request.Topics.contents.begin(); itor != request.Topics.contents.end(); ++itor)
+      {
+        find_log(*itor, 0, true);
+        names.push_back(str(*itor));
+      }
+
+    for (auto name = names.begin(); name != names.end(); ++name)
+    {
+      response.TopicMetadata.contents.emplace_back();
+      MetadataResponseView::TopicMetadataT & topic = response.TopicMetadata.contents.back();
+      topic.TopicName = view(*name);
+      auto found = topics_.find(*name);
+      topic.TopicErrorCode.value = found == topics_.end() ? Error::UnknownTopicOrPartition : Error::NoError;
+      if (found == topics_.end())
+        continue;
+      topic.PartitionMetadata.contents.resize(found->second.size());
+      for (size_t p = 0; p < found->second.size(); ++p)
+      {
+        MetadataResponseView::PartitionMetadataT & partition = topic.PartitionMetadata.contents[p];
+        partition.PartitionErrorCode.value = Error::NoError;
+        partition.PartitionId.value = static_cast<int32_t>(p);
+        partition.Leader.value = config_.node_id;
+        partition.Replicas.contents.assign(1, BE<int32_t>{config_.node_id});
+        partition.Isr.contents.assign(1, BE<int32_t>{config_.node_id});
+      }
+    }
+    encode_frame(out, header, response);
+  }
+
+  void answer(const ResponseHeader & header, const ProduceRequestView & request, std::vector<uint8_t> & out)
+  {
+    ProduceResponseView response;
+    for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    {
+      response.Topics.contents.emplace_back();
+      ProduceResponseView::TopicsT & topic = response.Topics.contents.back();
+      topic.TopicName = t->TopicName;
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        topic.Partitions.contents.emplace_back();
+        ProduceResponseView::PartitionsT & partition = topic.Partitions.contents.back();
+        partition.Partition = p->Partition;
+        partition.Offset.value = -1;
+        Log * log = find_log(t->TopicName, p->Partition.value, true);
+        if (!log)
+          partition.ErrorCode.value = Error::UnknownTopicOrPartition;
+        else if (!p->MessageSet.verify())
+          partition.ErrorCode.value = Error::InvalidMessage;
+        else
+        {
+          partition.ErrorCode.value = Error::NoError;
+          partition.Offset.value = append(*log, p->MessageSet);
+        }
+      }
+    }
+    if (request.RequiredAcks.value != 0)
+      encode_frame(out, header, response);
+  }
+
+  // Append every complete entry with broker-assigned offsets; returns the first.
+  int64_t append(Log & log, const LazyMessageSet & set)
+  {
+    const int64_t base = log.next_offset();
+    for (auto itor = set.begin(); itor != set.end(); ++itor)
+      if ((itor->attributes() & Compression::Mask) == Compression::None || !append_wrapper(log, *itor))
+        append_entry(log, *itor, 1);
+    return base;
+  }
+
+  // Copy 'entry' as it is, stamped with the last of the 'messages' offsets it takes.
+  void append_entry(Log & log, const LazyMessageSet::Entry & entry, size_t messages)
+  {
+    const size_t entry_header = sizeof(int64_t) + sizeof(int32_t);
+    const size_t position = log.data.size();
+    log.data.insert(log.data.end(), entry.message - entry_header, entry.message + entry.size);
+    endian::store_be(log.data.data() + position, static_cast<int64_t>(log.positions.size() + messages - 1));
+    log.positions.insert(log.positions.end(), messages, position);
+  }
+
+  /*
+   * append_wrapper
+   * Give the messages inside a compressed wrapper their own offsets, as a
+   * broker does: inflate it, stamp each inner entry, compress it again and
+   * stamp the wrapper with the last inner offset. False, for the caller to
+   * store it as one opaque message, if the codec is not built in or the
+   * contents do not decode or inflate past max_frame_size.
+   */
+  bool append_wrapper(Log & log, const LazyMessageSet::Entry & entry)
+  {
+    const Compression::Type type = entry.attributes() & Compression::Mask;
+    const BytesView value = entry.value();
+    std::vector<uint8_t> inflated = pool_.acquire();
+    std::vector<uint8_t> packed = pool_.acquire();
+    size_t messages = 0;
+    if (codec_.decompress(type, value.data, value.size, inflated, config_.max_frame_size))
+    {
+      const size_t entry_header = sizeof(int64_t) + sizeof(int32_t);
+      LazyMessageSet inner(inflated.data(), inflated.size());
+      size_t end = 0;
+      for (auto itor = inner.begin(); itor != inner.end(); ++itor)
+      {
+        const size_t at = static_cast<size_t>(itor->message - inflated.data()) - entry_header;
+        endian::store_be(inflated.data() + at, static_cast<int64_t>(log.positions.size() + messages));
+        end = at + entry_header + itor->size;
+        ++messages;
+      }
+      if (messages == 0 || !codec_.compress(type, inflated.data(), end, packed))
+        messages = 0;
+    }
+    if (messages)
+    {
+      MessageView wrapper;
+      wrapper.MagicByte.value = entry.magic();
+      wrapper.Attributes.value = entry.attributes();
+      wrapper.Key = entry.key();
+      wrapper.Value = BytesView{packed.data(), packed.size()};
+      const size_t position = log.data.size();
+      const int32_t size = static_cast<int32_t>(encoded_size(wrapper));
+      log.data.resize(position + sizeof(int64_t) + sizeof(int32_t) + size);
+      buffer::writer oBuf(log.data.data() + position, log.data.data() + log.data.size());
+      oBuf << BE<int64_t>{static_cast<int64_t>(log.positions.size() + messages - 1)};
+      oBuf << BE<int32_t>{size};
+      oBuf << wrapper;
+      log.positions.insert(log.positions.end(), messages, position);
+    }
+    pool_.release(std::move(packed));
+    pool_.release(std::move(inflated));
+    return messages != 0;
+  }
+
+  void answer(const ResponseHeader & header, const FetchRequestView & request, std::vector<uint8_t> & out)
+  {
+    FetchResponseView response;
+    for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    {
+      response.Topics.contents.emplace_back();
+      FetchResponseView::TopicsT & topic = response.Topics.contents.back();
+      topic.TopicName = t->TopicName;
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        topic.Partitions.contents.emplace_back();
+        FetchResponseView::PartitionsT & partition = topic.Partitions.contents.back();
+        partition.Partition = p->Partition;
+        partition.HighwaterMarkOffset.value = -1;
+        Log * log = find_log(t->TopicName, p->Partition.value, false);
+        const int64_t offset = p->FetchOffset.value;
+        if (!log)
+          partition.ErrorCode.value = Error::UnknownTopicOrPartition;
+        else if (offset < 0 || offset > log->next_offset())
+          partition.ErrorCode.value = Error::OffsetOutOfRange;
+        else
+        {
+          partition.ErrorCode.value = Error::NoError;
+          partition.HighwaterMarkOffset.value = log->next_offset();
+          // Like a real broker, cut at MaxBytes even inside an entry.
+          const size_t start = offset < log->next_offset() ? log->positions[offset] : log->data.size();
+          const size_t max_bytes = p->MaxBytes.value < 0 ? 0 : p->MaxBytes.value;
+          partition.MessageSet = LazyMessageSet(log->data.data() + start, std::min(max_bytes, log->data.size() - start));
+        }
+      }
+    }
+    encode_frame(out, header, response);
+  }
+
+  void answer(const ResponseHeader & header, const OffsetRequestView & request, std::vector<uint8_t> & out)
+  {
+    OffsetResponseView response;
+    for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    {
+      response.Topics.contents.emplace_back();
+      OffsetResponseView::TopicsT & topic = response.Topics.contents.back();
+      topic.TopicName = t->TopicName;
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        topic.Partitions.contents.emplace_back();
+        OffsetResponseView::PartitionOffsetT & partition = topic.Partitions.contents.back();
+        partition.Partition = p->Partition;
+        Log * log = find_log(t->TopicName, p->Partition.value, false);
+        if (!log)
+        {
+          partition.ErrorCode.value = Error::UnknownTopicOrPartition;
+          continue;
+        }
+        partition.ErrorCode.value = Error::NoError;
+        if (p->MaxNumberOfOffsets.value > 0)
+          partition.Offset.contents.push_back(BE<int64_t>{p->Time.value == -2 ? 0 : log->next_offset()});
+      }
+    }
+    encode_frame(out, header, response);
+  }
+
+  void answer(const ResponseHeader & header, const OffsetCommitRequestView & request, std::vector<uint8_t> & out)
+  {
+    OffsetCommitResponseView response;
+    std::map<std::pair<std::string, int32_t>, CommittedOffset> & group = groups_[str(request.ConsumerGroup)];
+    for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    {
+      response.Topics.contents.emplace_back();
+      OffsetCommitResponseView::TopicsT & topic = response.Topics.contents.back();
+      topic.TopicName = t->TopicName;
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        CommittedOffset & committed = group[std::make_pair(str(t->TopicName), p->Partition.value)];
+        committed.offset = p->Offset.value;
+        committed.metadata = str(p->Metadata);
+        OffsetCommitResponseView::PartitionsT partition;
+        partition.Partition = p->Partition;
+        partition.ErrorCode.value = Error::NoError;
+        topic.Partitions.contents.push_back(partition);
+      }
+    }
+    encode_frame(out, header, response);
+  }
+
+  void answer(const ResponseHeader & header, const OffsetFetchRequestView & request, std::vector<uint8_t> & out)
+  {
+    OffsetFetchResponseView response;
+    const std::map<std::pair<std::string, int32_t>, CommittedOffset> & group = groups_[str(request.ConsumerGroup)];
+    for (auto t = request.Topics.contents.begin(); t != request.Topics.contents.end(); ++t)
+    {
+      response.Topics.contents.emplace_back();
+      OffsetFetchResponseView::TopicsT & topic = response.Topics.contents.back();
+      topic.TopicName = t->TopicName;
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        topic.Partitions.contents.emplace_back();
+        OffsetFetchResponseView::PartitionsT & partition = topic.Partitions.contents.back();
+        partition.Partition = *p;
+        auto found = group.find(std::make_pair(str(t->TopicName), p->value));
+        partition.Offset.value = found == group.end() ? -1 : found->second.offset;
+        partition.Metadata = found == group.end() ? StringView{nullptr, 0} : view(found->second.metadata);
+        partition.ErrorCode.value = Error::NoError;
+      }
+    }
+    encode_frame(out, header, response);
+  }
+
+  void answer(const ResponseHeader & header, const ConsumerMetadataRequestView &, std::vector<uint8_t> & out)
+  {
+    const std::string host = "127.0.0.1";
+    ConsumerMetadataResponseView response;
+    response.ErrorCode.value = Error::NoError;
+    response.CoordinatorId.value = config_.node_id;
+    response.CoordinatorHost = view(host);
+    response.CoordinatorPort.value = config_.port;
+    encode_frame(out, header, response);
+  }
+
+  Config config_;
+  int listen_fd_;
+  int epfd_;
+  int wakefd_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+  std::unordered_map<int, std::unique_ptr<Client>> clients_;
+  std::map<std::string, std::vector<Log>> topics_;
+  std::map<std::string, std::map<std::pair<std::string, int32_t>, CommittedOffset>> groups_;
+  Codec codec_;
+  BufferPool pool_;
+};
+
+}
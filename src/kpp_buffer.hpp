@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+
+namespace buffer {
+
+/*
+ * writer
+ * Encode into the contiguous region [begin, end) through a cursor.
+ * A write that does not fit sets 'failed' and closes the region, so every
+ * later write fails too, much like failbit on an ostream.
+ */
+struct writer {
+  uint8_t * begin;
+  uint8_t * cursor;
+  uint8_t * end;
+  bool failed;
+
+  writer(uint8_t * first, uint8_t * last) : begin(first), cursor(first), end(last), failed(false) { }
+
+  explicit writer(std::vector<uint8_t> & out) : writer(out.data(), out.data() + out.size()) { }
+
+  inline void write(const void * src, size_t n) {
+    // Empty Strings and Bytes come with a null 'src', which memcpy rejects.
+    if (n == 0)
+      return;
+    if (static_cast<size_t>(end - cursor) < n) {
+      failed = true;
+      end = cursor;
+      return;
+    }
+    std::memcpy(cursor, src, n);
+    cursor += n;
+  }
+
+  /*
+   * take
+   * Claim the next 'n' bytes for the caller to fill and return where they
+   * start, or nullptr (failing the writer) if they do not fit.
+   */
+  inline uint8_t * take(size_t n) {
+    if (static_cast<size_t>(end - cursor) < n) {
+      failed = true;
+      end = cursor;
+      return nullptr;
+    }
+    uint8_t * first = cursor;
+    cursor += n;
+    return first;
+  }
+
+  size_t size() const { return cursor - begin; }
+  bool good() const { return !failed; }
+  explicit operator bool() const { return !failed; }
+};
+
+/*
+ * status
+ * Why a reader failed; the first failure wins.
+ */
+enum class status : uint8_t {
+  ok,
+  truncated,    // a read, length or count runs past the end of the input
+  bad_length,   // a negative length or count where none is allowed
+  over_limit,   // a length or count beyond the reader's limits
+  malformed,    // a CRC or size that does not match its contents
+};
+
+/*
+ * limits
+ * Caps on what one length prefix may claim: bytes for a String, Bytes or
+ * MessageSet, elements for an Array. A reader checks lengths against
+ * these and against the bytes it has left before anything is allocated.
+ */
+struct limits {
+  size_t max_length;
+  size_t max_elements;
+
+  limits() : max_length(SIZE_MAX), max_elements(SIZE_MAX) { }
+};
+
+/*
+ * reader
+ * Decode from the contiguous region [cursor, end).
+ * A read past 'end' zero-fills the destination, sets 'failed' and leaves
+ * the reader exhausted; 'error' says why.
+ */
+struct reader {
+  const uint8_t * cursor;
+  const uint8_t * end;
+  bool failed;
+  status error;
+  limits limit;
+
+  reader(const uint8_t * first, const uint8_t * last)
+    : cursor(first), end(last), failed(false), error(status::ok) { }
+
+  reader(const uint8_t * first, size_t n) : reader(first, first + n) { }
+
+  explicit reader(const std::vector<uint8_t> & in) : reader(in.data(), in.data() + in.size()) { }
+
+  inline void read(void * dst, size_t n) {
+    if (n == 0)
+      return;
+    if (remaining() < n) {
+      std::memset(dst, 0, n);
+      fail(status::truncated);
+      return;
+    }
+    std::memcpy(dst, cursor, n);
+    cursor += n;
+  }
+
+  /*
+   * take
+   * Step over the next 'n' bytes and return where they start, or nullptr
+   * if fewer than 'n' remain.
+   */
+  inline const uint8_t * take(size_t n) {
+    if (remaining() < n) {
+      fail(status::truncated);
+      return nullptr;
+    }
+    const uint8_t * first = cursor;
+    cursor += n;
+    return first;
+  }
+
+  /*
+   * length, count
+   * Vet a decoded length in bytes, or a count of elements that each take
+   * at least 'min_size' bytes, before it is allocated for. False, failing
+   * the reader, if it is negative, over the limit or more than is left.
+   */
+  inline bool length(int64_t n) {
+    if (n < 0)
+      return fail(status::bad_length);
+    if (static_cast<uint64_t>(n) > limit.max_length)
+      return fail(status::over_limit);
+    if (static_cast<uint64_t>(n) > remaining())
+      return fail(status::truncated);
+    return true;
+  }
+  inline bool count(int64_t n, size_t min_size) {
+    if (n < 0)
+      return fail(status::bad_length);
+    if (static_cast<uint64_t>(n) > limit.max_elements)
+      return fail(status::over_limit);
+    if (static_cast<uint64_t>(n) > remaining() / min_size)
+      return fail(status::truncated);
+    return true;
+  }
+
+  // Fail with 'why' unless already failed; always false.
+  inline bool fail(status why) {
+    if (!failed)
+      error = why;
+    failed = true;
+    cursor = end;
+    return false;
+  }
+
+  size_t remaining() const { return end - cursor; }
+  bool good() const { return !failed; }
+  explicit operator bool() const { return !failed; }
+};
+
+/*
+ * counter
+ * Measure instead of encode: every write only adds its length, so running
+ * a value through a counter yields its exact wire size.
+ */
+struct counter {
+  size_t count;
+
+  counter() : count(0) { }
+
+  inline void write(const void *, size_t n) { count += n; }
+
+  size_t size() const { return count; }
+};
+
+/*
+ * gather
+ * Encode into a list of pieces for writev instead of one buffer: writes
+ * shorter than 'min_reference' (headers, lengths, CRCs) are copied into
+ * 'scratch', longer ones (payloads) are referenced where they lie. The
+ * referenced memory must outlive the write of the result. Writes no wider
+ * than an int64 are always copied whatever 'min_reference' says: fixed-width
+ * fields are encoded from temporaries that are gone by the time of the write.
+ */
+struct gather {
+  struct piece {
+    const uint8_t * data;
+    size_t size;
+  };
+
+  std::vector<uint8_t> scratch;
+  size_t min_reference;
+
+  explicit gather(size_t min_reference_bytes = 4096) : min_reference(min_reference_bytes), total(0) { }
+
+  inline void write(const void * src, size_t n) {
+    total += n;
+    if (n >= min_reference && n > sizeof(int64_t)) {
+      spans.push_back(span{static_cast<const uint8_t *>(src), 0, n});
+      return;
+    }
+    if (n == 0)
+      return;
+    if (spans.empty() || spans.back().external)
+      spans.push_back(span{nullptr, scratch.size(), 0});
+    const uint8_t * p = static_cast<const uint8_t *>(src);
+    scratch.insert(scratch.end(), p, p + n);
+    spans.back().size += n;
+  }
+
+  /*
+   * pieces
+   * Append the encoding so far to 'out' in order. Pieces in 'scratch' stay
+   * valid until the next write, or across a move of 'scratch'.
+   */
+  void pieces(std::vector<piece> & out) const {
+    for (auto itor = spans.begin(); itor != spans.end(); ++itor)
+      out.push_back(piece{itor->external ? itor->external : scratch.data() + itor->offset, itor->size});
+  }
+
+  // Bytes referenced rather than copied.
+  size_t referenced() const { return total - scratch.size(); }
+
+  void clear() {
+    scratch.clear();
+    spans.clear();
+    total = 0;
+  }
+
+  size_t size() const { return total; }
+
+private:
+  // A referenced run, or (external null) a run of 'scratch' at 'offset'.
+  struct span {
+    const uint8_t * external;
+    size_t offset;
+    size_t size;
+  };
+
+  std::vector<span> spans;
+  size_t total;
+};
+
+}
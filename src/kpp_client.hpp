@@ -0,0 +1,740 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <kpp_frame.hpp>
+#include <kpp_metrics.hpp>
+#include <kpp_template.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+namespace kpp {
+
+class Poller;
+
+/*
+ * Connection
+ * One non-blocking broker socket carrying many requests at once. send()
+ * stamps each request with the next CorrelationId and queues its frame;
+ * the socket is written with writev over as many queued frames as fit, and
+ * responses are matched back to their callbacks by CorrelationId, in
+ * whatever order they come. At most max_in_flight requests are on the
+ * wire; the rest wait in the queue until responses free a slot.
+ *
+ * send(), call() and close() may be used from any thread, including from
+ * a callback. The socket and its epoll registration are only touched
+ * under the connection's mutex, and it leaves the Poller's epoll set
+ * before it is closed, so a reused descriptor number is never confused
+ * with it. Callbacks run on the thread driving the Poller the connection
+ * is added to.
+ */
+class Connection {
+public:
+  /*
+   * Callback
+   * 'error' is 0 or an errno value (the connection failed or was closed
+   * with the request outstanding, in which case 'body' is empty). 'body'
+   * reads the response after its CorrelationId and is only valid during
+   * the call.
+   */
+  using Callback = std::function<void (int error, buffer::reader & body)>;
+
+  struct Config {
+    std::string client_id;
+    size_t max_in_flight;
+    size_t max_frame_size;
+    size_t read_size;
+    size_t max_iov;
+    size_t min_reference;    // send_gather() references Bytes at least this long
+
+    Config()
+      : client_id("kpp"), max_in_flight(64), max_frame_size(FrameAssembler::default_max_frame_size),
+        read_size(64 << 10), max_iov(64), min_reference(4096) { }
+  };
+
+  explicit Connection(const Config & config = Config())
+    : config_(config), fd_(-1), connected_(false), error_(0), next_id_(0), poller_(nullptr),
+      registered_(false), events_(0), reset_read_(false), assembler_(config.max_frame_size),
+      read_buf_(config.read_size) { }
+
+  Connection(const Connection &) = delete;
+  Connection & operator = (const Connection &) = delete;
+
+  ~Connection() { close(); }
+
+  /*
+   * connect
+   * Start a non-blocking connect to host:port. Returns false, with error()
+   * set, if it fails straight away; otherwise the outcome shows once the
+   * Poller sees the socket writable. Requests may be sent before that.
+   * A socket still open from an earlier connect() is closed first, as by
+   * close(), failing whatever was outstanding on it.
+   */
+  bool connect(const std::string & host, uint16_t port)
+  {
+    bool open;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      open = fd_ >= 0;
+    }
+    if (open)
+      close();
+
+    addrinfo hints, * res = nullptr;
+    std::memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    const std::string service = std::to_string(port);
+    if (::getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 || !res)
+      return set_error(EHOSTUNREACH);
+
+    int fd = ::socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (fd < 0)
+    {
+      ::freeaddrinfo(res);
+      return set_error(errno);
+    }
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    int rc = ::connect(fd, res->ai_addr, res->ai_addrlen);
+    const int err = errno;
+    ::freeaddrinfo(res);
+    if (rc != 0 && err != EINPROGRESS)
+    {
+      ::close(fd);
+      return set_error(err);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    fd_ = fd;
+    connected_ = rc == 0;
+    error_ = 0;
+    return true;
+  }
+
+  /*
+   * send
+   * Queue 'request' and return its CorrelationId. 'done' runs when the
+   * response arrives; with expect_response false (a ProduceRequest with
+   * RequiredAcks 0) it runs with an empty body once the frame is written.
+   * On a failed connection 'done' runs at once with the error and -1 is
+   * returned.
+   */
+  template <typename Request>
+  int32_t send(const Request & request, Callback done, bool expect_response = true)
+  {
+    Outgoing out;
+    RequestHeaderView header = stamp(api_key<Request>::value, out, std::move(done), expect_response);
+    encode_frame(out.frame, header, request);
+    out.size = out.frame.size();
+    metrics::encoded(out.api, out.size, metrics::now() - out.sent);
+    return enqueue(std::move(out));
+  }
+
+  /*
+   * send_gather
+   * send() without copying payloads: Bytes of at least min_reference bytes
+   * are written straight from 'request' with writev, and only the rest is
+   * encoded into the frame. Whatever 'request' points at must stay alive
+   * and unchanged until 'done' runs.
+   */
+  template <typename Request>
+  int32_t send_gather(const Request & request, Callback done, bool expect_response = true)
+  {
+    Outgoing out;
+    RequestHeaderView header = stamp(api_key<Request>::value, out, std::move(done), expect_response);
+    buffer::gather oGather(config_.min_reference);
+    encode_frame(oGather, header, request);
+    oGather.pieces(out.pieces);
+    out.size = oGather.size();
+    metrics::encoded(out.api, out.size, metrics::now() - out.sent);
+    // The pieces in scratch move along with its storage.
+    out.frame = std::move(oGather.scratch);
+    return enqueue(std::move(out));
+  }
+
+  /*
+   * prepare
+   * Encode 'request' into 'out' under this connection's header, for
+   * send_template(). Locate the fields to patch before 'request' changes.
+   */
+  template <typename Request>
+  void prepare(const Request & request, RequestTemplate & out) const
+  {
+    out.encode(request_header(api_key<Request>::value, 0), request);
+  }
+
+  /*
+   * send_template
+   * send() a frame from prepare(), patched as needed: it is copied as it
+   * stands and only the CorrelationId is stamped into the copy, so nothing
+   * is encoded again. 'request' may be patched and sent again at once.
+   */
+  int32_t send_template(const RequestTemplate & request, Callback done, bool expect_response = true)
+  {
+    if (request.empty())
+    {
+      complete(done, EINVAL);
+      return -1;
+    }
+    Outgoing out;
+    RequestHeaderView header = stamp(request.get(RequestTemplate::api_key()), out, std::move(done), expect_response);
+    out.frame.assign(request.data(), request.data() + request.size());
+    uint8_t * p = out.frame.data() + RequestTemplate::correlation_id().offset;
+    store_raw(p, header.CorrelationId);
+    out.size = out.frame.size();
+    metrics::encoded(out.api, out.size, metrics::now() - out.sent);
+    return enqueue(std::move(out));
+  }
+
+  /*
+   * call
+   * send() with the response decoded into an owned Response. The future
+   * holds a std::system_error if the connection fails or the response
+   * does not decode (EBADMSG).
+   */
+  template <typename Response, typename Request>
+  std::future<Response> call(const Request & request)
+  {
+    std::shared_ptr<std::promise<Response>> promise = std::make_shared<std::promise<Response>>();
+    std::future<Response> result = promise->get_future();
+    send(request, [promise](int error, buffer::reader & body) {
+      Response response;
+      if (!error)
+      {
+        const uint64_t start = metrics::now();
+        const size_t bytes = body.remaining();
+        body >> response;
+        if (!body)
+          error = EBADMSG;
+        else
+          metrics::decoded(response, bytes, metrics::now() - start);
+      }
+      if (error)
+        promise->set_exception(std::make_exception_ptr(std::system_error(error, std::generic_category())));
+      else
+        promise->set_value(std::move(response));
+    });
+    return result;
+  }
+
+  // Fail every outstanding request with ECANCELED and close the socket.
+  void close() { fail(ECANCELED); }
+
+  int fd() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fd_;
+  }
+  bool connected() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connected_;
+  }
+  int error() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+  }
+
+  // Requests written and awaiting a response.
+  size_t in_flight() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_.size();
+  }
+
+  // Requests queued or partly written.
+  size_t queued() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size() + writing_.size();
+  }
+
+private:
+  friend class Poller;
+
+  struct Outgoing {
+    int32_t id;
+    bool expect_response;
+    Callback done;
+    std::vector<uint8_t> frame;
+    std::vector<buffer::gather::piece> pieces;  // empty: 'frame' is all of it
+    size_t size;
+    ApiKey::Type api;
+    uint64_t sent;                              // metrics::now() at send()
+  };
+
+  struct Waiting {
+    Callback done;
+    ApiKey::Type api;
+    uint64_t sent;
+  };
+
+  RequestHeaderView request_header(ApiKey::Type api, int32_t id) const
+  {
+    RequestHeaderView header;
+    header.ApiKey.value = api;
+    header.ApiVersion.value = 0;
+    header.CorrelationId.value = id;
+    header.ClientId = StringView{reinterpret_cast<const uint8_t *>(config_.client_id.data()), config_.client_id.size()};
+    return header;
+  }
+
+  RequestHeaderView stamp(ApiKey::Type api, Outgoing & out, Callback done, bool expect_response)
+  {
+    RequestHeaderView header = request_header(api, next_id_.fetch_add(1, std::memory_order_relaxed) & 0x7FFFFFFF);
+    out.id = header.CorrelationId.value;
+    out.expect_response = expect_response;
+    out.done = std::move(done);
+    out.api = header.ApiKey.value;
+    out.sent = metrics::now();
+    return header;
+  }
+
+  int32_t enqueue(Outgoing && out)
+  {
+    const int32_t id = out.id;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (error_ || fd_ < 0)
+      {
+        const int error = error_ ? error_ : ENOTCONN;
+        lock.unlock();
+        metrics::failed(out.api);
+        complete(out.done, error);
+        return -1;
+      }
+      queue_.push_back(std::move(out));
+    }
+    wake();
+    return id;
+  }
+
+  bool set_error(int error)
+  {
+    error_ = error;
+    return false;
+  }
+
+  static void complete(Callback & done, int error)
+  {
+    if (!done)
+      return;
+    buffer::reader empty(static_cast<const uint8_t *>(nullptr), static_cast<const uint8_t *>(nullptr));
+    done(error, empty);
+  }
+
+  // Move queued requests onto the wire side while in-flight slots are free.
+  void admit()
+  {
+    while (!queue_.empty() && (config_.max_in_flight == 0 || in_flight_.size() < config_.max_in_flight))
+    {
+      Outgoing & out = queue_.front();
+      if (out.expect_response)
+        in_flight_.insert(std::make_pair(out.id, Waiting{std::move(out.done), out.api, out.sent}));
+      writing_.push_back(std::move(out));
+      queue_.pop_front();
+    }
+  }
+
+  // Register with 'epfd' for the events wanted now, or update them.
+  void sync(int epfd)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0)
+      return;
+    admit();
+    const uint32_t events = EPOLLIN | (!connected_ || !writing_.empty() ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    if (registered_ && events == events_)
+      return;
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = this;
+    ::epoll_ctl(epfd, registered_ ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd_, &ev);
+    registered_ = true;
+    events_ = events;
+  }
+
+  // Leave the Poller's epoll set. Called with mutex_ held.
+  void unregister();
+
+  // Leave the Poller altogether.
+  void detach()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unregister();
+    poller_ = nullptr;
+  }
+
+  void on_event(uint32_t events)
+  {
+    int error = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (fd_ < 0)
+        return;
+      if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))
+        error = socket_error(ECONNRESET);
+    }
+    if (error)
+      return fail(error);
+    if (events & EPOLLOUT)
+      on_writable();
+    if (events & EPOLLIN)
+      on_readable();
+  }
+
+  // Called with mutex_ held.
+  int socket_error(int fallback) const
+  {
+    int err = 0;
+    socklen_t len = sizeof err;
+    if (::getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err == 0)
+      return fallback;
+    return err;
+  }
+
+  void on_writable()
+  {
+    std::vector<Callback> written;
+    int error;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error = flush(written);
+    }
+    for (auto itor = written.begin(); itor != written.end(); ++itor)
+      complete(*itor, 0);
+    if (error)
+      fail(error);
+  }
+
+  /*
+   * flush
+   * writev queued frames until the socket is full or nothing is left.
+   * Callbacks of fire-and-forget requests that went out are moved to
+   * 'written'. Returns 0 or an errno. Called with mutex_ held.
+   */
+  int flush(std::vector<Callback> & written)
+  {
+    if (!connected_)
+    {
+      if (int error = socket_error(0))
+        return error;
+      connected_ = true;
+    }
+    admit();
+    while (!writing_.empty())
+    {
+      iovec iov[256];
+      const size_t max_iov = std::min<size_t>(config_.max_iov, sizeof iov / sizeof iov[0]);
+      size_t n = 0;
+      for (auto itor = writing_.begin(); itor != writing_.end() && n < max_iov; ++itor)
+      {
+        size_t skip = itor == writing_.begin() ? write_offset_ : 0;
+        if (itor->pieces.empty())
+        {
+          iov[n].iov_base = itor->frame.data() + skip;
+          iov[n].iov_len = itor->frame.size() - skip;
+          ++n;
+          continue;
+        }
+        for (auto p = itor->pieces.begin(); p != itor->pieces.end() && n < max_iov; ++p)
+        {
+          if (skip >= p->size)
+          {
+            skip -= p->size;
+            continue;
+          }
+          iov[n].iov_base = const_cast<uint8_t *>(p->data) + skip;
+          iov[n].iov_len = p->size - skip;
+          skip = 0;
+          ++n;
+        }
+      }
+      ssize_t rc = ::writev(fd_, iov, static_cast<int>(n));
+      if (rc < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : errno;
+      }
+      size_t left = static_cast<size_t>(rc);
+      while (left && !writing_.empty())
+      {
+        Outgoing & out = writing_.front();
+        const size_t rest = out.size - write_offset_;
+        if (left < rest)
+        {
+          write_offset_ += left;
+          break;
+        }
+        left -= rest;
+        write_offset_ = 0;
+        if (!out.expect_response)
+          written.push_back(std::move(out.done));
+        writing_.pop_front();
+      }
+      // A short write means the socket buffer is full.
+      if (write_offset_ != 0)
+        return 0;
+      admit();
+    }
+    return 0;
+  }
+
+  /*
+   * on_readable
+   * The read itself happens under the mutex, so a close() from another
+   * thread or from a callback lands between reads, never during one. The
+   * assembler belongs to this thread; a fail() only asks for its reset.
+   */
+  void on_readable()
+  {
+    for (;;)
+    {
+      ssize_t rc;
+      int error;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (reset_read_)
+        {
+          assembler_.reset();
+          reset_read_ = false;
+        }
+        if (fd_ < 0)
+          return;
+        rc = ::read(fd_, read_buf_.data(), read_buf_.size());
+        error = errno;
+      }
+      if (rc == 0)
+        return fail(ECONNRESET);
+      if (rc < 0)
+      {
+        if (error == EINTR)
+          continue;
+        if (error == EAGAIN || error == EWOULDBLOCK)
+          return;
+        return fail(error);
+      }
+      bool ok = assembler_.feed(read_buf_.data(), static_cast<size_t>(rc), [this](const uint8_t * body, size_t size) {
+        buffer::reader iBuf(body, size);
+        ResponseHeader header;
+        iBuf >> header;
+        Waiting waiting;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          auto found = in_flight_.find(header.CorrelationId.value);
+          if (found == in_flight_.end())
+            return;
+          waiting = std::move(found->second);
+          in_flight_.erase(found);
+        }
+        metrics::round_trip(waiting.api, metrics::now() - waiting.sent);
+        if (waiting.done)
+          waiting.done(iBuf ? 0 : EBADMSG, iBuf);
+      });
+      if (!ok)
+        return fail(EBADMSG);
+      if (static_cast<size_t>(rc) < read_buf_.size())
+        return;
+    }
+  }
+
+  // Close the socket and fail everything outstanding with 'error'.
+  void fail(int error)
+  {
+    std::deque<Outgoing> queued, writing;
+    std::unordered_map<int32_t, Waiting> in_flight;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (fd_ >= 0)
+      {
+        unregister();
+        ::close(fd_);
+        fd_ = -1;
+      }
+      connected_ = false;
+      error_ = error;
+      write_offset_ = 0;
+      reset_read_ = true;
+      queued.swap(queue_);
+      writing.swap(writing_);
+      in_flight.swap(in_flight_);
+    }
+    for (auto itor = in_flight.begin(); itor != in_flight.end(); ++itor)
+    {
+      metrics::failed(itor->second.api);
+      complete(itor->second.done, error);
+    }
+    for (auto itor = writing.begin(); itor != writing.end(); ++itor)
+      if (!itor->expect_response)
+      {
+        metrics::failed(itor->api);
+        complete(itor->done, error);
+      }
+    for (auto itor = queued.begin(); itor != queued.end(); ++itor)
+    {
+      metrics::failed(itor->api);
+      complete(itor->done, error);
+    }
+  }
+
+  void wake();
+
+  Config config_;
+  int fd_;
+  bool connected_;
+  int error_;
+  std::atomic<int32_t> next_id_;
+  Poller * poller_;
+  bool registered_;          // fd_ is in poller_'s epoll set, for events_
+  uint32_t events_;
+  bool reset_read_;          // drop the assembler's partial frame before the next read
+  size_t write_offset_ = 0;
+  mutable std::mutex mutex_;
+  std::deque<Outgoing> queue_;
+  std::deque<Outgoing> writing_;
+  std::unordered_map<int32_t, Waiting> in_flight_;
+  FrameAssembler assembler_;
+  std::vector<uint8_t> read_buf_;
+};
+
+/*
+ * Poller
+ * epoll loop driving any number of Connections. run_once() waits for
+ * socket activity (or a send() from another thread) and services it; call
+ * it in a loop on one thread.
+ */
+class Poller {
+public:
+  Poller()
+    : epfd_(::epoll_create1(EPOLL_CLOEXEC)), wakefd_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+  {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+  }
+
+  Poller(const Poller &) = delete;
+  Poller & operator = (const Poller &) = delete;
+
+  ~Poller()
+  {
+    for (auto itor = connections_.begin(); itor != connections_.end(); ++itor)
+      (*itor)->detach();
+    ::close(wakefd_);
+    ::close(epfd_);
+  }
+
+  // Start servicing 'conn', which must be connect()ed and outlive its removal.
+  void add(Connection & conn)
+  {
+    {
+      std::lock_guard<std::mutex> lock(conn.mutex_);
+      conn.poller_ = this;
+    }
+    connections_.push_back(&conn);
+    wake();
+  }
+
+  void remove(Connection & conn)
+  {
+    for (auto itor = connections_.begin(); itor != connections_.end(); ++itor)
+      if (*itor == &conn)
+      {
+        conn.detach();
+        connections_.erase(itor);
+        return;
+      }
+  }
+
+  /*
+   * run_once
+   * Wait up to 'timeout_ms' (-1 forever) and handle what is ready.
+   * Returns the number of events handled.
+   */
+  size_t run_once(int timeout_ms)
+  {
+    sync();
+    epoll_event events[64];
+    int n = ::epoll_wait(epfd_, events, 64, timeout_ms);
+    for (int i = 0; i < n; ++i)
+    {
+      if (!events[i].data.ptr)
+      {
+        uint64_t count;
+        while (::read(wakefd_, &count, sizeof count) > 0) { }
+        continue;
+      }
+      static_cast<Connection *>(events[i].data.ptr)->on_event(events[i].events);
+    }
+    sync();
+    return n < 0 ? 0 : static_cast<size_t>(n);
+  }
+
+  // Interrupt a blocked run_once(); safe from any thread.
+  void wake()
+  {
+    const uint64_t one = 1;
+    ssize_t rc = ::write(wakefd_, &one, sizeof one);
+    (void)rc;
+  }
+
+private:
+  friend class Connection;
+
+  // Bring each connection's epoll registration in line with its interest.
+  void sync()
+  {
+    for (auto itor = connections_.begin(); itor != connections_.end(); ++itor)
+      (*itor)->sync(epfd_);
+  }
+
+  int epfd_;
+  int wakefd_;
+  std::vector<Connection *> connections_;
+};
+
+inline void Connection::unregister()
+{
+  if (registered_ && poller_ && fd_ >= 0)
+    ::epoll_ctl(poller_->epfd_, EPOLL_CTL_DEL, fd_, nullptr);
+  registered_ = false;
+  events_ = 0;
+}
+
+inline void Connection::wake()
+{
+  Poller * poller;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    poller = poller_;
+  }
+  if (poller)
+    poller->wake();
+}
+
+}
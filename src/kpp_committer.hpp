@@ -0,0 +1,311 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <kpp_client.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+
+
+namespace kpp {
+
+/*
+ * OffsetCommitter
+ * Coalesces offset commits. Each (group, topic, partition) has a slot that
+ * keeps just its latest offset and a version bumped by every commit; a
+ * flush sends the slots whose version moved since they were last sent.
+ * commit() by name finds the slot under a mutex; the per-message path
+ * takes a handle once with slot() and commits through it with one store
+ * and one increment, no lock. Both are safe from any thread. tick() sends
+ * one OffsetCommitRequest per group once the interval has passed, flush()
+ * sends at once, and flush_sync() sends and waits for the answers, for
+ * shutdown.
+ *
+ * A commit that fails, whole or per partition, is sent again by the next
+ * flush unless its slot was committed to since it was sent, whether that
+ * newer offset is pending or already in flight, so a retry never takes a
+ * partition back to an older offset. on_error hears about each failure.
+ * Callbacks run on the Poller thread driving the connections.
+ */
+class OffsetCommitter {
+public:
+  using clock = std::chrono::steady_clock;
+  using ConnectionFn = std::function<Connection * (const std::string & group)>;
+  // 'error' is an errno value for a failed request, otherwise the Error code.
+  using ErrorFn = std::function<void (const std::string & group, const std::string & topic, int32_t partition,
+                                      int64_t offset, int error)>;
+
+  struct Config {
+    clock::duration interval;
+
+    Config() : interval(std::chrono::seconds(5)) { }
+  };
+
+  // One partition's commit state; slots live as long as the committer.
+  class Slot {
+  public:
+    Slot() : offset_(0), version_(0), sent_(0) { }
+
+  private:
+    friend class OffsetCommitter;
+
+    std::string group_;
+    std::string topic_;
+    int32_t partition_;
+    std::atomic<int64_t> offset_;
+    std::atomic<uint64_t> version_;  // commits recorded so far
+    uint64_t sent_;                  // version last sent, or restored after a failure; mutex_
+    std::string metadata_;           // mutex_
+  };
+
+  OffsetCommitter(const Config & config, ConnectionFn coordinator, ErrorFn on_error = ErrorFn())
+    : config_(config), coordinator_(std::move(coordinator)), on_error_(std::move(on_error)),
+      last_flush_(clock::now()), in_flight_(0), failures_(0) { }
+
+  OffsetCommitter(const OffsetCommitter &) = delete;
+  OffsetCommitter & operator = (const OffsetCommitter &) = delete;
+
+  // Waits for commits in flight; their connections must still be polled.
+  ~OffsetCommitter()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return in_flight_ == 0; });
+  }
+
+  // Handle of the (group, topic, partition) slot, for commit(Slot *, int64_t).
+  Slot * slot(const std::string & group, const std::string & topic, int32_t partition)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return &slot_locked(group, topic, partition);
+  }
+
+  // Record 'offset' as the next offset to consume; replaces any earlier one.
+  void commit(Slot * slot, int64_t offset)
+  {
+    slot->offset_.store(offset, std::memory_order_relaxed);
+    slot->version_.fetch_add(1, std::memory_order_release);
+  }
+
+  void commit(const std::string & group, const std::string & topic, int32_t partition, int64_t offset,
+              const std::string & metadata = std::string())
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot & s = slot_locked(group, topic, partition);
+    s.metadata_ = metadata;
+    commit(&s, offset);
+  }
+
+  // Partitions with an offset waiting to be sent.
+  size_t pending() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (auto group = groups_.begin(); group != groups_.end(); ++group)
+      for (auto itor = group->second.begin(); itor != group->second.end(); ++itor)
+        if (itor->second.version_.load(std::memory_order_acquire) != itor->second.sent_)
+          ++n;
+    return n;
+  }
+
+  // flush() if the interval has passed since the last one.
+  size_t tick(clock::time_point now = clock::now())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (now - last_flush_ < config_.interval)
+        return 0;
+    }
+    return flush(now);
+  }
+
+  /*
+   * flush
+   * Send everything pending, one request per group. Returns the number of
+   * requests sent.
+   */
+  size_t flush(clock::time_point now = clock::now())
+  {
+    std::vector<std::pair<const std::string *, Batch>> batches;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      last_flush_ = now;
+      for (auto group = groups_.begin(); group != groups_.end(); ++group)
+      {
+        Batch batch;
+        for (auto itor = group->second.begin(); itor != group->second.end(); ++itor)
+        {
+          Slot & s = itor->second;
+          // The version first: an offset stored after it is newer, never older.
+          const uint64_t version = s.version_.load(std::memory_order_acquire);
+          if (version == s.sent_)
+            continue;
+          s.sent_ = version;
+          batch.push_back(Sent{&s, version, s.offset_.load(std::memory_order_relaxed), s.metadata_});
+        }
+        if (!batch.empty())
+          batches.emplace_back(&group->first, std::move(batch));
+      }
+    }
+    size_t sent = 0;
+    for (auto itor = batches.begin(); itor != batches.end(); ++itor)
+      sent += send(*itor->first, std::move(itor->second));
+    return sent;
+  }
+
+  /*
+   * flush_sync
+   * flush() and wait up to 'timeout' for every commit in flight. True if
+   * all of them succeeded and nothing is left pending.
+   */
+  bool flush_sync(clock::duration timeout)
+  {
+    size_t failures;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      failures = failures_;
+    }
+    flush();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!idle_.wait_for(lock, timeout, [this] { return in_flight_ == 0; }))
+        return false;
+      if (failures_ != failures)
+        return false;
+    }
+    return pending() == 0;
+  }
+
+private:
+  using Key = std::pair<std::string, int32_t>;
+
+  // A slot as it went out in one request.
+  struct Sent {
+    Slot * slot;
+    uint64_t version;
+    int64_t offset;
+    std::string metadata;
+  };
+  using Batch = std::vector<Sent>;
+
+  Slot & slot_locked(const std::string & group, const std::string & topic, int32_t partition)
+  {
+    auto inserted = groups_[group].emplace(std::piecewise_construct, std::forward_as_tuple(topic, partition),
+                                           std::forward_as_tuple());
+    Slot & s = inserted.first->second;
+    if (inserted.second)
+    {
+      s.group_ = group;
+      s.topic_ = topic;
+      s.partition_ = partition;
+    }
+    return s;
+  }
+
+  size_t send(const std::string & group, Batch && batch)
+  {
+    OffsetCommitRequest request;
+    request.ConsumerGroup.bytes.assign(group.begin(), group.end());
+    for (auto itor = batch.begin(); itor != batch.end(); ++itor)
+    {
+      const std::string & topic = itor->slot->topic_;
+      if (request.Topics.contents.empty() ||
+          request.Topics.contents.back().TopicName.bytes.size() != topic.size() ||
+          !std::equal(topic.begin(), topic.end(), request.Topics.contents.back().TopicName.bytes.begin()))
+      {
+        request.Topics.contents.emplace_back();
+        request.Topics.contents.back().TopicName.bytes.assign(topic.begin(), topic.end());
+      }
+      OffsetCommitRequest::PartitionsT p;
+      p.Partition.value = itor->slot->partition_;
+      p.Offset.value = itor->offset;
+      p.Timestamp.value = -1;
+      p.Metadata.bytes.assign(itor->metadata.begin(), itor->metadata.end());
+      request.Topics.contents.back().Partitions.contents.push_back(std::move(p));
+    }
+
+    Connection * conn = coordinator_(group);
+    std::shared_ptr<Batch> sent = std::make_shared<Batch>(std::move(batch));
+    if (!conn)
+    {
+      failed(*sent, ENOTCONN);
+      return 0;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++in_flight_;
+    }
+    conn->send(request, [this, sent](int error, buffer::reader & body) {
+      OffsetCommitResponseView response;
+      if (!error)
+      {
+        const uint64_t start = metrics::now();
+        const size_t bytes = body.remaining();
+        body >> response;
+        if (!body)
+          error = EBADMSG;
+        else
+          metrics::decoded(response, bytes, metrics::now() - start);
+      }
+      if (error)
+        failed(*sent, error);
+      else
+        for (auto t = response.Topics.contents.begin(); t != response.Topics.contents.end(); ++t)
+          for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+          {
+            if (p->ErrorCode.value == Error::NoError)
+              continue;
+            for (auto itor = sent->begin(); itor != sent->end(); ++itor)
+              if (itor->slot->partition_ == p->Partition.value && itor->slot->topic_.size() == t->TopicName.size &&
+                  std::equal(itor->slot->topic_.begin(), itor->slot->topic_.end(), t->TopicName.data))
+                failed(*itor, p->ErrorCode.value);
+          }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--in_flight_ == 0)
+        idle_.notify_all();
+    });
+    return 1;
+  }
+
+  void failed(Batch & batch, int error)
+  {
+    for (auto itor = batch.begin(); itor != batch.end(); ++itor)
+      failed(*itor, error);
+  }
+
+  // Send the slot again unless it was committed to after this went out.
+  void failed(const Sent & sent, int error)
+  {
+    Slot & s = *sent.slot;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++failures_;
+      if (s.version_.load(std::memory_order_acquire) == sent.version && s.sent_ == sent.version)
+        s.sent_ = sent.version - 1;
+    }
+    if (on_error_)
+      on_error_(s.group_, s.topic_, s.partition_, sent.offset, error);
+  }
+
+  Config config_;
+  ConnectionFn coordinator_;
+  ErrorFn on_error_;
+  mutable std::mutex mutex_;
+  std::condition_variable idle_;
+  std::map<std::string, std::map<Key, Slot>> groups_;
+  clock::time_point last_flush_;
+  size_t in_flight_;
+  size_t failures_;
+};
+
+}
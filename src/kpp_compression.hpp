@@ -0,0 +1,394 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef KPP_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KPP_WITH_SNAPPY
+#include <snappy-c.h>
+#endif
+
+/**
+A compressed MessageSet travels as the Value of a single wrapper Message
+whose Attributes carry the codec in their low three bits:
+
+  Attributes => int8
+    bits 0-2 => None (0) | GZIP (1) | Snappy (2)
+
+The wrapped Value is a MessageSet without its MessageSetSize prefix. Snappy
+payloads use the xerial block framing the Java client writes; raw snappy is
+accepted on decode as well.
+
+GZIP needs KPP_WITH_ZLIB and Snappy needs KPP_WITH_SNAPPY; without them the
+codec reports failure.
+*/
+
+namespace kpp {
+
+namespace Compression {
+  using Type = int8_t;
+  constexpr Type None   = 0,
+                 GZIP   = 1,
+                 Snappy = 2;
+  constexpr Type Mask   = 0x07;
+}
+
+/*
+ * BufferPool
+ * Recycles byte buffers together with their capacity, so steady-state
+ * decompression allocates nothing. Safe to share between threads.
+ */
+class BufferPool {
+public:
+  explicit BufferPool(size_t max_pooled = 64) : max_pooled_(max_pooled) { }
+
+  std::vector<uint8_t> acquire()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty())
+      return std::vector<uint8_t>();
+    std::vector<uint8_t> buf = std::move(free_.back());
+    free_.pop_back();
+    return buf;
+  }
+
+  void release(std::vector<uint8_t> && buf)
+  {
+    buf.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.size() < max_pooled_ && buf.capacity())
+      free_.push_back(std::move(buf));
+  }
+
+private:
+  size_t max_pooled_;
+  std::mutex mutex_;
+  std::vector<std::vector<uint8_t>> free_;
+};
+
+namespace {
+  const uint8_t xerial_magic[] = { 0x82, 'S', 'N', 'A', 'P', 'P', 'Y', 0 };
+  const size_t xerial_header_size = sizeof xerial_magic + 2 * sizeof(int32_t);
+  const size_t xerial_block_size = 32 << 10;
+
+  inline int32_t load_be32(const uint8_t * p)
+  {
+    int32_t v;
+    std::memcpy(&v, p, sizeof v);
+    return endian::ntoh(v);
+  }
+  inline void store_be32(uint8_t * p, int32_t v)
+  {
+    v = endian::hton(v);
+    std::memcpy(p, &v, sizeof v);
+  }
+}
+
+/*
+ * Codec
+ * Compresses and decompresses whole buffers. It keeps its zlib streams
+ * between calls and only resets them, so one Codec per thread avoids
+ * re-allocating compressor state for every wrapper message.
+ */
+class Codec {
+public:
+  Codec()
+  {
+#ifdef KPP_WITH_ZLIB
+    std::memset(&deflate_, 0, sizeof deflate_);
+    std::memset(&inflate_, 0, sizeof inflate_);
+    deflate_ok_ = deflateInit2(&deflate_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    inflate_ok_ = inflateInit2(&inflate_, 15 + 32) == Z_OK;
+#endif
+  }
+
+  ~Codec()
+  {
+#ifdef KPP_WITH_ZLIB
+    if (deflate_ok_)
+      deflateEnd(&deflate_);
+    if (inflate_ok_)
+      inflateEnd(&inflate_);
+#endif
+  }
+
+  Codec(const Codec &) = delete;
+  Codec & operator = (const Codec &) = delete;
+
+  // What decompress() inflates to at most unless told otherwise.
+  static const size_t default_max_output = 64 << 20;
+
+  static bool supported(Compression::Type codec)
+  {
+    switch (codec & Compression::Mask) {
+      case Compression::None: return true;
+#ifdef KPP_WITH_ZLIB
+      case Compression::GZIP: return true;
+#endif
+#ifdef KPP_WITH_SNAPPY
+      case Compression::Snappy: return true;
+#endif
+      default: return false;
+    }
+  }
+
+  /*
+   * compress, decompress
+   * Replace the contents of 'out'; its capacity is reused. Return false on
+   * an unsupported codec or corrupt input, and from decompress also when
+   * the result would exceed 'max_output' bytes: a few KB on the wire can
+   * claim or inflate to gigabytes.
+   */
+  bool compress(Compression::Type codec, const uint8_t * in, size_t n, std::vector<uint8_t> & out)
+  {
+    switch (codec & Compression::Mask) {
+      case Compression::None:
+        out.assign(in, in + n);
+        return true;
+      case Compression::GZIP:
+        return gzip(in, n, out);
+      case Compression::Snappy:
+        return snappy(in, n, out);
+      default:
+        return false;
+    }
+  }
+
+  bool decompress(Compression::Type codec, const uint8_t * in, size_t n, std::vector<uint8_t> & out,
+                  size_t max_output = default_max_output)
+  {
+    switch (codec & Compression::Mask) {
+      case Compression::None:
+        if (n > max_output)
+          return false;
+        out.assign(in, in + n);
+        return true;
+      case Compression::GZIP:
+        return gunzip(in, n, out, max_output);
+      case Compression::Snappy:
+        return unsnappy(in, n, out, max_output);
+      default:
+        return false;
+    }
+  }
+
+private:
+#ifdef KPP_WITH_ZLIB
+  bool gzip(const uint8_t * in, size_t n, std::vector<uint8_t> & out)
+  {
+    if (!deflate_ok_ || deflateReset(&deflate_) != Z_OK)
+      return false;
+    out.resize(deflateBound(&deflate_, n) + 32);
+    deflate_.next_in = const_cast<Bytef *>(in);
+    deflate_.avail_in = n;
+    deflate_.next_out = out.data();
+    deflate_.avail_out = out.size();
+    if (deflate(&deflate_, Z_FINISH) != Z_STREAM_END)
+      return false;
+    out.resize(deflate_.total_out);
+    return true;
+  }
+
+  bool gunzip(const uint8_t * in, size_t n, std::vector<uint8_t> & out, size_t max_output)
+  {
+    if (!inflate_ok_ || inflateReset(&inflate_) != Z_OK)
+      return false;
+    out.resize(std::min(max_output, std::max(out.capacity(), 4 * n + 64)));
+    inflate_.next_in = const_cast<Bytef *>(in);
+    inflate_.avail_in = n;
+    inflate_.next_out = out.data();
+    inflate_.avail_out = out.size();
+    for (;;)
+    {
+      int rc = inflate(&inflate_, Z_NO_FLUSH);
+      if (rc == Z_STREAM_END)
+        break;
+      if (rc != Z_OK && rc != Z_BUF_ERROR)
+        return false;
+      if (inflate_.avail_out != 0)
+        return false;  // input ended before the stream did
+      size_t done = inflate_.total_out;
+      if (done >= max_output)
+        return false;
+      out.resize(std::min(max_output, 2 * out.size()));
+      inflate_.next_out = out.data() + done;
+      inflate_.avail_out = out.size() - done;
+    }
+    out.resize(inflate_.total_out);
+    return true;
+  }
+#else
+  bool gzip(const uint8_t *, size_t, std::vector<uint8_t> &) { return false; }
+  bool gunzip(const uint8_t *, size_t, std::vector<uint8_t> &, size_t) { return false; }
+#endif
+
+#ifdef KPP_WITH_SNAPPY
+  bool snappy(const uint8_t * in, size_t n, std::vector<uint8_t> & out)
+  {
+    const size_t blocks = (n + xerial_block_size - 1) / xerial_block_size;
+    out.resize(xerial_header_size + blocks * sizeof(int32_t) +
+               blocks * snappy_max_compressed_length(std::min(n, xerial_block_size)));
+    std::memcpy(out.data(), xerial_magic, sizeof xerial_magic);
+    store_be32(out.data() + sizeof xerial_magic, 1);
+    store_be32(out.data() + sizeof xerial_magic + sizeof(int32_t), 1);
+    size_t pos = xerial_header_size;
+    for (size_t done = 0; done < n; done += xerial_block_size)
+    {
+      size_t block = std::min(xerial_block_size, n - done);
+      size_t packed = out.size() - pos - sizeof(int32_t);
+      if (snappy_compress(reinterpret_cast<const char *>(in + done), block,
+                          reinterpret_cast<char *>(out.data() + pos + sizeof(int32_t)), &packed) != SNAPPY_OK)
+        return false;
+      store_be32(out.data() + pos, static_cast<int32_t>(packed));
+      pos += sizeof(int32_t) + packed;
+    }
+    out.resize(pos);
+    return true;
+  }
+
+  static bool unsnappy_block(const uint8_t * in, size_t n, std::vector<uint8_t> & out, size_t max_output)
+  {
+    size_t length;
+    if (snappy_uncompressed_length(reinterpret_cast<const char *>(in), n, &length) != SNAPPY_OK)
+      return false;
+    // The length comes from the input: check it before allocating for it.
+    if (length > max_output - out.size())
+      return false;
+    size_t start = out.size();
+    out.resize(start + length);
+    return snappy_uncompress(reinterpret_cast<const char *>(in), n,
+                             reinterpret_cast<char *>(out.data() + start), &length) == SNAPPY_OK;
+  }
+
+  bool unsnappy(const uint8_t * in, size_t n, std::vector<uint8_t> & out, size_t max_output)
+  {
+    out.clear();
+    if (n < xerial_header_size || std::memcmp(in, xerial_magic, sizeof xerial_magic) != 0)
+      return unsnappy_block(in, n, out, max_output);
+    for (size_t pos = xerial_header_size; pos < n; )
+    {
+      if (n - pos < sizeof(int32_t))
+        return false;
+      int32_t packed = load_be32(in + pos);
+      pos += sizeof(int32_t);
+      if (packed < 0 || static_cast<size_t>(packed) > n - pos || !unsnappy_block(in + pos, packed, out, max_output))
+        return false;
+      pos += packed;
+    }
+    return true;
+  }
+#else
+  bool snappy(const uint8_t *, size_t, std::vector<uint8_t> &) { return false; }
+  bool unsnappy(const uint8_t *, size_t, std::vector<uint8_t> &, size_t) { return false; }
+#endif
+
+#ifdef KPP_WITH_ZLIB
+  z_stream deflate_;
+  z_stream inflate_;
+  bool deflate_ok_;
+  bool inflate_ok_;
+#endif
+};
+
+/*
+ * compress
+ * Wrap 'inner' into one Message whose Value is its entries compressed with
+ * 'codec'. The wrapper goes into an outer MessageSet like any other
+ * message. Returns false if the codec is unavailable.
+ */
+template <typename S>
+bool compress(Codec & codec, Compression::Type type, const basic_MessageSet<S> & inner, Message & wrapper)
+{
+  buffer::counter oSize;
+  basic_MessageSet<S>::encode_entries(oSize, inner);
+  std::vector<uint8_t> plain(oSize.count);
+  buffer::writer oBuf(plain);
+  basic_MessageSet<S>::encode_entries(oBuf, inner);
+
+  wrapper.MagicByte.value = 0;
+  wrapper.Attributes.value = type & Compression::Mask;
+  wrapper.Key.bytes.clear();
+  wrapper.Key.null = true;
+  return codec.compress(type, plain.data(), plain.size(), wrapper.Value.bytes);
+}
+
+/*
+ * MessageSetReader
+ * Walks a LazyMessageSet and steps transparently into compressed wrapper
+ * messages, yielding the messages they contain. Wrappers are inflated into
+ * one buffer taken from 'pool' and returned to it when the reader goes
+ * away; entries from inside a wrapper stay valid until the reader steps
+ * into the next one. A wrapper that inflates beyond 'max_inflated' bytes
+ * fails the reader like a corrupt one.
+ */
+class MessageSetReader {
+public:
+  MessageSetReader(const LazyMessageSet & outer, Codec & codec, BufferPool & pool,
+                   size_t max_inflated = Codec::default_max_output)
+    : outer_(outer.begin()), outer_end_(outer.end()),
+      codec_(codec), pool_(pool), max_inflated_(max_inflated), failed_(false) { }
+
+  ~MessageSetReader() { pool_.release(std::move(inflated_)); }
+
+  MessageSetReader(const MessageSetReader &) = delete;
+  MessageSetReader & operator = (const MessageSetReader &) = delete;
+
+  /*
+   * next
+   * Store the next plain message in 'entry'. Returns false at the end of
+   * the set, or on a wrapper that could not be decompressed (see failed()).
+   */
+  bool next(LazyMessageSet::Entry & entry)
+  {
+    for (;;)
+    {
+      if (inner_ != inner_end_)
+      {
+        entry = *inner_++;
+        return true;
+      }
+      if (failed_ || outer_ == outer_end_)
+        return false;
+
+      const LazyMessageSet::Entry & current = *outer_;
+      Compression::Type type = current.attributes() & Compression::Mask;
+      if (type == Compression::None)
+      {
+        entry = current;
+        ++outer_;
+        return true;
+      }
+
+      BytesView value = current.value();
+      ++outer_;
+      if (inflated_.capacity() == 0)
+        inflated_ = pool_.acquire();
+      if (!codec_.decompress(type, value.data, value.size, inflated_, max_inflated_))
+      {
+        failed_ = true;
+        return false;
+      }
+      LazyMessageSet inner(inflated_.data(), inflated_.size());
+      inner_ = inner.begin();
+      inner_end_ = inner.end();
+    }
+  }
+
+  bool failed() const { return failed_; }
+
+private:
+  LazyMessageSet::iterator outer_, outer_end_;
+  LazyMessageSet::iterator inner_, inner_end_;
+  Codec & codec_;
+  BufferPool & pool_;
+  size_t max_inflated_;
+  std::vector<uint8_t> inflated_;
+  bool failed_;
+};
+
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <kpp_client.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace kpp {
+
+/*
+ * FetchBatch
+ * One FetchResponse handed to the application by Consumer::poll(). Its
+ * message sets are LazyMessageSets over 'response.frame'. Partitions that
+ * were moved by seek() or unassign() while the fetch was in flight or
+ * waiting in poll()'s queue have been removed. Hand it back with Consumer::release() once processed; that
+ * frees its share of the memory budget and may start the next prefetch.
+ */
+struct FetchBatch {
+  int32_t broker;
+  size_t bytes;
+  Decoded<FetchResponseView> response;
+};
+
+/*
+ * Consumer
+ * Fetch pipeline that keeps the network busy while the application works.
+ * Assigned partitions are grouped by leader into one FetchRequest per
+ * broker. As soon as a response arrives, its partitions move to the offset
+ * after their last complete message and the next fetch for that broker goes
+ * out at once, on the I/O thread, while the response waits in poll()'s
+ * queue. So with prefetch_depth 2 (the default) each broker has one
+ * batch with the application and the next one buffered or on the wire.
+ *
+ * Memory is capped by memory_budget. It covers buffered responses plus,
+ * for each fetch in flight, the most it could return (MaxBytes for each of
+ * its partitions). A fetch that does not fit waits until release() frees
+ * room; one always goes out when nothing is buffered, so a budget smaller
+ * than a single response still makes progress.
+ *
+ * A partition error (OffsetOutOfRange, NotLeaderForPartition, ...) is
+ * delivered in the batch and leaves the offset where it was; the
+ * application reacts, e.g. with seek(), and the next fetch picks that up.
+ *
+ * poll(), release() and the assignment calls are safe from any thread.
+ * Connections come from ConnectionFn and must be driven by a Poller.
+ */
+class Consumer {
+public:
+  using clock = std::chrono::steady_clock;
+  using LeaderFn = std::function<int32_t (const std::string & topic, int32_t partition)>;
+  using ConnectionFn = std::function<Connection * (int32_t broker)>;
+
+  struct Config {
+    int32_t max_wait_time;
+    int32_t min_bytes;
+    int32_t max_bytes;         // per partition
+    size_t memory_budget;
+    size_t prefetch_depth;     // batches per broker, buffered or in flight
+
+    Config()
+      : max_wait_time(100), min_bytes(1), max_bytes(1 << 20), memory_budget(64 << 20), prefetch_depth(2) { }
+  };
+
+  Consumer(const Config & config, LeaderFn leader, ConnectionFn connection)
+    : config_(config), leader_(std::move(leader)), connection_(std::move(connection)),
+      state_(std::make_shared<Shared>()), used_(0), generations_(0), closed_(false) { }
+
+  Consumer(const Consumer &) = delete;
+  Consumer & operator = (const Consumer &) = delete;
+
+  // Responses still in flight are dropped when they arrive. Waits for a
+  // callback that is running, so it must not be destroyed from one.
+  ~Consumer()
+  {
+    close();
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->idle.wait(lock, [this] { return state_->callbacks == 0; });
+  }
+
+  // Start consuming 'partition' of 'topic' at 'offset'.
+  void assign(const std::string & topic, int32_t partition, int64_t offset)
+  {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      Partition & p = partitions_[Key(topic, partition)];
+      p.offset = offset;
+      p.generation = ++generations_;
+      drop_ready(Key(topic, partition));
+    }
+    fill();
+  }
+
+  // Move an assigned partition; data fetched from the old offset, in flight
+  // or buffered, is dropped.
+  void seek(const std::string & topic, int32_t partition, int64_t offset)
+  {
+    assign(topic, partition, offset);
+  }
+
+  void unassign(const std::string & topic, int32_t partition)
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    partitions_.erase(Key(topic, partition));
+    drop_ready(Key(topic, partition));
+  }
+
+  // Next fetch offset of an assigned partition, or -1.
+  int64_t position(const std::string & topic, int32_t partition) const
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    auto found = partitions_.find(Key(topic, partition));
+    return found == partitions_.end() ? -1 : found->second.offset;
+  }
+
+  /*
+   * poll
+   * Take the oldest buffered batch, waiting up to 'timeout' for one.
+   * Returns false on timeout or after close().
+   */
+  bool poll(FetchBatch & out, clock::duration timeout = clock::duration::zero())
+  {
+    fill();
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    if (!state_->ready.wait_for(lock, timeout, [this] { return closed_ || !ready_.empty(); }) || closed_)
+      return false;
+    out = std::move(ready_.front());
+    ready_.pop_front();
+    return true;
+  }
+
+  // Give a polled batch back, freeing its budget and resuming prefetch.
+  void release(FetchBatch && batch)
+  {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      used_ -= std::min(used_, batch.bytes);
+      Broker & broker = brokers_[batch.broker];
+      if (broker.batches)
+        --broker.batches;
+      batch.response = Decoded<FetchResponseView>();
+      batch.bytes = 0;
+    }
+    fill();
+  }
+
+  // Bytes buffered or reserved for fetches in flight.
+  size_t used() const
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return used_;
+  }
+
+  // Stop fetching and wake any poll(); responses in flight are dropped.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    closed_ = true;
+    state_->alive = false;
+    state_->ready.notify_all();
+  }
+
+private:
+  using Key = std::pair<std::string, int32_t>;
+  // The partitions a fetch carries, with the generation each was sent at.
+  using Sent = std::map<Key, uint64_t>;
+
+  struct Partition {
+    int64_t offset;
+    uint64_t generation;       // new from generations_ at each assign() and seek()
+    uint64_t sent_generation;  // generation of the fetch in flight
+    bool in_flight;
+
+    Partition() : offset(0), generation(0), sent_generation(0), in_flight(false) { }
+  };
+
+  struct Broker {
+    size_t batches;  // buffered, with the application, or in flight
+
+    Broker() : batches(0) { }
+  };
+
+  // Outlives the Consumer for callbacks that arrive after it is gone.
+  struct Shared {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable idle;
+    bool alive;
+    size_t callbacks;
+
+    Shared() : alive(true), callbacks(0) { }
+  };
+
+  struct Pending {
+    int32_t broker;
+    Connection * conn;
+    FetchRequest request;
+    Sent sent;
+    size_t reserved;
+  };
+
+  // Start a fetch on every broker with room for one.
+  void fill()
+  {
+    std::vector<Pending> pending;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (closed_)
+        return;
+      std::map<int32_t, size_t> by_broker;
+      for (auto itor = partitions_.begin(); itor != partitions_.end(); ++itor)
+      {
+        if (itor->second.in_flight)
+          continue;
+        const int32_t broker = leader_(itor->first.first, itor->first.second);
+        if (broker < 0 || brokers_[broker].batches >= config_.prefetch_depth)
+          continue;
+        auto slot = by_broker.find(broker);
+        if (slot == by_broker.end())
+        {
+          Connection * conn = connection_(broker);
+          if (!conn)
+            continue;
+          slot = by_broker.insert(std::make_pair(broker, pending.size())).first;
+          pending.emplace_back();
+          Pending & p = pending.back();
+          p.broker = broker;
+          p.conn = conn;
+          p.request.ReplicaId.value = -1;
+          p.request.MaxWaitTime.value = config_.max_wait_time;
+          p.request.MinBytes.value = config_.min_bytes;
+          p.reserved = 0;
+        }
+        Pending & p = pending[slot->second];
+        const size_t reserve = static_cast<size_t>(config_.max_bytes);
+        if (used_ + reserve > config_.memory_budget && (used_ > 0 || p.reserved > 0))
+          continue;
+        used_ += reserve;
+        p.reserved += reserve;
+
+        const std::string & topic = itor->first.first;
+        if (p.request.Topics.contents.empty() ||
+            topic.size() != p.request.Topics.contents.back().TopicName.bytes.size() ||
+            !std::equal(topic.begin(), topic.end(), p.request.Topics.contents.back().TopicName.bytes.begin()))
+        {
+          p.request.Topics.contents.emplace_back();
+          p.request.Topics.contents.back().TopicName.bytes.assign(topic.begin(), topic.end());
+        }
+        FetchRequest::PartitionsT fp;
+        fp.Partition.value = itor->first.second;
+        fp.FetchOffset.value = itor->second.offset;
+        fp.MaxBytes.value = config_.max_bytes;
+        p.request.Topics.contents.back().Partitions.contents.push_back(fp);
+        p.sent[itor->first] = itor->second.generation;
+        itor->second.sent_generation = itor->second.generation;
+        itor->second.in_flight = true;
+      }
+      for (auto itor = pending.begin(); itor != pending.end(); ++itor)
+        if (!itor->sent.empty())
+          ++brokers_[itor->broker].batches;
+    }
+    for (auto itor = pending.begin(); itor != pending.end(); ++itor)
+      if (!itor->sent.empty())
+        send(*itor);
+  }
+
+  void send(Pending & p)
+  {
+    std::shared_ptr<Shared> state = state_;
+    const int32_t broker = p.broker;
+    const size_t reserved = p.reserved;
+    std::shared_ptr<Sent> sent = std::make_shared<Sent>(std::move(p.sent));
+    p.conn->send(p.request, [this, state, broker, reserved, sent](int error, buffer::reader & body) {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->alive)
+          return;
+        ++state->callbacks;
+      }
+      received(broker, reserved, *sent, error, body);
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (--state->callbacks == 0)
+        state->idle.notify_all();
+    });
+  }
+
+  // A response (or failure) for the fetch that carried 'sent'.
+  void received(int32_t broker, size_t reserved, const Sent & sent, int error, buffer::reader & body)
+  {
+    FetchBatch batch;
+    batch.broker = broker;
+    batch.bytes = body.remaining();
+    if (!error)
+    {
+      const uint64_t start = metrics::now();
+      std::shared_ptr<std::vector<uint8_t>> frame = std::make_shared<std::vector<uint8_t>>(body.cursor, body.end);
+      batch.response = decode_view<FetchResponseView>(frame);
+      if (batch.response.ok)
+        metrics::decoded(batch.response.message, batch.bytes, metrics::now() - start);
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      used_ -= std::min(used_, reserved);
+      Broker & b = brokers_[broker];
+      bool keep = !error && batch.response.ok && advance(batch.response.message, sent);
+      for (auto itor = sent.begin(); itor != sent.end(); ++itor)
+      {
+        auto found = partitions_.find(itor->first);
+        if (found != partitions_.end() && found->second.sent_generation == itor->second)
+          found->second.in_flight = false;
+      }
+      if (keep)
+      {
+        used_ += batch.bytes;
+        ready_.push_back(std::move(batch));
+        state_->ready.notify_one();
+      }
+      else if (b.batches)
+        --b.batches;
+      if (error || !batch.response.ok)
+        return;  // retried by the next poll() or release()
+    }
+    fill();
+  }
+
+  /*
+   * advance
+   * Move each partition past its complete messages and drop partitions
+   * that were reassigned meanwhile, or that this fetch did not carry at
+   * their current generation. True if anything is left to deliver.
+   */
+  bool advance(FetchResponseView & response, const Sent & sent)
+  {
+    bool deliver = false;
+    std::vector<FetchResponseView::TopicsT> & topics = response.Topics.contents;
+    for (auto t = topics.begin(); t != topics.end(); ++t)
+    {
+      const std::string topic(reinterpret_cast<const char *>(t->TopicName.data), t->TopicName.size);
+      std::vector<FetchResponseView::PartitionsT> & parts = t->Partitions.contents;
+      for (auto p = parts.begin(); p != parts.end(); )
+      {
+        const Key key(topic, p->Partition.value);
+        auto found = partitions_.find(key);
+        auto carried = sent.find(key);
+        if (found == partitions_.end() || carried == sent.end() || !found->second.in_flight ||
+            found->second.sent_generation != carried->second ||
+            found->second.sent_generation != found->second.generation)
+        {
+          p = parts.erase(p);
+          continue;
+        }
+        const int64_t next = p->ErrorCode.value == Error::NoError ?
+          p->MessageSet.next_offset(found->second.offset) : found->second.offset;
+        if (next != found->second.offset || p->ErrorCode.value != Error::NoError)
+          deliver = true;
+        found->second.offset = next;
+        ++p;
+      }
+    }
+    return deliver;
+  }
+
+  // Remove 'key' from the batches waiting for poll(); state_->mutex held.
+  void drop_ready(const Key & key)
+  {
+    for (auto batch = ready_.begin(); batch != ready_.end(); )
+    {
+      bool empty = true;
+      std::vector<FetchResponseView::TopicsT> & topics = batch->response->Topics.contents;
+      for (auto t = topics.begin(); t != topics.end(); ++t)
+      {
+        std::vector<FetchResponseView::PartitionsT> & parts = t->Partitions.contents;
+        if (key.first.size() == t->TopicName.size &&
+            std::equal(key.first.begin(), key.first.end(), t->TopicName.data))
+          for (auto p = parts.begin(); p != parts.end(); )
+            p = p->Partition.value == key.second ? parts.erase(p) : p + 1;
+        if (!parts.empty())
+          empty = false;
+      }
+      if (!empty)
+      {
+        ++batch;
+        continue;
+      }
+      used_ -= std::min(used_, batch->bytes);
+      Broker & broker = brokers_[batch->broker];
+      if (broker.batches)
+        --broker.batches;
+      batch = ready_.erase(batch);
+    }
+  }
+
+  Config config_;
+  LeaderFn leader_;
+  ConnectionFn connection_;
+  std::shared_ptr<Shared> state_;
+  std::map<Key, Partition> partitions_;
+  std::map<int32_t, Broker> brokers_;
+  std::deque<FetchBatch> ready_;
+  size_t used_;
+  uint64_t generations_;
+  bool closed_;
+};
+
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KPP_CRC32_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+
+namespace crc {
+
+/*
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) as used by the
+ * Message Crc field. All entry points follow the zlib convention: start
+ * from 0 and feed the previous result back in to continue a running CRC.
+ */
+
+namespace {
+
+  const uint32_t polynomial = 0xEDB88320;
+
+  /*
+   * tables
+   * Slicing-by-8 lookup tables; t[0] is the plain bytewise table.
+   */
+  struct tables_t {
+    uint32_t t[8][256];
+
+    tables_t() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+          c = c & 1 ? (c >> 1) ^ polynomial : c >> 1;
+        t[0][i] = c;
+      }
+      for (uint32_t i = 0; i < 256; ++i)
+        for (int k = 1; k < 8; ++k)
+          t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+    }
+  };
+
+  inline const tables_t & tables() {
+    static const tables_t instance;
+    return instance;
+  }
+
+  /*
+   * The *_raw functions work on the un-inverted CRC register.
+   */
+  inline uint32_t bytewise_raw(uint32_t c, const uint8_t * p, size_t n) {
+    const uint32_t (&t)[256] = tables().t[0];
+    while (n--)
+      c = t[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c;
+  }
+
+  inline uint32_t slicing8_raw(uint32_t c, const uint8_t * p, size_t n) {
+    const uint32_t (&t)[8][256] = tables().t;
+    while (n >= 8) {
+      uint32_t one = c ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+      uint32_t two = uint32_t(p[4]) | uint32_t(p[5]) << 8 | uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+      c = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+          t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+      p += 8;
+      n -= 8;
+    }
+    return bytewise_raw(c, p, n);
+  }
+
+#ifdef KPP_CRC32_PCLMUL
+  /*
+   * pclmul_fold
+   * Carry-less multiply folding ("Fast CRC Computation for Generic
+   * Polynomials Using PCLMULQDQ", Gopal et al.). Needs n >= 64 and n a
+   * multiple of 16; uses no lookup tables.
+   */
+  __attribute__((target("pclmul,sse4.1")))
+  inline uint32_t pclmul_fold(uint32_t c, const uint8_t * p, size_t n) {
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+    p += 64;
+    n -= 64;
+
+    // Four lanes of 128 bits, folded 64 bytes at a time.
+    while (n >= 64) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30)));
+      p += 64;
+      n -= 64;
+    }
+
+    // Fold the four lanes into one.
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+      x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+      p += 16;
+      n -= 16;
+    }
+
+    // 128 -> 64 bits.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+  }
+
+  inline uint32_t pclmul_raw(uint32_t c, const uint8_t * p, size_t n) {
+    if (n >= 64) {
+      size_t folded = n & ~size_t(15);
+      c = pclmul_fold(c, p, folded);
+      p += folded;
+      n -= folded;
+    }
+    return slicing8_raw(c, p, n);
+  }
+#endif
+
+  using raw_fn = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+  inline raw_fn select_raw() {
+#ifdef KPP_CRC32_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+      return pclmul_raw;
+#endif
+    return slicing8_raw;
+  }
+}
+
+/*
+ * bytewise
+ * Reference one-table, one-byte-per-step CRC.
+ */
+inline uint32_t bytewise(uint32_t crc, const void * data, size_t n) {
+  return ~bytewise_raw(~crc, static_cast<const uint8_t *>(data), n);
+}
+
+/*
+ * slicing8
+ * Portable fallback, eight bytes per step.
+ */
+inline uint32_t slicing8(uint32_t crc, const void * data, size_t n) {
+  return ~slicing8_raw(~crc, static_cast<const uint8_t *>(data), n);
+}
+
+/*
+ * accelerated
+ * True when update() runs on the PCLMULQDQ folding path.
+ */
+inline bool accelerated() {
+#ifdef KPP_CRC32_PCLMUL
+  static const bool yes = select_raw() == pclmul_raw;
+  return yes;
+#else
+  return false;
+#endif
+}
+
+/*
+ * update
+ * Fastest implementation for this CPU, chosen once on first use.
+ */
+inline uint32_t update(uint32_t crc, const void * data, size_t n) {
+  static const raw_fn impl = select_raw();
+  return ~impl(~crc, static_cast<const uint8_t *>(data), n);
+}
+
+}
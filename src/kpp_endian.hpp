@@ -1,4 +1,14 @@
+#pragma once
+
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KPP_ENDIAN_SIMD 1
+#include <immintrin.h>
+#endif
 
 
 namespace endian {
@@ -100,26 +110,193 @@ namespace {
       return reverse_words_impl(val, sizeof(T));
     }
 
-  static inline bool is_big_endian() {
-    const uint16_t endianness = 256;
-    return *reinterpret_cast<const uint8_t *>(&endianness);
-  }
+  template<typename T>
+    constexpr T reverse_any(T val) {
+      return static_cast<T>(reverse(static_cast<typename std::make_unsigned<T>::type>(val)));
+    }
 } 
 
+/*
+ * big_endian
+ * Host byte order, known at compile time.
+ */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+constexpr bool big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+#else
+constexpr bool big_endian = false;
+#endif
+
+/*
+ * byteswap
+ * Reverse the bytes of an integer; one bswap/rev instruction where the
+ * compiler has the builtin, the constexpr byte shuffle otherwise.
+ */
+#if defined(__GNUC__)
+constexpr uint8_t byteswap_u(uint8_t v) { return v; }
+constexpr uint16_t byteswap_u(uint16_t v) { return __builtin_bswap16(v); }
+constexpr uint32_t byteswap_u(uint32_t v) { return __builtin_bswap32(v); }
+constexpr uint64_t byteswap_u(uint64_t v) { return __builtin_bswap64(v); }
+
+template<typename T>
+constexpr T byteswap(T val) {
+  return static_cast<T>(byteswap_u(static_cast<typename std::make_unsigned<T>::type>(val)));
+}
+#else
+template<typename T>
+constexpr T byteswap(T val) {
+  return reverse_any(val);
+}
+#endif
+
+template<typename T>
+constexpr T hton(T val) {
+  return big_endian ? val : byteswap(val);
+}
+
+template<typename T>
+constexpr T ntoh(T val) {
+  return big_endian ? val : byteswap(val);
+}
+
+/*
+ * load_be, store_be
+ * Read or write a big-endian T at any address.
+ */
+template<typename T>
+inline T load_be(const void * p) {
+  T val;
+  std::memcpy(&val, p, sizeof val);
+  return ntoh(val);
+}
+
+template<typename T>
+inline void store_be(void * p, T val) {
+  val = hton(val);
+  std::memcpy(p, &val, sizeof val);
+}
+
+namespace {
+
+  /*
+   * swap_n kernels
+   * Byte-reverse 'n' elements of W bytes from 'src' to 'dst'. Any alignment;
+   * dst == src converts in place.
+   */
+  template<size_t W> struct uint_of;
+  template<> struct uint_of<2> { using type = uint16_t; };
+  template<> struct uint_of<4> { using type = uint32_t; };
+  template<> struct uint_of<8> { using type = uint64_t; };
+
+  template<size_t W>
+    inline void swap_n_scalar(uint8_t * dst, const uint8_t * src, size_t n) {
+      using U = typename uint_of<W>::type;
+      for (size_t i = 0; i < n; ++i) {
+        U v;
+        std::memcpy(&v, src + i * W, W);
+        v = byteswap(v);
+        std::memcpy(dst + i * W, &v, W);
+      }
+    }
+
+#ifdef KPP_ENDIAN_SIMD
+  // pshufb control reversing each W-byte group of a 16-byte lane.
+  template<size_t W>
+    inline __m128i lane_mask() {
+      alignas(16) uint8_t m[16];
+      for (int i = 0; i < 16; ++i)
+        m[i] = static_cast<uint8_t>(i - i % W + (W - 1 - i % W));
+      return _mm_load_si128(reinterpret_cast<const __m128i *>(m));
+    }
+
+  template<size_t W>
+    __attribute__((target("ssse3")))
+    inline void swap_n_ssse3(uint8_t * dst, const uint8_t * src, size_t n) {
+      const __m128i mask = lane_mask<W>();
+      size_t bytes = n * W, i = 0;
+      for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_shuffle_epi8(v, mask));
+      }
+      swap_n_scalar<W>(dst + i, src + i, (bytes - i) / W);
+    }
+
+  template<size_t W>
+    __attribute__((target("avx2")))
+    inline void swap_n_avx2(uint8_t * dst, const uint8_t * src, size_t n) {
+      const __m256i mask = _mm256_broadcastsi128_si256(lane_mask<W>());
+      size_t bytes = n * W, i = 0;
+      for (; i + 64 <= bytes; i += 64) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), _mm256_shuffle_epi8(b, mask));
+      }
+      for (; i + 32 <= bytes; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_shuffle_epi8(a, mask));
+      }
+      swap_n_scalar<W>(dst + i, src + i, (bytes - i) / W);
+    }
+#endif
+
+  template<size_t W>
+    struct swap_n_impl {
+      using fn = void (*)(uint8_t *, const uint8_t *, size_t);
+
+      static fn select() {
+#ifdef KPP_ENDIAN_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+          return swap_n_avx2<W>;
+        if (__builtin_cpu_supports("ssse3"))
+          return swap_n_ssse3<W>;
+#endif
+        return swap_n_scalar<W>;
+      }
+
+      static void run(uint8_t * dst, const uint8_t * src, size_t n) {
+        static const fn impl = select();
+        // Short arrays are not worth the indirect call.
+        if (n * W < 32)
+          swap_n_scalar<W>(dst, src, n);
+        else
+          impl(dst, src, n);
+      }
+    };
+
+  template<size_t W>
+    inline void convert_n(void * dst, const void * src, size_t n) {
+      if (big_endian) {
+        if (dst != src)
+          std::memmove(dst, src, n * W);
+        return;
+      }
+      swap_n_impl<W>::run(static_cast<uint8_t *>(dst), static_cast<const uint8_t *>(src), n);
+    }
+}
+
+/*
+ * ntoh_n, hton_n
+ * Convert 'n' integers at once between wire (big-endian) and host order,
+ * with AVX2 or SSSE3 shuffles when the CPU has them. Either side may be
+ * unaligned, and 'dst' may equal 'src'; other overlaps are not allowed.
+ */
 template<typename T>
-inline T hton(T val) {
-if (is_big_endian())
-  return val;
-else
-  return reverse(val);
+inline void ntoh_n(T * dst, const void * src, size_t n) {
+  static_assert(std::is_integral<T>::value, "ntoh_n converts integers");
+  if (sizeof(T) == 1)
+    std::memmove(dst, src, n);
+  else
+    convert_n<sizeof(T) == 1 ? 2 : sizeof(T)>(dst, src, n);
 }
 
 template<typename T>
-inline T ntoh(T val) {
-if (is_big_endian())
-  return val;
-else
-  return reverse(val);
+inline void hton_n(void * dst, const T * src, size_t n) {
+  static_assert(std::is_integral<T>::value, "hton_n converts integers");
+  if (sizeof(T) == 1)
+    std::memmove(dst, src, n);
+  else
+    convert_n<sizeof(T) == 1 ? 2 : sizeof(T)>(dst, src, n);
 }
 
 }
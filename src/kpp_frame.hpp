@@ -0,0 +1,122 @@
+#pragma once
+
+#include <kpp_endian.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+
+namespace kpp {
+
+/*
+ * FrameAssembler
+ * Splits a byte stream of 'Size (RequestMessage | ResponseMessage)' frames
+ * as it arrives in arbitrary chunks, e.g. straight from recv().
+ *
+ * feed() calls on_frame(const uint8_t * body, size_t size) for each
+ * complete frame, with 'body' just past the Size prefix. A frame that lies
+ * whole inside the chunk is handed out in place; only a frame straddling a
+ * chunk boundary is gathered into an internal buffer, which keeps its
+ * capacity between frames. Either way 'body' is only valid during the call.
+ */
+class FrameAssembler {
+public:
+  static const size_t default_max_frame_size = 100 << 20;
+
+  explicit FrameAssembler(size_t max_frame_size = default_max_frame_size)
+    : max_frame_size_(max_frame_size), failed_(false) { }
+
+  /*
+   * feed
+   * Consume 'n' bytes. Returns false, now and on every later call, once a
+   * Size prefix is negative or larger than max_frame_size.
+   */
+  template <typename Fn>
+  bool feed(const uint8_t * data, size_t n, Fn && on_frame)
+  {
+    if (failed_)
+      return false;
+
+    if (!partial_.empty())
+    {
+      if (partial_.size() < sizeof(int32_t))
+      {
+        size_t take = std::min(sizeof(int32_t) - partial_.size(), n);
+        partial_.insert(partial_.end(), data, data + take);
+        data += take;
+        n -= take;
+        if (partial_.size() < sizeof(int32_t))
+          return true;
+        if (!valid(frame_size(partial_.data())))
+          return fail();
+        partial_.reserve(sizeof(int32_t) + frame_size(partial_.data()));
+      }
+      size_t want = sizeof(int32_t) + frame_size(partial_.data()) - partial_.size();
+      size_t take = std::min(want, n);
+      partial_.insert(partial_.end(), data, data + take);
+      data += take;
+      n -= take;
+      if (take < want)
+        return true;
+      on_frame(partial_.data() + sizeof(int32_t), partial_.size() - sizeof(int32_t));
+      partial_.clear();
+    }
+
+    while (n >= sizeof(int32_t))
+    {
+      int32_t size = frame_size(data);
+      if (!valid(size))
+        return fail();
+      if (n - sizeof(int32_t) < static_cast<size_t>(size))
+      {
+        partial_.reserve(sizeof(int32_t) + size);
+        break;
+      }
+      on_frame(data + sizeof(int32_t), static_cast<size_t>(size));
+      data += sizeof(int32_t) + size;
+      n -= sizeof(int32_t) + size;
+    }
+    partial_.insert(partial_.end(), data, data + n);
+    return true;
+  }
+
+  // Bytes held back waiting for the rest of their frame.
+  size_t buffered() const { return partial_.size(); }
+
+  bool failed() const { return failed_; }
+
+  // Drop any partial frame and the failed state, e.g. after a reconnect.
+  void reset()
+  {
+    partial_.clear();
+    failed_ = false;
+  }
+
+private:
+  static int32_t frame_size(const uint8_t * p)
+  {
+    int32_t size;
+    std::memcpy(&size, p, sizeof size);
+    return endian::ntoh(size);
+  }
+
+  bool valid(int32_t size) const
+  {
+    return size >= 0 && static_cast<size_t>(size) <= max_frame_size_;
+  }
+
+  bool fail()
+  {
+    failed_ = true;
+    partial_.clear();
+    return false;
+  }
+
+  size_t max_frame_size_;
+  bool failed_;
+  std::vector<uint8_t> partial_;
+};
+
+}
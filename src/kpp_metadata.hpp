@@ -0,0 +1,353 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstring>
+
+
+namespace kpp {
+
+/*
+ * MetadataCache
+ * Client-side view of cluster metadata, flattened for the send path into
+ * an open-addressing hash table from (topic, partition) to leader. The
+ * table lives in a snapshot whose layout never changes; update() builds a
+ * new one and swaps it in, while invalidate() only stores -1 into the
+ * partition's slot of the current one. leader() and partitions() never
+ * take a lock or touch a std::map: a lookup is one FNV-1a hash of the
+ * topic, a probe or two and a memcmp.
+ *
+ * Refresh is incremental. update() replaces only the topics a response
+ * carries and keeps the rest. on_error() reacts to NotLeaderForPartition
+ * and LeaderNotAvailable by dropping that partition's leader (leader()
+ * returns -1, so the Accumulator holds its messages back) and marking the
+ * topic stale; refresh_request() asks for just the stale topics.
+ *
+ * Reads are safe from any thread. Writers serialise on a mutex and retire
+ * the old snapshot only after every reader that could still see it has
+ * finished. Readers announce themselves in one of 'reader_shards' pairs
+ * of epoch counters, each on its own cache line and picked per thread, so
+ * concurrent lookups from different threads do not contend on one line.
+ */
+class MetadataCache {
+public:
+  struct Broker {
+    int32_t node_id;
+    std::string host;
+    int32_t port;
+  };
+
+  MetadataCache() : current_(new Snapshot()), epoch_(0) { }
+
+  MetadataCache(const MetadataCache &) = delete;
+  MetadataCache & operator = (const MetadataCache &) = delete;
+
+  ~MetadataCache() { delete current_.load(); }
+
+  static uint64_t hash(const uint8_t * data, size_t size)
+  {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i)
+      h = (h ^ data[i]) * 1099511628211ULL;
+    return h;
+  }
+
+  /*
+   * leader
+   * Node id leading 'partition' of 'topic', or -1 when it is unknown, has
+   * no leader or was invalidated.
+   */
+  int32_t leader(const uint8_t * topic, size_t size, int32_t partition) const
+  {
+    read_guard guard(*this);
+    const std::atomic<int32_t> * value = guard.snapshot->find(hash(topic, size), topic, size, partition);
+    return value ? value->load(std::memory_order_relaxed) : -1;
+  }
+  int32_t leader(const std::string & topic, int32_t partition) const
+  {
+    return leader(reinterpret_cast<const uint8_t *>(topic.data()), topic.size(), partition);
+  }
+
+  // Number of partitions of 'topic', or 0 when it is unknown.
+  int32_t partitions(const uint8_t * topic, size_t size) const
+  {
+    read_guard guard(*this);
+    const std::atomic<int32_t> * value = guard.snapshot->find(hash(topic, size), topic, size, count_slot);
+    return value ? value->load(std::memory_order_relaxed) : 0;
+  }
+  int32_t partitions(const std::string & topic) const
+  {
+    return partitions(reinterpret_cast<const uint8_t *>(topic.data()), topic.size());
+  }
+
+  // Address of broker 'node_id'; false when it is unknown.
+  bool broker(int32_t node_id, Broker & out) const
+  {
+    read_guard guard(*this);
+    const std::vector<Broker> & brokers = guard.snapshot->brokers;
+    for (auto itor = brokers.begin(); itor != brokers.end(); ++itor)
+      if (itor->node_id == node_id)
+      {
+        out = *itor;
+        return true;
+      }
+    return false;
+  }
+
+  /*
+   * update
+   * Merge a MetadataResponse: its brokers are added or replaced, and each
+   * topic it carries replaces what was known about that topic. A topic
+   * that came back with an error is kept stale.
+   */
+  template <typename S>
+  void update(const basic_MetadataResponse<S> & response)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto b = response.Brokers.contents.begin(); b != response.Brokers.contents.end(); ++b)
+    {
+      Broker & broker = brokers_[b->NodeId.value];
+      broker.node_id = b->NodeId.value;
+      broker.host = text(b->Host);
+      broker.port = b->Port.value;
+    }
+    for (auto t = response.TopicMetadata.contents.begin(); t != response.TopicMetadata.contents.end(); ++t)
+    {
+      const std::string name = text(t->TopicName);
+      std::vector<int32_t> & leaders = topics_[name];
+      leaders.clear();
+      for (auto p = t->PartitionMetadata.contents.begin(); p != t->PartitionMetadata.contents.end(); ++p)
+      {
+        const int32_t id = p->PartitionId.value;
+        if (id < 0)
+          continue;
+        if (static_cast<size_t>(id) >= leaders.size())
+          leaders.resize(id + 1, -1);
+        leaders[id] = p->PartitionErrorCode.value == Error::LeaderNotAvailable ? -1 : p->Leader.value;
+      }
+      if (t->TopicErrorCode.value == Error::NoError && !leaders.empty())
+        stale_.erase(name);
+      else
+        stale_.insert(name);
+    }
+    publish();
+  }
+
+  /*
+   * on_error
+   * Feed a per-partition error from a Produce or Fetch response. Leader
+   * errors invalidate the partition and return true; the caller should
+   * then send refresh_request().
+   */
+  bool on_error(const std::string & topic, int32_t partition, Error::Type error)
+  {
+    if (error != Error::NotLeaderForPartition && error != Error::LeaderNotAvailable)
+      return false;
+    invalidate(topic, partition);
+    return true;
+  }
+
+  // Forget the leader of one partition and mark its topic stale.
+  void invalidate(const std::string & topic, int32_t partition)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stale_.insert(topic);
+    auto found = topics_.find(topic);
+    if (found == topics_.end() || partition < 0 || static_cast<size_t>(partition) >= found->second.size() ||
+        found->second[partition] < 0)
+      return;
+    found->second[partition] = -1;
+    // The slot is there, since the snapshot mirrors topics_; no rebuild needed.
+    const uint8_t * name = reinterpret_cast<const uint8_t *>(topic.data());
+    std::atomic<int32_t> * value = current_.load()->find(hash(name, topic.size()), name, topic.size(), partition);
+    if (value)
+      value->store(-1, std::memory_order_relaxed);
+  }
+
+  // Ask for metadata on 'topic' with the next refresh_request().
+  void track(const std::string & topic)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!topics_.count(topic))
+      stale_.insert(topic);
+  }
+
+  bool needs_refresh() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !stale_.empty();
+  }
+
+  // A MetadataRequest for every stale topic; empty when nothing is stale.
+  MetadataRequest refresh_request() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    MetadataRequest request;
+    for (auto itor = stale_.begin(); itor != stale_.end(); ++itor)
+    {
+      request.Topics.contents.emplace_back();
+      request.Topics.contents.back().bytes.assign(itor->begin(), itor->end());
+    }
+    return request;
+  }
+
+private:
+  // partitions() keeps a topic's partition count under this partition.
+  static const int32_t count_slot = -1;
+  static const size_t reader_shards = 16;
+
+  struct Slot {
+    uint64_t hash;
+    uint32_t topic;       // index into Snapshot::topics, npos when empty
+    int32_t partition;
+  };
+
+  struct Snapshot {
+    static const uint32_t npos = ~uint32_t(0);
+
+    std::vector<std::string> topics;
+    std::vector<Slot> slots;
+    // Leader, or the partition count in count_slot, of each slot. Atomic
+    // so invalidate() can clear a leader in place.
+    std::unique_ptr<std::atomic<int32_t>[]> values;
+    size_t mask;
+    std::vector<Broker> brokers;
+
+    Snapshot() : mask(0) { }
+
+    static size_t probe(uint64_t hash, int32_t partition)
+    {
+      uint64_t h = hash ^ (static_cast<uint64_t>(static_cast<uint32_t>(partition)) * 0x9E3779B97F4A7C15ULL);
+      return static_cast<size_t>(h ^ (h >> 29));
+    }
+
+    std::atomic<int32_t> * find(uint64_t hash, const uint8_t * topic, size_t size, int32_t partition) const
+    {
+      if (slots.empty())
+        return nullptr;
+      for (size_t i = probe(hash, partition) & mask; ; i = (i + 1) & mask)
+      {
+        const Slot & slot = slots[i];
+        if (slot.topic == npos)
+          return nullptr;
+        if (slot.hash == hash && slot.partition == partition)
+        {
+          const std::string & name = topics[slot.topic];
+          if (name.size() == size && std::memcmp(name.data(), topic, size) == 0)
+            return &values[i];
+        }
+      }
+    }
+
+    void insert(uint64_t hash, uint32_t topic, int32_t partition, int32_t value)
+    {
+      size_t i = probe(hash, partition) & mask;
+      while (slots[i].topic != npos)
+        i = (i + 1) & mask;
+      slots[i] = Slot{hash, topic, partition};
+      values[i].store(value, std::memory_order_relaxed);
+    }
+  };
+
+  // Reader counts of one shard, for each parity of epoch_.
+  struct alignas(64) ReaderShard {
+    std::atomic<size_t> readers[2];
+
+    ReaderShard() { readers[0] = 0; readers[1] = 0; }
+  };
+
+  // Shard of the calling thread; threads are dealt out round-robin.
+  static size_t reader_shard()
+  {
+    static std::atomic<size_t> next(0);
+    static thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % reader_shards;
+    return shard;
+  }
+
+  // Pins the current snapshot for the lifetime of the guard.
+  struct read_guard {
+    const MetadataCache & cache;
+    std::atomic<size_t> * counter;
+    const Snapshot * snapshot;
+
+    explicit read_guard(const MetadataCache & c) : cache(c)
+    {
+      ReaderShard & shard = cache.shards_[reader_shard()];
+      for (;;)
+      {
+        const size_t epoch = cache.epoch_.load();
+        counter = &shard.readers[epoch & 1];
+        counter->fetch_add(1);
+        if (cache.epoch_.load() == epoch)
+          break;
+        counter->fetch_sub(1);
+      }
+      snapshot = cache.current_.load();
+    }
+    ~read_guard() { counter->fetch_sub(1, std::memory_order_release); }
+  };
+
+  static std::string text(const StringView & s)
+  {
+    return std::string(reinterpret_cast<const char *>(s.data), s.size);
+  }
+  template <typename Alloc>
+  static std::string text(const basic_String<Alloc> & s)
+  {
+    return std::string(s.bytes.begin(), s.bytes.end());
+  }
+
+  // Build a snapshot from topics_ and brokers_ and swap it in; mutex_ held.
+  void publish()
+  {
+    Snapshot * next = new Snapshot();
+    size_t entries = 0;
+    for (auto t = topics_.begin(); t != topics_.end(); ++t)
+      entries += t->second.size() + 1;
+    size_t capacity = 16;
+    while (capacity < 2 * entries)
+      capacity *= 2;
+    next->slots.assign(capacity, Slot{0, Snapshot::npos, 0});
+    next->values.reset(new std::atomic<int32_t>[capacity]);
+    next->mask = capacity - 1;
+    next->topics.reserve(topics_.size());
+    for (auto t = topics_.begin(); t != topics_.end(); ++t)
+    {
+      const uint32_t index = static_cast<uint32_t>(next->topics.size());
+      next->topics.push_back(t->first);
+      const uint64_t h = hash(reinterpret_cast<const uint8_t *>(t->first.data()), t->first.size());
+      next->insert(h, index, count_slot, static_cast<int32_t>(t->second.size()));
+      for (size_t p = 0; p < t->second.size(); ++p)
+        next->insert(h, index, static_cast<int32_t>(p), t->second[p]);
+    }
+    for (auto b = brokers_.begin(); b != brokers_.end(); ++b)
+      next->brokers.push_back(b->second);
+
+    const Snapshot * previous = current_.exchange(next);
+    // Readers that started before the flip may still hold 'previous'.
+    const size_t epoch = epoch_.fetch_add(1);
+    for (size_t i = 0; i < reader_shards; ++i)
+      while (shards_[i].readers[epoch & 1].load() != 0)
+        std::this_thread::yield();
+    delete previous;
+  }
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::vector<int32_t>> topics_;
+  std::map<int32_t, Broker> brokers_;
+  std::set<std::string> stale_;
+
+  std::atomic<const Snapshot *> current_;
+  mutable std::atomic<size_t> epoch_;
+  mutable ReaderShard shards_[reader_shards];
+};
+
+}
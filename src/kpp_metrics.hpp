@@ -0,0 +1,446 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+namespace kpp {
+namespace metrics {
+
+/*
+ * Library metrics, per ApiKey: requests and bytes encoded, responses and
+ * bytes decoded, time spent encoding and decoding, round-trip latency,
+ * transport failures, and response error codes by Error::Type.
+ *
+ * Everything sent through a Connection is counted as encoded, round trip
+ * or failure, but responses are decoded, and so counted with their error
+ * codes, only by Connection::call(), Consumer and OffsetCommitter. A
+ * Connection::send() caller decodes the body itself and gets no decode
+ * metrics unless it calls decoded() on its own.
+ *
+ * Every thread records into its own shard, with relaxed loads and stores
+ * and no read-modify-write, so recording never contends; snapshot() sums
+ * the shards of live threads and of threads that have exited. Times go
+ * into log-bucketed histograms: exact below 16 ns, then four buckets per
+ * power of two, so a percentile is within 25% of the true value.
+ *
+ * Everything here, including the clock reads at the call sites, compiles
+ * away unless KPP_WITH_METRICS is defined; snapshot() is then all zeros.
+ */
+#ifdef KPP_WITH_METRICS
+const bool enabled = true;
+#else
+const bool enabled = false;
+#endif
+
+// ApiKey values are below 'apis'. Error codes below 'errors' get a slot
+// each, Error::Unknown gets 'unknown_error', and any other code, past the
+// known ones or negative, is counted in 'other_error'.
+const size_t apis = 16;
+const size_t errors = 32;
+const size_t unknown_error = errors;
+const size_t other_error = errors + 1;
+const size_t error_slots = errors + 2;
+
+inline size_t error_slot(Error::Type code)
+{
+  if (code == Error::Unknown)
+    return unknown_error;
+  return code >= 0 && static_cast<size_t>(code) < errors ? static_cast<size_t>(code) : other_error;
+}
+
+// "0" .. "31", "unknown" or "other".
+inline std::string error_name(size_t slot)
+{
+  if (slot < errors)
+    return std::to_string(slot);
+  return slot == unknown_error ? "unknown" : "other";
+}
+
+/*
+ * Histogram
+ * Counts of nanosecond values in log-linear buckets.
+ */
+struct Histogram {
+  static const size_t exact = 16;
+  static const size_t buckets = exact + 60 * 4;
+
+  std::array<uint64_t, buckets> counts;
+
+  Histogram() { counts.fill(0); }
+
+  static size_t bucket(uint64_t ns)
+  {
+    if (ns < exact)
+      return static_cast<size_t>(ns);
+    const int e = 63 - __builtin_clzll(ns);
+    return exact + (e - 4) * 4 + ((ns >> (e - 2)) & 3);
+  }
+
+  // Smallest value that lands in bucket 'b'.
+  static uint64_t lower(size_t b)
+  {
+    if (b < exact)
+      return b;
+    const size_t e = (b - exact) / 4 + 4;
+    return (uint64_t(4) | ((b - exact) & 3)) << (e - 2);
+  }
+
+  uint64_t count() const
+  {
+    uint64_t n = 0;
+    for (size_t b = 0; b < buckets; ++b)
+      n += counts[b];
+    return n;
+  }
+
+  // Lower bound of the bucket holding quantile 'q' (0..1), 0 when empty.
+  uint64_t percentile(double q) const
+  {
+    const uint64_t n = count();
+    if (n == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(q * (n - 1)) + 1, seen = 0;
+    for (size_t b = 0; b < buckets; ++b)
+      if ((seen += counts[b]) >= rank)
+        return lower(b);
+    return lower(buckets - 1);
+  }
+
+  Histogram & operator += (const Histogram & other)
+  {
+    for (size_t b = 0; b < buckets; ++b)
+      counts[b] += other.counts[b];
+    return *this;
+  }
+};
+
+struct Api {
+  uint64_t requests;
+  uint64_t bytes_encoded;
+  uint64_t responses;
+  uint64_t bytes_decoded;
+  uint64_t failures;
+  std::array<uint64_t, error_slots> error_codes;
+  Histogram encode_ns;
+  Histogram decode_ns;
+  Histogram round_trip_ns;
+
+  Api() : requests(0), bytes_encoded(0), responses(0), bytes_decoded(0), failures(0) { error_codes.fill(0); }
+
+  bool active() const { return requests || responses || failures; }
+};
+
+struct Snapshot {
+  std::array<Api, apis> api;
+};
+
+inline const char * api_name(size_t api)
+{
+  switch (api)
+  {
+    case ApiKey::ProduceRequest: return "Produce";
+    case ApiKey::FetchRequest: return "Fetch";
+    case ApiKey::OffsetRequest: return "Offset";
+    case ApiKey::MetadataRequest: return "Metadata";
+    case ApiKey::OffsetCommitRequest: return "OffsetCommit";
+    case ApiKey::OffsetFetchRequest: return "OffsetFetch";
+    case ApiKey::ConsumerMetadataRequest: return "ConsumerMetadata";
+  }
+  return "Unknown";
+}
+
+// Timestamp for the durations below; 0 when metrics are compiled out.
+inline uint64_t now()
+{
+#ifdef KPP_WITH_METRICS
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+  return 0;
+#endif
+}
+
+#ifdef KPP_WITH_METRICS
+namespace detail {
+
+  // Written by its own thread only; read by snapshot().
+  struct counter {
+    std::atomic<uint64_t> value;
+
+    counter() : value(0) { }
+    void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+  };
+
+  struct histogram {
+    std::array<counter, Histogram::buckets> counts;
+
+    void add(uint64_t ns) { counts[Histogram::bucket(ns)].add(1); }
+    void read(Histogram & out) const
+    {
+      for (size_t b = 0; b < Histogram::buckets; ++b)
+        out.counts[b] += counts[b].get();
+    }
+  };
+
+  struct api_counters {
+    counter requests, bytes_encoded, responses, bytes_decoded, failures;
+    std::array<counter, error_slots> error_codes;
+    histogram encode_ns, decode_ns, round_trip_ns;
+
+    void read(Api & out) const
+    {
+      out.requests += requests.get();
+      out.bytes_encoded += bytes_encoded.get();
+      out.responses += responses.get();
+      out.bytes_decoded += bytes_decoded.get();
+      out.failures += failures.get();
+      for (size_t e = 0; e < error_slots; ++e)
+        out.error_codes[e] += error_codes[e].get();
+      encode_ns.read(out.encode_ns);
+      decode_ns.read(out.decode_ns);
+      round_trip_ns.read(out.round_trip_ns);
+    }
+  };
+
+  struct shard {
+    std::array<api_counters, apis> api;
+  };
+
+  // Shards of live threads, and the totals of threads that have exited.
+  struct registry {
+    std::mutex mutex;
+    std::vector<const shard *> live;
+    Snapshot retired;
+
+    static registry & get()
+    {
+      static registry r;
+      return r;
+    }
+  };
+
+  struct owner {
+    shard * s;
+
+    owner() : s(new shard())
+    {
+      registry & r = registry::get();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.live.push_back(s);
+    }
+    ~owner()
+    {
+      registry & r = registry::get();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      for (size_t a = 0; a < apis; ++a)
+        s->api[a].read(r.retired.api[a]);
+      for (auto itor = r.live.begin(); itor != r.live.end(); ++itor)
+        if (*itor == s)
+        {
+          r.live.erase(itor);
+          break;
+        }
+      delete s;
+    }
+  };
+
+  inline api_counters & local(ApiKey::Type key)
+  {
+    static thread_local owner mine;
+    return mine.s->api[static_cast<size_t>(key) < apis ? key : apis - 1];
+  }
+
+}
+#endif
+
+// A request of 'bytes' encoded in 'ns'.
+inline void encoded(ApiKey::Type api, size_t bytes, uint64_t ns)
+{
+#ifdef KPP_WITH_METRICS
+  detail::api_counters & a = detail::local(api);
+  a.requests.add(1);
+  a.bytes_encoded.add(bytes);
+  a.encode_ns.add(ns);
+#else
+  (void) api; (void) bytes; (void) ns;
+#endif
+}
+
+// A response arrived 'ns' after its request was sent.
+inline void round_trip(ApiKey::Type api, uint64_t ns)
+{
+#ifdef KPP_WITH_METRICS
+  detail::local(api).round_trip_ns.add(ns);
+#else
+  (void) api; (void) ns;
+#endif
+}
+
+// A request that got no response: the connection failed or was closed.
+inline void failed(ApiKey::Type api)
+{
+#ifdef KPP_WITH_METRICS
+  detail::local(api).failures.add(1);
+#else
+  (void) api;
+#endif
+}
+
+inline void error(ApiKey::Type api, Error::Type code)
+{
+#ifdef KPP_WITH_METRICS
+  detail::local(api).error_codes[error_slot(code)].add(1);
+#else
+  (void) api; (void) code;
+#endif
+}
+
+namespace detail {
+
+  /*
+   * error_codes
+   * Every int16 in a v0 response is an error code (ErrorCode,
+   * TopicErrorCode, PartitionErrorCode), so walking the schema for them
+   * finds them all without naming each response.
+   */
+  template <typename T, typename Fn>
+  inline typename std::enable_if<has_schema<T>::value>::type error_codes(const T & value, Fn & fn);
+  template <typename Fn>
+  inline void error_codes(const BE<int16_t> & code, Fn & fn) { fn(code.value); }
+  template <typename T, typename Fn>
+  inline typename std::enable_if<!has_schema<T>::value>::type error_codes(const T &, Fn &) { }
+  template <typename T, typename Alloc, typename Fn>
+  inline void error_codes(const Array<T, Alloc> & arr, Fn & fn)
+  {
+    for (auto itor = arr.contents.begin(); itor != arr.contents.end(); ++itor)
+      error_codes(*itor, fn);
+  }
+  template <typename C, typename Fn>
+  inline void error_fields(fields<>, const C &, Fn &) { }
+  template <typename F, typename... Fs, typename C, typename Fn>
+  inline void error_fields(fields<F, Fs...>, const C & c, Fn & fn)
+  {
+    error_codes(F::get(c), fn);
+    error_fields(fields<Fs...>(), c, fn);
+  }
+  template <typename T, typename Fn>
+  inline typename std::enable_if<has_schema<T>::value>::type error_codes(const T & value, Fn & fn)
+  {
+    error_fields(typename T::schema(), value, fn);
+  }
+
+}
+
+/*
+ * decoded
+ * A response of 'bytes' decoded in 'ns'; its non-zero error codes are
+ * counted too.
+ */
+template <typename Response>
+inline void decoded(const Response & response, size_t bytes, uint64_t ns)
+{
+#ifdef KPP_WITH_METRICS
+  const ApiKey::Type api = api_key<Response>::value;
+  detail::api_counters & a = detail::local(api);
+  a.responses.add(1);
+  a.bytes_decoded.add(bytes);
+  a.decode_ns.add(ns);
+  auto count = [api](int16_t code) {
+    if (code != Error::NoError)
+      error(api, code);
+  };
+  detail::error_codes(response, count);
+#else
+  (void) response; (void) bytes; (void) ns;
+#endif
+}
+
+// Totals over every thread so far.
+inline Snapshot snapshot()
+{
+  Snapshot out;
+#ifdef KPP_WITH_METRICS
+  detail::registry & r = detail::registry::get();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  out = r.retired;
+  for (auto itor = r.live.begin(); itor != r.live.end(); ++itor)
+    for (size_t a = 0; a < apis; ++a)
+      (*itor)->api[a].read(out.api[a]);
+#endif
+  return out;
+}
+
+/*
+ * to_text, to_json
+ * One line per ApiKey that saw traffic; latencies as count and
+ * p50/p99/p999/max in nanoseconds.
+ */
+inline std::string to_text(const Snapshot & s)
+{
+  std::ostringstream out;
+  for (size_t a = 0; a < apis; ++a)
+  {
+    const Api & api = s.api[a];
+    if (!api.active())
+      continue;
+    out << api_name(a) << " requests=" << api.requests << " bytes_encoded=" << api.bytes_encoded
+        << " responses=" << api.responses << " bytes_decoded=" << api.bytes_decoded << " failures=" << api.failures;
+    const Histogram * h[] = { &api.encode_ns, &api.decode_ns, &api.round_trip_ns };
+    const char * names[] = { "encode", "decode", "round_trip" };
+    for (size_t i = 0; i < 3; ++i)
+      out << ' ' << names[i] << "_ns=" << h[i]->percentile(0.5) << '/' << h[i]->percentile(0.99) << '/'
+          << h[i]->percentile(0.999) << '/' << h[i]->percentile(1.0);
+    for (size_t e = 0; e < error_slots; ++e)
+      if (api.error_codes[e])
+        out << " error" << (e < errors ? "" : "_") << error_name(e) << '=' << api.error_codes[e];
+    out << '\n';
+  }
+  return out.str();
+}
+
+inline std::string to_json(const Snapshot & s)
+{
+  std::ostringstream out;
+  out << '{';
+  bool first = true;
+  for (size_t a = 0; a < apis; ++a)
+  {
+    const Api & api = s.api[a];
+    if (!api.active())
+      continue;
+    out << (first ? "" : ",") << '"' << api_name(a) << "\":{\"api_key\":" << a << ",\"requests\":" << api.requests
+        << ",\"bytes_encoded\":" << api.bytes_encoded << ",\"responses\":" << api.responses
+        << ",\"bytes_decoded\":" << api.bytes_decoded << ",\"failures\":" << api.failures;
+    first = false;
+    const Histogram * h[] = { &api.encode_ns, &api.decode_ns, &api.round_trip_ns };
+    const char * names[] = { "encode_ns", "decode_ns", "round_trip_ns" };
+    for (size_t i = 0; i < 3; ++i)
+      out << ",\"" << names[i] << "\":{\"count\":" << h[i]->count() << ",\"p50\":" << h[i]->percentile(0.5)
+          << ",\"p99\":" << h[i]->percentile(0.99) << ",\"p999\":" << h[i]->percentile(0.999)
+          << ",\"max\":" << h[i]->percentile(1.0) << '}';
+    out << ",\"errors\":{";
+    bool first_error = true;
+    for (size_t e = 0; e < error_slots; ++e)
+      if (api.error_codes[e])
+      {
+        out << (first_error ? "" : ",") << '"' << error_name(e) << "\":" << api.error_codes[e];
+        first_error = false;
+      }
+    out << "}}";
+  }
+  out << '}';
+  return out.str();
+}
+
+}
+}
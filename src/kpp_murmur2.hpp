@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KPP_MURMUR2_SIMD 1
+#include <immintrin.h>
+#endif
+
+
+namespace murmur2 {
+
+/*
+ * 32-bit MurmurHash2 exactly as the Java client's Utils.murmur2() computes
+ * it (seed 0x9747b28c, little-endian blocks), so keys hash to the same
+ * partitions from either client.
+ */
+
+namespace {
+
+  const uint32_t seed = 0x9747b28c;
+  const uint32_t m = 0x5bd1e995;
+  const int r = 24;
+
+  inline uint32_t load_le(const uint8_t * p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+  }
+
+  inline uint32_t mix(uint32_t h, uint32_t k) {
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    return (h * m) ^ k;
+  }
+
+  /*
+   * finish
+   * Carry on from 'h' after the first 'done' four-byte blocks of data[0, n):
+   * the remaining blocks, the tail and the final avalanche.
+   */
+  inline uint32_t finish(uint32_t h, const uint8_t * data, size_t n, size_t done) {
+    const size_t blocks = n / 4;
+    for (size_t i = done; i < blocks; ++i)
+      h = mix(h, load_le(data + 4 * i));
+    const uint8_t * tail = data + 4 * blocks;
+    switch (n & 3) {
+      case 3: h ^= uint32_t(tail[2]) << 16;  // fall through
+      case 2: h ^= uint32_t(tail[1]) << 8;   // fall through
+      case 1: h ^= uint32_t(tail[0]);
+              h *= m;
+    }
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+  }
+
+  template <typename Key>
+    inline void hash_n_scalar(const Key * keys, size_t n, uint32_t * out) {
+      for (size_t i = 0; i < n; ++i) {
+        const uint8_t * p = reinterpret_cast<const uint8_t *>(keys[i].data);
+        out[i] = finish(seed ^ static_cast<uint32_t>(keys[i].size), p, keys[i].size, 0);
+      }
+    }
+
+#ifdef KPP_MURMUR2_SIMD
+  /*
+   * hash8_avx2
+   * Eight keys at once, one per 32-bit lane: blocks are gathered straight
+   * from each key, lanes whose key has run out are masked off, and the
+   * tail and final avalanche run vectorized too.
+   */
+  template <typename Key>
+    __attribute__((target("avx2")))
+    inline void hash8_avx2(const Key * keys, uint32_t * out) {
+      const __m256i vm = _mm256_set1_epi32(static_cast<int>(m));
+      alignas(32) int64_t addr[8];
+      alignas(32) int32_t len[8], blocks[8];
+      alignas(32) uint32_t tail[8];
+      int32_t most = 0;
+      for (int lane = 0; lane < 8; ++lane) {
+        const uint8_t * p = reinterpret_cast<const uint8_t *>(keys[lane].data);
+        addr[lane] = reinterpret_cast<intptr_t>(p);
+        len[lane] = static_cast<int32_t>(keys[lane].size);
+        blocks[lane] = len[lane] / 4;
+        most = std::max(most, blocks[lane]);
+        const uint8_t * t = p + 4 * blocks[lane];
+        uint32_t w = 0;
+        switch (len[lane] & 3) {
+          case 3: w ^= uint32_t(t[2]) << 16;  // fall through
+          case 2: w ^= uint32_t(t[1]) << 8;   // fall through
+          case 1: w ^= uint32_t(t[0]);
+        }
+        tail[lane] = w;
+      }
+      const __m256i vlen = _mm256_load_si256(reinterpret_cast<const __m256i *>(len));
+      const __m256i vblocks = _mm256_load_si256(reinterpret_cast<const __m256i *>(blocks));
+      __m256i lo = _mm256_load_si256(reinterpret_cast<const __m256i *>(addr));
+      __m256i hi = _mm256_load_si256(reinterpret_cast<const __m256i *>(addr + 4));
+      const __m256i step = _mm256_set1_epi64x(4);
+      __m256i vh = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(seed)), vlen);
+
+      for (int32_t b = 0; b < most; ++b) {
+        const __m256i active = _mm256_cmpgt_epi32(vblocks, _mm256_set1_epi32(b));
+        const __m128i k_lo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), static_cast<const int *>(nullptr), lo,
+                                                         _mm256_castsi256_si128(active), 1);
+        const __m128i k_hi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), static_cast<const int *>(nullptr), hi,
+                                                         _mm256_extracti128_si256(active, 1), 1);
+        __m256i vk = _mm256_inserti128_si256(_mm256_castsi128_si256(k_lo), k_hi, 1);
+        vk = _mm256_mullo_epi32(vk, vm);
+        vk = _mm256_xor_si256(vk, _mm256_srli_epi32(vk, r));
+        vk = _mm256_mullo_epi32(vk, vm);
+        vh = _mm256_blendv_epi8(vh, _mm256_xor_si256(_mm256_mullo_epi32(vh, vm), vk), active);
+        lo = _mm256_add_epi64(lo, step);
+        hi = _mm256_add_epi64(hi, step);
+      }
+
+      const __m256i has_tail = _mm256_cmpgt_epi32(_mm256_and_si256(vlen, _mm256_set1_epi32(3)), _mm256_setzero_si256());
+      const __m256i vt = _mm256_load_si256(reinterpret_cast<const __m256i *>(tail));
+      vh = _mm256_blendv_epi8(vh, _mm256_mullo_epi32(_mm256_xor_si256(vh, vt), vm), has_tail);
+      vh = _mm256_xor_si256(vh, _mm256_srli_epi32(vh, 13));
+      vh = _mm256_mullo_epi32(vh, vm);
+      vh = _mm256_xor_si256(vh, _mm256_srli_epi32(vh, 15));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), vh);
+    }
+
+  /*
+   * hash_n_avx2
+   * vpmulld's latency makes the lanes lose to the scalar loop, which the
+   * core already overlaps across keys, until keys average about 48 bytes;
+   * groups of shorter keys stay scalar.
+   */
+  const size_t simd_min_bytes = 8 * 48;
+
+  template <typename Key>
+    __attribute__((target("avx2")))
+    inline void hash_n_avx2(const Key * keys, size_t n, uint32_t * out) {
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8) {
+        size_t bytes = 0;
+        for (int lane = 0; lane < 8; ++lane)
+          bytes += keys[i + lane].size;
+        if (bytes >= simd_min_bytes)
+          hash8_avx2(keys + i, out + i);
+        else
+          hash_n_scalar(keys + i, 8, out + i);
+      }
+      hash_n_scalar(keys + i, n - i, out + i);
+    }
+#endif
+}
+
+/*
+ * hash
+ * Utils.murmur2() of data[0, n), as an unsigned value.
+ */
+inline uint32_t hash(const void * data, size_t n) {
+  return finish(seed ^ static_cast<uint32_t>(n), static_cast<const uint8_t *>(data), n, 0);
+}
+
+/*
+ * accelerated
+ * True when hash_n() runs eight lanes at a time.
+ */
+inline bool accelerated() {
+#ifdef KPP_MURMUR2_SIMD
+  static const bool yes = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return yes;
+#else
+  return false;
+#endif
+}
+
+/*
+ * hash_n
+ * out[i] = hash(keys[i].data, keys[i].size) for i < n. Key is anything
+ * with 'data' and 'size' members, such as a kpp::BytesView.
+ */
+template <typename Key>
+inline void hash_n(const Key * keys, size_t n, uint32_t * out) {
+#ifdef KPP_MURMUR2_SIMD
+  if (n >= 8 && accelerated())
+    return hash_n_avx2(keys, n, out);
+#endif
+  hash_n_scalar(keys, n, out);
+}
+
+}
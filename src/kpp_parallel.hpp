@@ -0,0 +1,254 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace kpp {
+
+/*
+ * WorkPool
+ * Fixed set of worker threads, each with its own task deque. A worker
+ * takes from the back of its own deque and, when that is empty, steals
+ * from the front of the others', so a few large tasks do not leave the
+ * rest of the pool idle. parallel_for() spreads its tasks over the deques
+ * and the calling thread works through them too until they are done.
+ */
+class WorkPool {
+public:
+  explicit WorkPool(size_t threads = std::thread::hardware_concurrency())
+    : queues_(threads ? threads : 1), queued_(0), stop_(false), next_(0)
+  {
+    for (size_t i = 0; i < queues_.size(); ++i)
+      workers_.emplace_back([this, i] { work(i); });
+  }
+
+  WorkPool(const WorkPool &) = delete;
+  WorkPool & operator = (const WorkPool &) = delete;
+
+  ~WorkPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto itor = workers_.begin(); itor != workers_.end(); ++itor)
+      itor->join();
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  /*
+   * parallel_for
+   * fn(i) for every i < n, in no particular order and on any thread;
+   * returns when all have run. Safe from several threads at once.
+   */
+  template <typename Fn>
+  void parallel_for(size_t n, Fn && fn)
+  {
+    if (n <= 1)
+    {
+      if (n)
+        fn(0);
+      return;
+    }
+    Job job(fn, n);
+    const size_t first = next_.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i)
+    {
+      Queue & q = queues_[(first + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      q.tasks.push_back(Task{&job, i});
+    }
+    queued_.fetch_add(n);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    wake_.notify_all();
+
+    Task task;
+    while (job.remaining.load() != 0 && take(first % queues_.size(), task))
+      run(task);
+    std::unique_lock<std::mutex> lock(job.mutex);
+    job.done.wait(lock, [&job] { return job.remaining.load() == 0; });
+  }
+
+private:
+  struct Job {
+    std::function<void (size_t)> fn;
+    std::atomic<size_t> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    template <typename Fn>
+    Job(Fn & f, size_t n) : fn(std::ref(f)), remaining(n) { }
+  };
+
+  struct Task {
+    Job * job;
+    size_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // From the back of queue 'self', else from the front of another.
+  bool take(size_t self, Task & out)
+  {
+    for (size_t i = 0; i < queues_.size(); ++i)
+    {
+      Queue & q = queues_[(self + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (q.tasks.empty())
+        continue;
+      if (i == 0)
+      {
+        out = q.tasks.back();
+        q.tasks.pop_back();
+      }
+      else
+      {
+        out = q.tasks.front();
+        q.tasks.pop_front();
+      }
+      queued_.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  /*
+   * run
+   * The count drops under job.mutex: the Job lives on parallel_for's stack,
+   * and once its caller can see zero it may return, so the last touch of
+   * the Job has to be the unlock that lets the caller see it.
+   */
+  static void run(const Task & task)
+  {
+    Job & job = *task.job;
+    job.fn(task.index);
+    std::lock_guard<std::mutex> lock(job.mutex);
+    if (job.remaining.fetch_sub(1) == 1)
+      job.done.notify_all();
+  }
+
+  void work(size_t self)
+  {
+    Task task;
+    for (;;)
+    {
+      if (take(self, task))
+      {
+        run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this] { return stop_ || queued_.load() != 0; });
+      if (stop_)
+        return;
+    }
+  }
+
+  std::vector<Queue> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> queued_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stop_;
+  std::atomic<size_t> next_;
+};
+
+/*
+ * decode_parallel
+ * Decode a response shaped 'Topics [TopicName [Partitions]]' (Fetch,
+ * Produce, Offset, OffsetCommit, OffsetFetch) into its owned form with the
+ * partitions spread over 'pool'. One pass walks the frame with the view
+ * types to find each partition's bytes, which for a fetch only reads the
+ * fixed fields and MessageSetSize; then every partition is decoded, and
+ * its messages CRC-checked, as its own task straight into its slot in
+ * 'out', so the order is that of the frame.
+ */
+template <template <typename> class Response>
+bool decode_parallel(WorkPool & pool, buffer::reader & iBuf, Response<Owned> & out)
+{
+  using PartitionView = typename Response<Borrowed>::PartitionsT;
+  struct Range {
+    size_t topic;
+    size_t partition;
+    const uint8_t * first;
+    const uint8_t * last;
+  };
+  std::vector<Range> ranges;
+
+  BE<int32_t> topics;
+  iBuf >> topics;
+  if (topics.value < 0 || static_cast<size_t>(topics.value) > iBuf.remaining())
+  {
+    set_failed(iBuf);
+    return false;
+  }
+  out.Topics.contents.resize(topics.value);
+  for (size_t t = 0; t < out.Topics.contents.size(); ++t)
+  {
+    auto & topic = out.Topics.contents[t];
+    BE<int32_t> partitions;
+    iBuf >> topic.TopicName >> partitions;
+    if (!iBuf || partitions.value < 0 || static_cast<size_t>(partitions.value) > iBuf.remaining())
+    {
+      set_failed(iBuf);
+      return false;
+    }
+    topic.Partitions.contents.resize(partitions.value);
+    for (size_t p = 0; p < topic.Partitions.contents.size(); ++p)
+    {
+      const uint8_t * first = iBuf.cursor;
+      PartitionView view;
+      iBuf >> view;
+      if (!iBuf)
+        return false;
+      ranges.push_back(Range{t, p, first, iBuf.cursor});
+    }
+  }
+
+  std::atomic<bool> ok(true);
+  pool.parallel_for(ranges.size(), [&](size_t i) {
+    const Range & r = ranges[i];
+    buffer::reader part(r.first, r.last);
+    part >> out.Topics.contents[r.topic].Partitions.contents[r.partition];
+    if (!part || part.remaining() != 0)
+      ok.store(false);
+  });
+  if (!ok.load())
+    set_failed(iBuf);
+  return ok.load();
+}
+
+/*
+ * verify_parallel
+ * LazyMessageSet::verify() of every partition of a FetchResponseView,
+ * spread over 'pool'; the lazy path's counterpart to decode_parallel.
+ */
+inline bool verify_parallel(WorkPool & pool, const FetchResponseView & response)
+{
+  std::vector<const LazyMessageSet *> sets;
+  for (auto t = response.Topics.contents.begin(); t != response.Topics.contents.end(); ++t)
+    for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      sets.push_back(&p->MessageSet);
+  std::atomic<bool> ok(true);
+  pool.parallel_for(sets.size(), [&](size_t i) {
+    if (!sets[i]->verify())
+      ok.store(false);
+  });
+  return ok.load();
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <kpp_producer.hpp>
+#include <kpp_murmur2.hpp>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace kpp {
+
+/*
+ * Partitioner
+ * Chooses partitions the way the Java client does: a message with a key
+ * goes to murmur2(key) & 0x7fffffff modulo the partition count, so keyed
+ * data lands on the same partition from either client; a message without
+ * one (null Key) sticks to one partition for sticky_messages messages,
+ * then moves round-robin to the next, which keeps keyless traffic in few,
+ * large batches.
+ *
+ * assign() routes a whole batch with one hash_n() call, eight keys per
+ * step where AVX2 is available. Not thread-safe: one per producing thread.
+ */
+class Partitioner {
+public:
+  struct Config {
+    size_t sticky_messages;
+
+    Config() : sticky_messages(1024) { }
+  };
+
+  explicit Partitioner(const Config & config = Config())
+    : config_(config), rng_(std::random_device()())
+  {
+    config_.sticky_messages = std::max<size_t>(config_.sticky_messages, 1);
+  }
+
+  static int32_t keyed(uint32_t hash, int32_t partitions)
+  {
+    return static_cast<int32_t>((hash & 0x7fffffff) % static_cast<uint32_t>(partitions));
+  }
+
+  /*
+   * partition
+   * Partition of one message of 'topic', or -1 if 'partitions' is not
+   * positive (topic metadata not known yet).
+   */
+  int32_t partition(const std::string & topic, BytesView key, int32_t partitions)
+  {
+    if (partitions <= 0)
+      return -1;
+    if (key.data)
+      return keyed(murmur2::hash(key.data, key.size), partitions);
+    return next(sticky_state(topic, partitions), partitions);
+  }
+
+  /*
+   * assign
+   * out[i] = partition(topic, keys[i], partitions) for i < n.
+   */
+  void assign(const std::string & topic, const BytesView * keys, size_t n, int32_t partitions, int32_t * out)
+  {
+    if (partitions <= 0)
+    {
+      std::fill(out, out + n, -1);
+      return;
+    }
+    hashes_.resize(n);
+    murmur2::hash_n(keys, n, hashes_.data());
+    Sticky * state = nullptr;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (keys[i].data)
+      {
+        out[i] = keyed(hashes_[i], partitions);
+        continue;
+      }
+      if (!state)
+        state = &sticky_state(topic, partitions);
+      out[i] = next(*state, partitions);
+    }
+  }
+
+  /*
+   * append
+   * Route and append n messages of 'topic' to 'accumulator'. Returns how
+   * many were taken; it stops at the first one the Accumulator refuses
+   * (memory budget exhausted) or at once if 'partitions' is not positive.
+   */
+  size_t append(Accumulator & accumulator, const std::string & topic, const BytesView * keys,
+                const BytesView * values, size_t n, int32_t partitions,
+                Accumulator::clock::time_point now = Accumulator::clock::now())
+  {
+    routes_.resize(n);
+    assign(topic, keys, n, partitions, routes_.data());
+    size_t i = 0;
+    while (i < n && routes_[i] >= 0 && accumulator.append(topic, routes_[i], keys[i], values[i], now))
+      ++i;
+    return i;
+  }
+
+private:
+  struct Sticky {
+    int32_t partition;
+    size_t remaining;
+  };
+
+  Sticky & sticky_state(const std::string & topic, int32_t partitions)
+  {
+    auto found = sticky_.find(topic);
+    if (found == sticky_.end())
+    {
+      Sticky fresh = { static_cast<int32_t>(rng_() % static_cast<uint32_t>(partitions)), config_.sticky_messages };
+      found = sticky_.insert(std::make_pair(topic, fresh)).first;
+    }
+    return found->second;
+  }
+
+  int32_t next(Sticky & state, int32_t partitions)
+  {
+    if (state.remaining == 0)
+    {
+      ++state.partition;
+      state.remaining = config_.sticky_messages;
+    }
+    if (state.partition >= partitions)
+      state.partition %= partitions;
+    --state.remaining;
+    return state.partition;
+  }
+
+  Config config_;
+  std::minstd_rand rng_;
+  std::unordered_map<std::string, Sticky> sticky_;
+  std::vector<uint32_t> hashes_;
+  std::vector<int32_t> routes_;
+};
+
+}
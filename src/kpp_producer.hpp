@@ -0,0 +1,326 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <kpp_compression.hpp>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace kpp {
+
+/*
+ * ProduceBatch
+ * One ProduceRequest for one broker, drained from an Accumulator. The
+ * request's message sets point into 'buffers', so the batch is move-only
+ * in practice and must outlive any encoding of 'request'. Hand it back
+ * with Accumulator::release() once the broker has answered.
+ *
+ * 'uncompressed' counts partitions that went out as plain entries because
+ * the configured codec failed or is not built in.
+ */
+struct ProduceBatch {
+  int32_t broker;
+  ProduceRequestView request;
+  size_t messages;
+  size_t bytes;
+  size_t uncompressed;
+  std::vector<std::vector<uint8_t>> buffers;
+};
+
+/*
+ * Accumulator
+ * Producer-side batching. append() encodes each message straight into the
+ * MessageSet of its topic/partition; drain() turns every batch that is due
+ * into one ProduceRequest per leader broker. A batch is due when it
+ * reaches batch_size bytes, when it is older than linger, or when the
+ * memory budget is exhausted, in which case everything is flushed and
+ * append() refuses new messages until batches are released.
+ *
+ * All members are safe to call from several threads. drain() holds the
+ * lock only to pick and take batches; leader_ and compression run without
+ * it, so append() does not wait for them.
+ */
+class Accumulator {
+public:
+  using clock = std::chrono::steady_clock;
+  using LeaderFn = std::function<int32_t (const std::string & topic, int32_t partition)>;
+
+  struct Config {
+    size_t batch_size;
+    clock::duration linger;
+    size_t memory_budget;
+    int16_t required_acks;
+    int32_t timeout;
+    Compression::Type compression;
+
+    Config()
+      : batch_size(64 << 10), linger(std::chrono::milliseconds(5)), memory_budget(64 << 20),
+        required_acks(1), timeout(1500), compression(Compression::None) { }
+  };
+
+  Accumulator(const Config & config, LeaderFn leader)
+    : config_(config), leader_(std::move(leader)), used_(0), exhausted_(false) { }
+
+  /*
+   * append
+   * Add one message. Returns false, without taking the message, while the
+   * memory budget is exhausted, for a negative partition, or for a message
+   * that does not fit() even in an empty Accumulator; that last one does
+   * not count as exhausting the budget, so later messages still go in.
+   */
+  bool append(const std::string & topic, int32_t partition, BytesView key, BytesView value,
+              clock::time_point now = clock::now())
+  {
+    MessageView msg;
+    msg.Key = key;
+    msg.Value = value;
+    const size_t size = entry_size(msg);
+
+    if (partition < 0 || size > config_.memory_budget)
+      return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (exhausted_ || used_ + size > config_.memory_budget)
+    {
+      exhausted_ = true;
+      return false;
+    }
+    Batch & batch = batch_for(topic, partition);
+    if (batch.entries.empty())
+    {
+      batch.entries = pool_.acquire();
+      batch.entries.reserve(config_.batch_size);
+      batch.created = now;
+    }
+    const size_t start = batch.entries.size();
+    batch.entries.resize(start + size);
+    buffer::writer oBuf(batch.entries.data() + start, batch.entries.data() + batch.entries.size());
+    oBuf << BE<int64_t>{batch.count};
+    oBuf << BE<int32_t>{static_cast<int32_t>(size - sizeof(int64_t) - sizeof(int32_t))};
+    oBuf << msg;
+    ++batch.count;
+    used_ += size;
+    return true;
+  }
+
+  // Whether a message with this key and value can ever be taken by append().
+  bool fits(BytesView key, BytesView value) const
+  {
+    MessageView msg;
+    msg.Key = key;
+    msg.Value = value;
+    return entry_size(msg) <= config_.memory_budget;
+  }
+
+  /*
+   * drain
+   * Append a ProduceBatch to 'out' for every broker with a due batch, or
+   * with any batch at all when 'force' is set. Partitions whose leader is
+   * unknown (negative) stay buffered. Returns the number of batches added.
+   */
+  size_t drain(clock::time_point now, std::vector<ProduceBatch> & out, bool force = false)
+  {
+    std::vector<Taken> taken;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const bool all = force || exhausted_;
+      for (auto topic = topics_.begin(); topic != topics_.end(); ++topic)
+        for (auto batch = topic->second.begin(); batch != topic->second.end(); ++batch)
+        {
+          if (batch->second.entries.empty())
+            continue;
+          if (!all && batch->second.entries.size() < config_.batch_size && now - batch->second.created < config_.linger)
+            continue;
+          taken.push_back(Taken{&topic->first, batch->first, -1, std::vector<uint8_t>(), 0});
+        }
+    }
+    if (taken.empty())
+      return 0;
+
+    for (auto itor = taken.begin(); itor != taken.end(); ++itor)
+      itor->broker = leader_(*itor->topic, itor->partition);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto itor = taken.begin(); itor != taken.end(); ++itor)
+      {
+        if (itor->broker < 0)
+          continue;
+        // Another drain() may have taken it meanwhile.
+        Batch & batch = topics_[*itor->topic][itor->partition];
+        itor->entries = std::move(batch.entries);
+        itor->count = batch.count;
+        batch.entries.clear();
+        batch.count = 0;
+      }
+    }
+
+    std::map<int32_t, size_t> by_broker;
+    const size_t first = out.size();
+    size_t plain = 0, sealed = 0;
+    for (auto itor = taken.begin(); itor != taken.end(); ++itor)
+    {
+      if (itor->entries.empty())
+        continue;
+      auto slot = by_broker.find(itor->broker);
+      if (slot == by_broker.end())
+      {
+        slot = by_broker.insert(std::make_pair(itor->broker, out.size())).first;
+        out.emplace_back();
+        ProduceBatch & pb = out.back();
+        pb.broker = itor->broker;
+        pb.request.RequiredAcks.value = config_.required_acks;
+        pb.request.Timeout.value = config_.timeout;
+        pb.messages = 0;
+        pb.bytes = 0;
+        pb.uncompressed = 0;
+      }
+      ProduceBatch & pb = out[slot->second];
+      if (pb.request.Topics.contents.empty() ||
+          pb.request.Topics.contents.back().TopicName.data != reinterpret_cast<const uint8_t *>(itor->topic->data()))
+      {
+        pb.request.Topics.contents.emplace_back();
+        StringView & name = pb.request.Topics.contents.back().TopicName;
+        name.data = reinterpret_cast<const uint8_t *>(itor->topic->data());
+        name.size = itor->topic->size();
+      }
+
+      plain += itor->entries.size();
+      if (!seal(*itor))
+        ++pb.uncompressed;
+      sealed += itor->entries.size();
+      ProduceRequestView::PartitionsT p;
+      p.Partition.value = itor->partition;
+      p.MessageSet = LazyMessageSet(itor->entries.data(), itor->entries.size());
+      pb.request.Topics.contents.back().Partitions.contents.push_back(p);
+      pb.messages += itor->count;
+      pb.bytes += itor->entries.size();
+      pb.buffers.push_back(std::move(itor->entries));
+    }
+
+    if (sealed != plain)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      used_ += sealed;
+      used_ -= std::min(used_, plain);
+    }
+    return out.size() - first;
+  }
+
+  /*
+   * next_ready
+   * When the oldest pending batch reaches its linger time; time_point::max()
+   * if nothing is buffered.
+   */
+  clock::time_point next_ready() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    clock::time_point next = clock::time_point::max();
+    for (auto topic = topics_.begin(); topic != topics_.end(); ++topic)
+      for (auto batch = topic->second.begin(); batch != topic->second.end(); ++batch)
+        if (!batch->second.entries.empty())
+          next = std::min(next, batch->second.created + config_.linger);
+    return next;
+  }
+
+  // Return a drained batch's memory to the budget and its buffers to the pool.
+  void release(ProduceBatch && pb)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= std::min(used_, pb.bytes);
+    if (used_ < config_.memory_budget)
+      exhausted_ = false;
+    for (auto itor = pb.buffers.begin(); itor != pb.buffers.end(); ++itor)
+      pool_.release(std::move(*itor));
+    pb.buffers.clear();
+    pb.request.Topics.contents.clear();
+  }
+
+  // Bytes held in pending and unreleased batches.
+  size_t buffered() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+  }
+
+private:
+  struct Batch {
+    std::vector<uint8_t> entries;
+    int64_t count;
+    clock::time_point created;
+
+    Batch() : count(0) { }
+  };
+
+  // A batch on its way out of drain(); 'topic' is the key in topics_.
+  struct Taken {
+    const std::string * topic;
+    int32_t partition;
+    int32_t broker;
+    std::vector<uint8_t> entries;
+    int64_t count;
+  };
+
+  // Bytes 'msg' takes in a MessageSet: Offset, MessageSize and the Message.
+  static size_t entry_size(const MessageView & msg)
+  {
+    return sizeof(int64_t) + sizeof(int32_t) + encoded_size(msg);
+  }
+
+  Batch & batch_for(const std::string & topic, int32_t partition)
+  {
+    return topics_[topic][partition];
+  }
+
+  /*
+   * seal
+   * Replace the entries by one compressed wrapper entry, if configured.
+   * False, leaving them as they are, if the codec fails.
+   */
+  bool seal(Taken & batch)
+  {
+    if (config_.compression == Compression::None)
+      return true;
+    std::vector<uint8_t> packed = pool_.acquire();
+    bool ok;
+    {
+      std::lock_guard<std::mutex> lock(codec_mutex_);
+      ok = codec_.compress(config_.compression, batch.entries.data(), batch.entries.size(), packed);
+    }
+    if (!ok)
+    {
+      pool_.release(std::move(packed));
+      return false;
+    }
+    MessageView wrapper;
+    wrapper.Attributes.value = config_.compression;
+    wrapper.Value = BytesView{packed.data(), packed.size()};
+    std::vector<uint8_t> sealed = pool_.acquire();
+    sealed.resize(sizeof(int64_t) + sizeof(int32_t) + encoded_size(wrapper));
+    buffer::writer oBuf(sealed);
+    oBuf << BE<int64_t>{batch.count - 1};
+    oBuf << BE<int32_t>{static_cast<int32_t>(encoded_size(wrapper))};
+    oBuf << wrapper;
+
+    pool_.release(std::move(packed));
+    pool_.release(std::move(batch.entries));
+    batch.entries = std::move(sealed);
+    return true;
+  }
+
+  Config config_;
+  LeaderFn leader_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::map<int32_t, Batch>> topics_;
+  BufferPool pool_;
+  std::mutex codec_mutex_;
+  Codec codec_;
+  size_t used_;
+  bool exhausted_;
+};
+
+}
@@ -1,9 +1,17 @@
+#pragma once
 
 #include <kpp_endian.hpp>
 #include <kpp_variant.hpp>
+#include <kpp_buffer.hpp>
+#include <kpp_crc32.hpp>
+#include <kpp_arena.hpp>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
 #include <iostream>
 #include <tuple>
+#include <type_traits>
 #include <cstdint>
 
 /**
@@ -32,6 +40,9 @@ Message => Crc MagicByte Attributes Key Value
   Key => bytes
   Value => bytes
 
+MetadataRequest => [TopicName]
+  TopicName => string
+
 MetadataResponse => [Broker][TopicMetadata]
   Broker => NodeId Host Port
   NodeId => int32
@@ -158,10 +169,29 @@ namespace Error {
                  NotCoordinatorForConsumerCode = 16;
 }
 
+/*
+ * wire_size
+ * Encoded size of T when it is the same for every value, 0 when it depends
+ * on the contents. Lets a size pass resolve fixed-width types at compile
+ * time and size an Array of them without visiting each element.
+ * Structs with a schema (below) whose fields are all fixed-width are fixed
+ * themselves.
+ */
+template <typename... >
+struct void_type { using type = void; };
+
+template <typename T, typename = void>
+struct wire_size : std::integral_constant<size_t, 0> { };
+template <typename T>
+struct wire_size<T, typename void_type<typename T::schema>::type>
+  : std::integral_constant<size_t, T::schema::width> { };
+
 template<typename INT>
 struct BE {
   INT value;
 };
+template <typename INT>
+struct wire_size<BE<INT>> : std::integral_constant<size_t, sizeof(INT)> { };
 template <typename charT, typename traits, typename INT>
 std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, const BE<INT> & benum )
 {
@@ -177,20 +207,50 @@ std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits>
   benum.value = endian::ntoh(val);
   return iStream ;
 }
+template <typename INT>
+inline buffer::writer & operator << (buffer::writer & oBuf, const BE<INT> & benum)
+{
+  INT val = endian::hton(benum.value);
+  oBuf.write(&val, sizeof val);
+  return oBuf;
+}
+template <typename INT>
+inline buffer::reader & operator >> (buffer::reader & iBuf, BE<INT> & benum)
+{
+  INT val;
+  iBuf.read(&val, sizeof val);
+  benum.value = endian::ntoh(val);
+  return iBuf;
+}
+template <typename INT>
+inline buffer::counter & operator << (buffer::counter & oSize, const BE<INT> &)
+{
+  oSize.count += sizeof(INT);
+  return oSize;
+}
+template <typename INT>
+inline buffer::gather & operator << (buffer::gather & oGather, const BE<INT> & benum)
+{
+  INT val = endian::hton(benum.value);
+  oGather.write(&val, sizeof val);
+  return oGather;
+}
 
-struct String {
-  std::vector<uint8_t> bytes;
+template <typename Alloc>
+struct basic_String {
+  std::vector<uint8_t, Alloc> bytes;
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, const String & str )
+using String = basic_String<std::allocator<uint8_t>>;
+template <typename charT, typename traits, typename Alloc>
+std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, const basic_String<Alloc> & str )
 {
-  BE<int16_t> sz = {str.bytes.size()};
+  BE<int16_t> sz = {static_cast<int16_t>(str.bytes.size())};
   oStream << sz;
-  oStream.write(reinterpret_cast<charT*>(str.bytes.data()), str.bytes.size());
+  oStream.write(reinterpret_cast<const charT*>(str.bytes.data()), str.bytes.size());
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, String & str)
+template <typename charT, typename traits, typename Alloc>
+std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, basic_String<Alloc> & str)
 {
   BE<int16_t> sz; 
   iStream >> sz;
@@ -198,404 +258,1567 @@ std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits>
   iStream.read(reinterpret_cast<charT*>(str.bytes.data()), sz.value);
   return iStream ;
 }
+template <typename Alloc>
+buffer::writer & operator << (buffer::writer & oBuf, const basic_String<Alloc> & str)
+{
+  oBuf << BE<int16_t>{static_cast<int16_t>(str.bytes.size())};
+  oBuf.write(str.bytes.data(), str.bytes.size());
+  return oBuf;
+}
+template <typename Alloc>
+buffer::reader & operator >> (buffer::reader & iBuf, basic_String<Alloc> & str)
+{
+  BE<int16_t> sz;
+  iBuf >> sz;
+  const int16_t n = sz.value < 0 ? 0 : sz.value;
+  if (!iBuf.length(n))
+  {
+    str.bytes.clear();
+    return iBuf;
+  }
+  const uint8_t * p = iBuf.take(n);
+  str.bytes.assign(p, p + n);
+  return iBuf;
+}
+template <typename Alloc>
+buffer::counter & operator << (buffer::counter & oSize, const basic_String<Alloc> & str)
+{
+  oSize.count += sizeof(int16_t) + str.bytes.size();
+  return oSize;
+}
+template <typename Alloc>
+buffer::gather & operator << (buffer::gather & oGather, const basic_String<Alloc> & str)
+{
+  oGather << BE<int16_t>{static_cast<int16_t>(str.bytes.size())};
+  oGather.write(str.bytes.data(), str.bytes.size());
+  return oGather;
+}
 
-struct Bytes {
-  std::vector<uint8_t> bytes;
+/*
+ * Bytes
+ * Kafka bytes are nullable, and null (-1) is not the same as empty (0): a
+ * null Value is a tombstone. 'null' records which one an empty Bytes is;
+ * it starts out true, so a key or value that is never set goes out as
+ * null, and decoding sets it from the length. Non-empty bytes are never
+ * null.
+ */
+template <typename Alloc>
+struct basic_Bytes {
+  std::vector<uint8_t, Alloc> bytes;
+  bool null;
+
+  basic_Bytes() : null(true) { }
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT, traits> & operator << (std::basic_ostream<charT,traits> & oStream, const Bytes & str )
+using Bytes = basic_Bytes<std::allocator<uint8_t>>;
+template <typename Alloc>
+int32_t wire_length(const basic_Bytes<Alloc> & str)
+{
+  return str.bytes.empty() && str.null ? -1 : static_cast<int32_t>(str.bytes.size());
+}
+template <typename charT, typename traits, typename Alloc>
+std::basic_ostream<charT, traits> & operator << (std::basic_ostream<charT,traits> & oStream, const basic_Bytes<Alloc> & str )
 {
-  BE<int32_t> sz = {str.bytes.size()};
+  BE<int32_t> sz = {wire_length(str)};
   oStream << sz;
-  oStream.write(reinterpret_cast<charT*>(str.bytes.data()), str.bytes.size());
+  oStream.write(reinterpret_cast<const charT*>(str.bytes.data()), str.bytes.size());
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, Bytes & str)
+template <typename charT, typename traits, typename Alloc>
+std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, basic_Bytes<Alloc> & str)
 {
   BE<int32_t> sz; 
   iStream >> sz;
-  str.bytes.resize(sz.value);
-  iStream.read(reinterpret_cast<charT*>(str.bytes.data()), sz.value);
+  str.null = sz.value < 0;
+  str.bytes.resize(sz.value < 0 ? 0 : sz.value);
+  iStream.read(reinterpret_cast<charT*>(str.bytes.data()), str.bytes.size());
   return iStream ;
 }
-
-template <typename T>
-struct Array {
-  std::vector<T> contents;
-};
-template <typename charT, typename traits, typename ArrayT>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, const Array<ArrayT> & arr )
+template <typename Alloc>
+buffer::writer & operator << (buffer::writer & oBuf, const basic_Bytes<Alloc> & str)
 {
-  BE<int32_t> sz = {arr.contents.size()};
-  oStream << sz;
-  for(auto itor = arr.contents.begin(); itor != arr.contents.end(); ++itor)
-  {
-    oStream << *itor;
-  }
-  return oStream;
+  oBuf << BE<int32_t>{wire_length(str)};
+  oBuf.write(str.bytes.data(), str.bytes.size());
+  return oBuf;
 }
-template <typename charT, typename traits, typename ArrayT>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, Array<ArrayT> & arr)
+template <typename Alloc>
+buffer::reader & operator >> (buffer::reader & iBuf, basic_Bytes<Alloc> & str)
 {
   BE<int32_t> sz;
-  iStream >> sz;
-  arr.contents.resize(sz.value);
-  for(int i = 0; i < sz.value; ++i)
+  iBuf >> sz;
+  const int32_t n = sz.value < 0 ? 0 : sz.value;
+  str.null = sz.value < 0;
+  if (!iBuf.length(n))
   {
-    arr.contents.push_back();
-    iStream >> arr.contents.back();
+    str.bytes.clear();
+    return iBuf;
   }
-  return iStream;
+  const uint8_t * p = iBuf.take(n);
+  str.bytes.assign(p, p + n);
+  return iBuf;
 }
-
-struct OffsetFetchResponse { 
-   struct PartitionsT {
-     BE<int32_t> Partition;
-     BE<int64_t> Offset;
-     String  Metadata;
-     BE<Error::Type> ErrorCode; 
-   };
-   struct TopicsT {
-     String TopicName;
-     Array<PartitionsT> Partitions;
-   };
-   
-   Array<TopicsT> Topics;
-};
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetFetchResponse & ofr)
+template <typename Alloc>
+buffer::counter & operator << (buffer::counter & oSize, const basic_Bytes<Alloc> & str)
 {
-  oStream << ofr.Topics;
-  return oStream;
+  oSize.count += sizeof(int32_t) + str.bytes.size();
+  return oSize;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetFetchResponse & ofr)
+template <typename Alloc>
+buffer::gather & operator << (buffer::gather & oGather, const basic_Bytes<Alloc> & str)
 {
-  iStream >> ofr.Topics;
-  return iStream;
+  oGather << BE<int32_t>{wire_length(str)};
+  oGather.write(str.bytes.data(), str.bytes.size());
+  return oGather;
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetFetchResponse::TopicsT & t)
+
+/*
+ * StringView, BytesView
+ * Non-owning counterparts of String and Bytes: pointer and length into the
+ * buffer they were decoded from. Only a buffer::reader can produce them;
+ * they encode through any backend.
+ */
+struct StringView {
+  const uint8_t * data;
+  size_t size;
+};
+template <typename OStream>
+OStream & operator << (OStream & oStream, const StringView & str)
 {
-  oStream << t.TopicName;
-  oStream << t.Partitions;
+  oStream << BE<int16_t>{static_cast<int16_t>(str.size)};
+  oStream.write(reinterpret_cast<const char *>(str.data), str.size);
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetFetchResponse::TopicsT & t)
+inline buffer::reader & operator >> (buffer::reader & iBuf, StringView & str)
 {
-  iStream >> t.TopicName;
-  iStream >> t.Partitions;
-  return iStream;
+  BE<int16_t> sz;
+  iBuf >> sz;
+  str.size = sz.value < 0 ? 0 : sz.value;
+  str.data = iBuf.length(str.size) ? iBuf.take(str.size) : nullptr;
+  if (!str.data)
+    str.size = 0;
+  return iBuf;
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetFetchResponse::PartitionsT & p)
+
+// A null BytesView (data == nullptr) stands for the -1 length.
+struct BytesView {
+  const uint8_t * data;
+  size_t size;
+};
+inline int32_t wire_length(const BytesView & str)
+{
+  return str.data ? static_cast<int32_t>(str.size) : -1;
+}
+template <typename OStream>
+OStream & operator << (OStream & oStream, const BytesView & str)
 {
-  oStream << p.Partition;
-  oStream << p.Offset;
-  oStream << p.Metadata;
-  oStream << p.ErrorCode; 
+  oStream << BE<int32_t>{wire_length(str)};
+  oStream.write(reinterpret_cast<const char *>(str.data), str.size);
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetFetchResponse::PartitionsT & p)
+inline buffer::reader & operator >> (buffer::reader & iBuf, BytesView & str)
 {
-  iStream >> p.Partition;
-  iStream >> p.Offset;
-  iStream >> p.Metadata;
-  iStream >> p.ErrorCode;
-  return iStream;
+  BE<int32_t> sz;
+  iBuf >> sz;
+  str.size = sz.value < 0 ? 0 : sz.value;
+  str.data = sz.value < 0 || !iBuf.length(str.size) ? nullptr : iBuf.take(str.size);
+  if (!str.data)
+    str.size = 0;
+  return iBuf;
 }
 
-struct OffsetFetchRequest {
-  struct TopicsT {
-    String TopicName;
-    Array<BE<int32_t>> Partitions;
-  };
-  String ConsumerGroup;
-  Array<TopicsT> Topics; 
-};
+/*
+ * set_failed, skip
+ * The two things composite decoders need beyond operator>>: flagging a
+ * malformed value, and stepping over bytes they do not decode.
+ */
 template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetFetchRequest & ofr)
+void set_failed(std::basic_istream<charT,traits> & iStream)
 {
-  oStream << ofr.ConsumerGroup;
-  oStream << ofr.Topics;
-  return oStream;
+  iStream.setstate(std::ios_base::failbit);
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetFetchRequest & ofr)
+inline void set_failed(buffer::reader & iBuf)
 {
-  iStream >> ofr.ConsumerGroup;
-  iStream >> ofr.Topics;
-  return iStream;
+  iBuf.fail(buffer::status::malformed);
 }
 template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetFetchRequest::TopicsT & t)
+void skip(std::basic_istream<charT,traits> & iStream, size_t n)
 {
-  oStream << t.TopicName;
-  oStream << t.Partitions;
-  return oStream;
+  iStream.ignore(n);
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetFetchRequest::TopicsT & t)
+inline void skip(buffer::reader & iBuf, size_t n)
 {
-  iStream >> t.TopicName;
-  iStream >> t.Partitions;
-  return iStream;
+  iBuf.take(n);
 }
 
-
-
-struct OffsetCommitResponse {
-  struct PartitionsT {
-    BE<int32_t> Partition;
-    BE<Error::Type> ErrorCode;
-  };
-   struct TopicsT {
-    String TopicName;
-    Array<PartitionsT> Partitions;
-  };
-  Array<TopicsT> Topics;  
+/*
+ * Array and the message structs below are shared by both codec backends:
+ * OStream/IStream is either a std::basic_ostream/istream or a
+ * buffer::writer/reader, and only the leaf types above differ. A
+ * buffer::gather encodes like a writer but leaves large payloads in place.
+ */
+template <typename T, typename Alloc = std::allocator<T>>
+struct Array {
+  std::vector<T, Alloc> contents;
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitResponse & ocr)
+template <typename OStream, typename ArrayT, typename Alloc>
+OStream & operator << (OStream & oStream, const Array<ArrayT, Alloc> & arr )
 {
-  oStream << ocr.Topics;
+  BE<int32_t> sz = {static_cast<int32_t>(arr.contents.size())};
+  oStream << sz;
+  for(auto itor = arr.contents.begin(); itor != arr.contents.end(); ++itor)
+  {
+    oStream << *itor;
+  }
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitResponse & ocr)
+template <typename IStream, typename ArrayT, typename Alloc>
+IStream & operator >> (IStream & iStream, Array<ArrayT, Alloc> & arr)
 {
-  iStream >> ocr.Topics;
+  BE<int32_t> sz;
+  iStream >> sz;
+  arr.contents.resize(sz.value);
+  for(auto itor = arr.contents.begin(); itor != arr.contents.end(); ++itor)
+  {
+    iStream >> *itor;
+  }
   return iStream;
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitResponse::TopicsT & t)
+/*
+ * Arrays of plain integers (partition lists, Replicas/Isr, offsets) skip
+ * the per-element path on the buffer backend and convert in one bulk
+ * endian::hton_n/ntoh_n pass straight between the buffer and the vector.
+ */
+template <typename INT, typename Alloc>
+buffer::writer & operator << (buffer::writer & oBuf, const Array<BE<INT>, Alloc> & arr)
 {
-  oStream << t.TopicName;
-  oStream << t.Partitions;
-  return oStream;
+  static_assert(sizeof(BE<INT>) == sizeof(INT), "BE<INT> must be layout-compatible with INT");
+  const size_t n = arr.contents.size();
+  oBuf << BE<int32_t>{static_cast<int32_t>(n)};
+  if (uint8_t * out = oBuf.take(n * sizeof(INT)))
+    endian::hton_n(out, reinterpret_cast<const INT *>(arr.contents.data()), n);
+  return oBuf;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitResponse::TopicsT & t)
+/*
+ * On the buffer backend an Array's count is vetted before the vector is
+ * sized: every element takes at least one byte (wire_size when fixed), so
+ * a count beyond what is left fails at once instead of allocating for it.
+ */
+template <typename ArrayT, typename Alloc>
+buffer::reader & operator >> (buffer::reader & iBuf, Array<ArrayT, Alloc> & arr)
 {
-  iStream >> t.TopicName;
-  iStream >> t.Partitions;
-  return iStream;
+  BE<int32_t> sz;
+  iBuf >> sz;
+  if (!iBuf.count(sz.value, wire_size<ArrayT>::value ? wire_size<ArrayT>::value : 1))
+  {
+    arr.contents.clear();
+    return iBuf;
+  }
+  arr.contents.resize(sz.value);
+  for(auto itor = arr.contents.begin(); itor != arr.contents.end() && iBuf; ++itor)
+  {
+    iBuf >> *itor;
+  }
+  return iBuf;
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitResponse::PartitionsT & p)
+template <typename INT, typename Alloc>
+buffer::reader & operator >> (buffer::reader & iBuf, Array<BE<INT>, Alloc> & arr)
 {
-  oStream << p.Partition;
-  oStream << p.ErrorCode;
-  return oStream;
+  BE<int32_t> sz;
+  iBuf >> sz;
+  if (!iBuf.count(sz.value, sizeof(INT)))
+  {
+    arr.contents.clear();
+    return iBuf;
+  }
+  arr.contents.resize(sz.value);
+  endian::ntoh_n(reinterpret_cast<INT *>(arr.contents.data()), iBuf.take(sz.value * sizeof(INT)), sz.value);
+  return iBuf;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitResponse::PartitionsT & p)
+template <typename ArrayT, typename Alloc>
+buffer::counter & operator << (buffer::counter & oSize, const Array<ArrayT, Alloc> & arr)
 {
-  iStream >> p.Partition;
-  iStream >> p.ErrorCode;
-  return iStream;
+  oSize.count += sizeof(int32_t);
+  if (wire_size<ArrayT>::value)
+    oSize.count += arr.contents.size() * wire_size<ArrayT>::value;
+  else
+    for(auto itor = arr.contents.begin(); itor != arr.contents.end(); ++itor)
+    {
+      oSize << *itor;
+    }
+  return oSize;
 }
 
+/*
+ * Schemas
+ * A struct lists its fields once, in wire order,
+ *
+ *   using schema = fields<KPP_FIELD(PartitionsT, Partition),
+ *                         KPP_FIELD(PartitionsT, Offset)>;
+ *
+ * and its operator<<, operator>> and size pass are generated from that list.
+ * On the buffer backend every run of two or more adjacent fixed-width
+ * fields costs a single bounds check, after which the run is moved with
+ * unchecked big-endian loads and stores.
+ */
+template <typename M, M Ptr>
+struct field;
+template <typename C, typename F, F C::*Ptr>
+struct field<F C::*, Ptr> {
+  using type = F;
 
-struct OffsetCommitRequest {
-  struct PartitionsT {
-    BE<int32_t> Partition;
-    BE<int64_t> Offset;
-    BE<int64_t> Timestamp;
-    String Metadata;
-  };
-  struct TopicsT {
-    String TopicName;
-    Array<PartitionsT> Partitions;
-  };
-  String ConsumerGroup;
-  Array<TopicsT> Topics;
+  static const F & get(const C & c) { return c.*Ptr; }
+  static F & get(C & c) { return c.*Ptr; }
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitRequest & ocr)
-{
-  oStream << ocr.ConsumerGroup;
-  oStream << ocr.Topics;
-  return oStream;
-}
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitRequest & ocr)
-{
-  iStream >> ocr.ConsumerGroup;
-  iStream >> ocr.Topics;
-  return iStream;
-}
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitRequest::TopicsT & t)
+#define KPP_FIELD(Struct, Member) ::kpp::field<decltype(&Struct::Member), &Struct::Member>
+
+template <typename T, typename = void>
+struct has_schema : std::false_type { };
+template <typename T>
+struct has_schema<T, typename void_type<typename T::schema>::type> : std::true_type { };
+
+/*
+ * store_raw, load_raw
+ * Move a fixed-width value through 'p' without bounds checks; the caller
+ * has already claimed wire_size<T> bytes.
+ */
+template <typename INT>
+inline void store_raw(uint8_t *& p, const BE<INT> & benum)
 {
-  oStream << t.TopicName;
-  oStream << t.Partitions;
-  return oStream;
+  endian::store_be(p, benum.value);
+  p += sizeof(INT);
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitRequest::TopicsT & t)
+template <typename INT>
+inline void load_raw(const uint8_t *& p, BE<INT> & benum)
 {
-  iStream >> t.TopicName;
-  iStream >> t.Partitions;
-  return iStream;
+  benum.value = endian::load_be<INT>(p);
+  p += sizeof(INT);
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetCommitRequest::PartitionsT & p)
+template <typename T>
+inline typename std::enable_if<has_schema<T>::value>::type store_raw(uint8_t *& p, const T & value)
 {
-  oStream << p.Partition;
-  oStream << p.Offset;
-  oStream << p.Timestamp;
-  oStream << p.Metadata;
-  return oStream;
+  T::schema::store_run(p, value, std::integral_constant<size_t, T::schema::run>());
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetCommitRequest::PartitionsT & p)
+template <typename T>
+inline typename std::enable_if<has_schema<T>::value>::type load_raw(const uint8_t *& p, T & value)
 {
-  iStream >> p.Partition;
-  iStream >> p.Offset;
-  iStream >> p.Timestamp;
-  iStream >> p.Metadata;
-  return iStream;
+  T::schema::load_run(p, value, std::integral_constant<size_t, T::schema::run>());
 }
 
+template <typename... Fs>
+struct fields;
 
-struct ConsumerMetadataResponse {
-  BE<Error::Type> ErrorCode;
-  BE<int32_t> CoordinatorId;
-  String CoordinatorHost;
-  BE<int32_t> CoordinatorPort;
+// drop<N, Fs...>::type is fields<> of what follows the first N.
+template <size_t N, typename... Fs>
+struct drop { using type = fields<Fs...>; };
+template <typename F, typename... Fs>
+struct drop<0, F, Fs...> { using type = fields<F, Fs...>; };
+template <size_t N, typename F, typename... Fs>
+struct drop<N, F, Fs...> { using type = typename drop<N - 1, Fs...>::type; };
+
+template <>
+struct fields<> {
+  static const bool fixed = true;
+  static const size_t sum = 0;
+  static const size_t run = 0;
+  static const size_t run_width = 0;
+
+  template <typename Stream, typename C>
+  static void encode(Stream &, const C &) { }
+  template <typename Stream, typename C>
+  static void decode(Stream &, C &) { }
+  template <typename C>
+  static void store_run(uint8_t *&, const C &, std::integral_constant<size_t, 0>) { }
+  template <typename C>
+  static void load_run(const uint8_t *&, C &, std::integral_constant<size_t, 0>) { }
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const ConsumerMetadataResponse & cmr) 
+
+template <typename F, typename... Fs>
+struct fields<F, Fs...> {
+  using rest = fields<Fs...>;
+  static const size_t own = wire_size<typename F::type>::value;
+
+  static const bool fixed = own && rest::fixed;
+  static const size_t sum = own + rest::sum;
+  static const size_t width = fixed ? sum : 0;
+  // Length and byte width of the fixed-width run starting at F.
+  static const size_t run = own ? 1 + rest::run : 0;
+  static const size_t run_width = own ? own + rest::run_width : 0;
+
+  using coalesce = std::integral_constant<bool, (run > 1)>;
+  using after_run = typename drop<run, F, Fs...>::type;
+
+  template <typename OStream, typename C>
+  static void encode(OStream & oStream, const C & c)
+  {
+    oStream << F::get(c);
+    rest::encode(oStream, c);
+  }
+  template <typename C>
+  static void encode(buffer::writer & oBuf, const C & c)
+  {
+    encode_buffer(oBuf, c, coalesce());
+  }
+  template <typename C>
+  static void encode(buffer::counter & oSize, const C & c)
+  {
+    encode_buffer(oSize, c, coalesce());
+  }
+
+  template <typename IStream, typename C>
+  static void decode(IStream & iStream, C & c)
+  {
+    iStream >> F::get(c);
+    rest::decode(iStream, c);
+  }
+  template <typename C>
+  static void decode(buffer::reader & iBuf, C & c)
+  {
+    decode_buffer(iBuf, c, coalesce());
+  }
+
+  template <typename C>
+  static void store_run(uint8_t *&, const C &, std::integral_constant<size_t, 0>) { }
+  template <typename C, size_t N>
+  static void store_run(uint8_t *& p, const C & c, std::integral_constant<size_t, N>)
+  {
+    store_raw(p, F::get(c));
+    rest::store_run(p, c, std::integral_constant<size_t, N - 1>());
+  }
+  template <typename C>
+  static void load_run(const uint8_t *&, C &, std::integral_constant<size_t, 0>) { }
+  template <typename C, size_t N>
+  static void load_run(const uint8_t *& p, C & c, std::integral_constant<size_t, N>)
+  {
+    load_raw(p, F::get(c));
+    rest::load_run(p, c, std::integral_constant<size_t, N - 1>());
+  }
+
+private:
+  template <typename OStream, typename C>
+  static void encode_buffer(OStream & oStream, const C & c, std::false_type)
+  {
+    oStream << F::get(c);
+    rest::encode(oStream, c);
+  }
+  template <typename C>
+  static void encode_buffer(buffer::writer & oBuf, const C & c, std::true_type)
+  {
+    uint8_t * p = oBuf.take(run_width);
+    if (!p)
+      return;
+    store_run(p, c, std::integral_constant<size_t, run>());
+    after_run::encode(oBuf, c);
+  }
+  template <typename C>
+  static void encode_buffer(buffer::counter & oSize, const C & c, std::true_type)
+  {
+    oSize.count += run_width;
+    after_run::encode(oSize, c);
+  }
+
+  template <typename C>
+  static void decode_buffer(buffer::reader & iBuf, C & c, std::false_type)
+  {
+    iBuf >> F::get(c);
+    rest::decode(iBuf, c);
+  }
+  template <typename C>
+  static void decode_buffer(buffer::reader & iBuf, C & c, std::true_type)
+  {
+    const uint8_t * p = iBuf.take(run_width);
+    if (!p)
+    {
+      // The reader is exhausted now; the plain path zero-fills the rest.
+      iBuf >> F::get(c);
+      rest::decode(iBuf, c);
+      return;
+    }
+    load_run(p, c, std::integral_constant<size_t, run>());
+    after_run::decode(iBuf, c);
+  }
+};
+
+template <typename OStream, typename T>
+typename std::enable_if<has_schema<T>::value, OStream &>::type
+operator << (OStream & oStream, const T & value)
 {
-  oStream << cmr.ErrorCode; 
-  oStream << cmr.CoordinatorId;
-  oStream << cmr.CoordinatorHost;
-  oStream << cmr.CoordinatorPort;
+  T::schema::encode(oStream, value);
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                ConsumerMetadataResponse & cmr)
+template <typename IStream, typename T>
+typename std::enable_if<has_schema<T>::value, IStream &>::type
+operator >> (IStream & iStream, T & value)
 {
-  iStream >> cmr.ErrorCode;
-  iStream >> cmr.CoordinatorId;
-  iStream >> cmr.CoordinatorHost;
-  iStream >> cmr.CoordinatorPort;
+  T::schema::decode(iStream, value);
   return iStream;
 }
 
+/*
+ * encoded_size
+ * Exact number of bytes 'value' occupies on the wire, without encoding it.
+ */
+template <typename T>
+size_t encoded_size(const T & value)
+{
+  buffer::counter oSize;
+  oSize << value;
+  return oSize.count;
+}
 
+/*
+ * Message structs are templated on a storage policy S naming the string,
+ * bytes, array and message set types their fields use. Owned copies
+ * payloads into String/Bytes and materializes every Message; Borrowed
+ * decodes them as views into the frame buffer and walks message sets
+ * lazily. Each basic_X<S> has the aliases X (Owned) and XView (Borrowed).
+ * ArenaOwned and ArenaBorrowed are the same with every container drawing
+ * from the current arena::monotonic; see decode_in_arena().
+ */
+template <typename S> struct basic_MessageSet;
+class LazyMessageSet;
 
-struct ConsumerMetadataRequest {
-  String ConsumerGroup;
+struct Owned {
+  using string = String;
+  using bytes = Bytes;
+  template <typename T> using array = Array<T>;
+  using message_set = basic_MessageSet<Owned>;
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const ConsumerMetadataRequest & cmr) 
+struct Borrowed {
+  using string = StringView;
+  using bytes = BytesView;
+  template <typename T> using array = Array<T>;
+  using message_set = LazyMessageSet;
+};
+struct ArenaOwned {
+  using string = basic_String<arena::allocator<uint8_t>>;
+  using bytes = basic_Bytes<arena::allocator<uint8_t>>;
+  template <typename T> using array = Array<T, arena::allocator<T>>;
+  using message_set = basic_MessageSet<ArenaOwned>;
+};
+struct ArenaBorrowed {
+  using string = StringView;
+  using bytes = BytesView;
+  template <typename T> using array = Array<T, arena::allocator<T>>;
+  using message_set = LazyMessageSet;
+};
+template <typename S>
+using string_t = typename S::string;
+template <typename S>
+using bytes_t = typename S::bytes;
+template <typename S, typename T>
+using array_t = typename S::template array<T>;
+template <typename S>
+using message_set_t = typename S::message_set;
+
+/*
+ * checksum
+ * Continue a CRC over 'str' exactly as it is laid out on the wire.
+ */
+template <typename Alloc>
+uint32_t checksum(uint32_t c, const basic_Bytes<Alloc> & str)
 {
-  oStream << cmr.ConsumerGroup;
-  return oStream;
+  int32_t sz = endian::hton(wire_length(str));
+  c = crc::update(c, &sz, sizeof sz);
+  return crc::update(c, str.bytes.data(), str.bytes.size());
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                ConsumerMetadataRequest & cmr)
+inline uint32_t checksum(uint32_t c, const BytesView & str)
 {
-  iStream >> cmr.ConsumerGroup;
-  return iStream;
+  int32_t sz = endian::hton(wire_length(str));
+  c = crc::update(c, &sz, sizeof sz);
+  return crc::update(c, str.data, str.size);
 }
 
+/*
+ * Message
+ * Crc covers MagicByte through Value. It is computed on encode, whatever
+ * the Crc member holds, and verified on decode; a mismatch fails the stream.
+ */
+template <typename S>
+struct basic_Message {
+  BE<int32_t> Crc;
+  BE<int8_t> MagicByte;
+  BE<int8_t> Attributes;
+  bytes_t<S> Key;
+  bytes_t<S> Value;
+
+  basic_Message() : Crc(), MagicByte(), Attributes(), Key(), Value() { }
+
+  uint32_t checksum() const
+  {
+    const uint8_t head[] = { static_cast<uint8_t>(MagicByte.value), static_cast<uint8_t>(Attributes.value) };
+    uint32_t c = crc::update(0, head, sizeof head);
+    c = kpp::checksum(c, Key);
+    return kpp::checksum(c, Value);
+  }
+
+  template <typename OStream>
+  friend OStream & operator << (OStream & oStream, const basic_Message & m)
+  {
+    oStream << BE<int32_t>{static_cast<int32_t>(m.checksum())};
+    oStream << m.MagicByte;
+    oStream << m.Attributes;
+    oStream << m.Key;
+    oStream << m.Value;
+    return oStream;
+  }
+  // The size pass needs no Crc.
+  friend buffer::counter & operator << (buffer::counter & oSize, const basic_Message & m)
+  {
+    oSize.count += sizeof(int32_t) + 2 * sizeof(int8_t);
+    oSize << m.Key;
+    oSize << m.Value;
+    return oSize;
+  }
+  template <typename IStream>
+  friend IStream & operator >> (IStream & iStream, basic_Message & m)
+  {
+    iStream >> m.Crc;
+    iStream >> m.MagicByte;
+    iStream >> m.Attributes;
+    iStream >> m.Key;
+    iStream >> m.Value;
+    if (static_cast<uint32_t>(m.Crc.value) != m.checksum())
+      set_failed(iStream);
+    return iStream;
+  }
+};
+using Message = basic_Message<Owned>;
+using MessageView = basic_Message<Borrowed>;
+
+/*
+ * MessageSet
+ * Encodes as 'MessageSetSize [Offset MessageSize Message]', the form it
+ * takes inside produce and fetch partitions; MessageSize is derived from
+ * each Message. A broker may cut the last message short at MaxBytes, so a
+ * trailing partial entry is skipped on decode rather than failing.
+ */
+template <typename S>
+struct basic_MessageSet {
+  struct EntryT {
+    BE<int64_t> Offset;
+    basic_Message<S> Message;
+  };
+  array_t<S, EntryT> Messages;
+
+  template <typename OStream>
+  static void encode_entries(OStream & oStream, const basic_MessageSet & ms)
+  {
+    for(auto itor = ms.Messages.contents.begin(); itor != ms.Messages.contents.end(); ++itor)
+    {
+      oStream << itor->Offset;
+      oStream << BE<int32_t>{static_cast<int32_t>(encoded_size(itor->Message))};
+      oStream << itor->Message;
+    }
+  }
+  template <typename IStream>
+  static void decode_entries(IStream & iStream, basic_MessageSet & ms, size_t remaining)
+  {
+    const size_t header = sizeof(int64_t) + sizeof(int32_t);
+    ms.Messages.contents.clear();
+    while (remaining >= header)
+    {
+      EntryT entry;
+      BE<int32_t> sz;
+      iStream >> entry.Offset;
+      iStream >> sz;
+      remaining -= header;
+      if (sz.value < 0 || static_cast<size_t>(sz.value) > remaining)
+        break;
+      iStream >> entry.Message;
+      if (encoded_size(entry.Message) != static_cast<size_t>(sz.value))
+        set_failed(iStream);
+      if (!iStream)
+        return;
+      remaining -= sz.value;
+      ms.Messages.contents.push_back(std::move(entry));
+    }
+    skip(iStream, remaining);
+  }
+
+  template <typename OStream>
+  friend OStream & operator << (OStream & oStream, const basic_MessageSet & ms)
+  {
+    buffer::counter oSize;
+    encode_entries(oSize, ms);
+    oStream << BE<int32_t>{static_cast<int32_t>(oSize.count)};
+    encode_entries(oStream, ms);
+    return oStream;
+  }
+  template <typename IStream>
+  friend IStream & operator >> (IStream & iStream, basic_MessageSet & ms)
+  {
+    BE<int32_t> sz;
+    iStream >> sz;
+    decode_entries(iStream, ms, sz.value < 0 ? 0 : sz.value);
+    return iStream;
+  }
+  friend buffer::reader & operator >> (buffer::reader & iBuf, basic_MessageSet & ms)
+  {
+    BE<int32_t> sz;
+    iBuf >> sz;
+    ms.Messages.contents.clear();
+    if (iBuf.length(sz.value < 0 ? 0 : sz.value))
+      decode_entries(iBuf, ms, sz.value < 0 ? 0 : sz.value);
+    return iBuf;
+  }
+};
+using MessageSet = basic_MessageSet<Owned>;
+using MessageSetView = basic_MessageSet<Borrowed>;
+
+/*
+ * LazyMessageSet
+ * A MessageSet left in its wire form and walked in place. Iterating only
+ * reads each entry's Offset and MessageSize; Key and Value are located on
+ * demand and the CRC is checked only through verify().
+ *
+ * Iteration stops cleanly at a trailing entry that was cut short at the
+ * fetch MaxBytes limit; truncated() reports it and next_offset() says where
+ * the following fetch should start.
+ */
+class LazyMessageSet {
+public:
+  struct Entry {
+    int64_t offset;
+    const uint8_t * message;  // Crc through Value
+    size_t size;
+
+    int32_t crc() const { return field<int32_t>(0); }
+    int8_t magic() const { return field<int8_t>(4); }
+    int8_t attributes() const { return field<int8_t>(5); }
+
+    BytesView key() const
+    {
+      BytesView k = {nullptr, 0};
+      buffer::reader iBuf(body(), message + size);
+      iBuf >> k;
+      return k;
+    }
+    BytesView value() const
+    {
+      BytesView k = {nullptr, 0}, v = {nullptr, 0};
+      buffer::reader iBuf(body(), message + size);
+      iBuf >> k >> v;
+      return iBuf ? v : BytesView{nullptr, 0};
+    }
+
+    bool verify() const
+    {
+      const size_t crc_size = sizeof(int32_t);
+      return size >= crc_size && static_cast<uint32_t>(crc()) == crc::update(0, message + crc_size, size - crc_size);
+    }
+
+  private:
+    // Key starts after Crc, MagicByte and Attributes.
+    const uint8_t * body() const
+    {
+      const size_t header = sizeof(int32_t) + 2 * sizeof(int8_t);
+      return message + (size < header ? size : header);
+    }
+
+    template <typename INT>
+    INT field(size_t at) const
+    {
+      BE<INT> benum = {0};
+      if (at + sizeof(INT) <= size)
+      {
+        buffer::reader iBuf(message + at, sizeof(INT));
+        iBuf >> benum;
+      }
+      return benum.value;
+    }
+  };
 
-struct OffsetResponse {
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Entry *;
+    using reference = const Entry &;
+
+    iterator() : pos_(nullptr), end_(nullptr) { }
+    iterator(const uint8_t * pos, const uint8_t * end) : pos_(pos), end_(end) { parse(); }
+
+    reference operator * () const { return entry_; }
+    pointer operator -> () const { return &entry_; }
+    iterator & operator ++ () { pos_ = entry_.message + entry_.size; parse(); return *this; }
+    iterator operator ++ (int) { iterator old = *this; ++*this; return old; }
+    bool operator == (const iterator & other) const { return pos_ == other.pos_; }
+    bool operator != (const iterator & other) const { return pos_ != other.pos_; }
+
+  private:
+    void parse()
+    {
+      buffer::reader iBuf(pos_, end_);
+      BE<int64_t> offset;
+      BE<int32_t> sz;
+      iBuf >> offset >> sz;
+      if (!iBuf || sz.value < 0 || static_cast<size_t>(sz.value) > iBuf.remaining())
+      {
+        pos_ = end_;
+        return;
+      }
+      entry_.offset = offset.value;
+      entry_.message = iBuf.cursor;
+      entry_.size = sz.value;
+    }
+
+    const uint8_t * pos_;
+    const uint8_t * end_;
+    Entry entry_;
+  };
+
+  const uint8_t * data;  // entries, after the MessageSetSize prefix
+  size_t size;
+
+  LazyMessageSet() : data(nullptr), size(0) { }
+  LazyMessageSet(const uint8_t * first, size_t n) : data(first), size(n) { }
+
+  iterator begin() const { return iterator(data, data + size); }
+  iterator end() const { return iterator(data + size, data + size); }
+
+  // Bytes covered by complete entries.
+  size_t complete_size() const
+  {
+    const uint8_t * last = data;
+    for (iterator itor = begin(); itor != end(); ++itor)
+      last = itor->message + itor->size;
+    return last - data;
+  }
+
+  bool truncated() const { return complete_size() != size; }
+
+  /*
+   * next_offset
+   * The offset after the last complete entry, or 'fetch_offset' when there
+   * is none, e.g. a single message larger than MaxBytes.
+   */
+  int64_t next_offset(int64_t fetch_offset) const
+  {
+    int64_t next = fetch_offset;
+    for (iterator itor = begin(); itor != end(); ++itor)
+      next = itor->offset + 1;
+    return next;
+  }
+
+  // Check the CRC of every complete entry.
+  bool verify() const
+  {
+    for (iterator itor = begin(); itor != end(); ++itor)
+      if (!itor->verify())
+        return false;
+    return true;
+  }
+
+  template <typename OStream>
+  friend OStream & operator << (OStream & oStream, const LazyMessageSet & ms)
+  {
+    oStream << BE<int32_t>{static_cast<int32_t>(ms.size)};
+    oStream.write(reinterpret_cast<const char *>(ms.data), ms.size);
+    return oStream;
+  }
+  friend buffer::reader & operator >> (buffer::reader & iBuf, LazyMessageSet & ms)
+  {
+    BE<int32_t> sz;
+    iBuf >> sz;
+    ms.size = sz.value < 0 ? 0 : sz.value;
+    ms.data = iBuf.length(ms.size) ? iBuf.take(ms.size) : nullptr;
+    if (!ms.data)
+      ms.size = 0;
+    return iBuf;
+  }
+};
+
+/*
+ * ProduceRequest
+ * MessageSet includes its MessageSetSize prefix.
+ */
+template <typename S>
+struct basic_ProduceRequest {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    message_set_t<S> MessageSet;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, MessageSet)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  BE<int16_t> RequiredAcks;
+  BE<int32_t> Timeout;
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_ProduceRequest, RequiredAcks),
+                        KPP_FIELD(basic_ProduceRequest, Timeout),
+                        KPP_FIELD(basic_ProduceRequest, Topics)>;
+};
+using ProduceRequest = basic_ProduceRequest<Owned>;
+using ProduceRequestView = basic_ProduceRequest<Borrowed>;
+
+template <typename S>
+struct basic_ProduceResponse {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<Error::Type> ErrorCode;
+    BE<int64_t> Offset;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, ErrorCode),
+                          KPP_FIELD(PartitionsT, Offset)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_ProduceResponse, Topics)>;
+};
+using ProduceResponse = basic_ProduceResponse<Owned>;
+using ProduceResponseView = basic_ProduceResponse<Borrowed>;
+
+template <typename S>
+struct basic_FetchRequest {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<int64_t> FetchOffset;
+    BE<int32_t> MaxBytes;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, FetchOffset),
+                          KPP_FIELD(PartitionsT, MaxBytes)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  BE<int32_t> ReplicaId;
+  BE<int32_t> MaxWaitTime;
+  BE<int32_t> MinBytes;
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_FetchRequest, ReplicaId),
+                        KPP_FIELD(basic_FetchRequest, MaxWaitTime),
+                        KPP_FIELD(basic_FetchRequest, MinBytes),
+                        KPP_FIELD(basic_FetchRequest, Topics)>;
+};
+using FetchRequest = basic_FetchRequest<Owned>;
+using FetchRequestView = basic_FetchRequest<Borrowed>;
+
+/*
+ * FetchResponse
+ * MessageSet includes its MessageSetSize prefix. In FetchResponseView it is
+ * a LazyMessageSet over the frame buffer.
+ */
+template <typename S>
+struct basic_FetchResponse {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<Error::Type> ErrorCode;
+    BE<int64_t> HighwaterMarkOffset;
+    message_set_t<S> MessageSet;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, ErrorCode),
+                          KPP_FIELD(PartitionsT, HighwaterMarkOffset),
+                          KPP_FIELD(PartitionsT, MessageSet)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_FetchResponse, Topics)>;
+};
+using FetchResponse = basic_FetchResponse<Owned>;
+using FetchResponseView = basic_FetchResponse<Borrowed>;
+
+template <typename S>
+struct basic_OffsetFetchResponse {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<int64_t> Offset;
+    string_t<S> Metadata;
+    BE<Error::Type> ErrorCode;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, Offset),
+                          KPP_FIELD(PartitionsT, Metadata),
+                          KPP_FIELD(PartitionsT, ErrorCode)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetFetchResponse, Topics)>;
+};
+using OffsetFetchResponse = basic_OffsetFetchResponse<Owned>;
+using OffsetFetchResponseView = basic_OffsetFetchResponse<Borrowed>;
+
+template <typename S>
+struct basic_OffsetFetchRequest {
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, BE<int32_t>> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  string_t<S> ConsumerGroup;
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetFetchRequest, ConsumerGroup),
+                        KPP_FIELD(basic_OffsetFetchRequest, Topics)>;
+};
+using OffsetFetchRequest = basic_OffsetFetchRequest<Owned>;
+using OffsetFetchRequestView = basic_OffsetFetchRequest<Borrowed>;
+
+
+
+template <typename S>
+struct basic_OffsetCommitResponse {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<Error::Type> ErrorCode;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, ErrorCode)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetCommitResponse, Topics)>;
+};
+using OffsetCommitResponse = basic_OffsetCommitResponse<Owned>;
+using OffsetCommitResponseView = basic_OffsetCommitResponse<Borrowed>;
+
+
+template <typename S>
+struct basic_OffsetCommitRequest {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<int64_t> Offset;
+    BE<int64_t> Timestamp;
+    string_t<S> Metadata;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, Offset),
+                          KPP_FIELD(PartitionsT, Timestamp),
+                          KPP_FIELD(PartitionsT, Metadata)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  string_t<S> ConsumerGroup;
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetCommitRequest, ConsumerGroup),
+                        KPP_FIELD(basic_OffsetCommitRequest, Topics)>;
+};
+using OffsetCommitRequest = basic_OffsetCommitRequest<Owned>;
+using OffsetCommitRequestView = basic_OffsetCommitRequest<Borrowed>;
+
+
+template <typename S>
+struct basic_ConsumerMetadataResponse {
+  BE<Error::Type> ErrorCode;
+  BE<int32_t> CoordinatorId;
+  string_t<S> CoordinatorHost;
+  BE<int32_t> CoordinatorPort;
+
+  using schema = fields<KPP_FIELD(basic_ConsumerMetadataResponse, ErrorCode),
+                        KPP_FIELD(basic_ConsumerMetadataResponse, CoordinatorId),
+                        KPP_FIELD(basic_ConsumerMetadataResponse, CoordinatorHost),
+                        KPP_FIELD(basic_ConsumerMetadataResponse, CoordinatorPort)>;
+};
+using ConsumerMetadataResponse = basic_ConsumerMetadataResponse<Owned>;
+using ConsumerMetadataResponseView = basic_ConsumerMetadataResponse<Borrowed>;
+
+
+
+template <typename S>
+struct basic_ConsumerMetadataRequest {
+  string_t<S> ConsumerGroup;
+
+  using schema = fields<KPP_FIELD(basic_ConsumerMetadataRequest, ConsumerGroup)>;
+};
+using ConsumerMetadataRequest = basic_ConsumerMetadataRequest<Owned>;
+using ConsumerMetadataRequestView = basic_ConsumerMetadataRequest<Borrowed>;
+
+
+template <typename S>
+struct basic_OffsetResponse {
 
   struct PartitionOffsetT {
     BE<int32_t> Partition;
     BE<Error::Type> ErrorCode;
-    Array<BE<int64_t>> Offset;
+    array_t<S, BE<int64_t>> Offset;
+
+    using schema = fields<KPP_FIELD(PartitionOffsetT, Partition),
+                          KPP_FIELD(PartitionOffsetT, ErrorCode),
+                          KPP_FIELD(PartitionOffsetT, Offset)>;
   };
 
   struct TopicsT {
-    String TopicName;
-    Array<PartitionOffsetT> Partitions;
+    string_t<S> TopicName;
+    array_t<S, PartitionOffsetT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
   };
-  Array<PartitionOffsetT> Topics; 
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetResponse, Topics)>;
 };
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetResponse & ocr)
+using OffsetResponse = basic_OffsetResponse<Owned>;
+using OffsetResponseView = basic_OffsetResponse<Borrowed>;
+
+
+/*
+ * OffsetRequest
+ * Time -1 asks for the latest offset, -2 for the earliest.
+ */
+template <typename S>
+struct basic_OffsetRequest {
+  struct PartitionsT {
+    BE<int32_t> Partition;
+    BE<int64_t> Time;
+    BE<int32_t> MaxNumberOfOffsets;
+
+    using schema = fields<KPP_FIELD(PartitionsT, Partition),
+                          KPP_FIELD(PartitionsT, Time),
+                          KPP_FIELD(PartitionsT, MaxNumberOfOffsets)>;
+  };
+  struct TopicsT {
+    string_t<S> TopicName;
+    array_t<S, PartitionsT> Partitions;
+
+    using schema = fields<KPP_FIELD(TopicsT, TopicName),
+                          KPP_FIELD(TopicsT, Partitions)>;
+  };
+  BE<int32_t> ReplicaId;
+  array_t<S, TopicsT> Topics;
+
+  using schema = fields<KPP_FIELD(basic_OffsetRequest, ReplicaId),
+                        KPP_FIELD(basic_OffsetRequest, Topics)>;
+};
+using OffsetRequest = basic_OffsetRequest<Owned>;
+using OffsetRequestView = basic_OffsetRequest<Borrowed>;
+
+
+/*
+ * MetadataRequest
+ * An empty topic list asks for every topic.
+ */
+template <typename S>
+struct basic_MetadataRequest {
+  array_t<S, string_t<S>> Topics;
+
+  using schema = fields<KPP_FIELD(basic_MetadataRequest, Topics)>;
+};
+using MetadataRequest = basic_MetadataRequest<Owned>;
+using MetadataRequestView = basic_MetadataRequest<Borrowed>;
+
+template <typename S>
+struct basic_MetadataResponse {
+  struct BrokerT {
+    BE<int32_t> NodeId;
+    string_t<S> Host;
+    BE<int32_t> Port;
+
+    using schema = fields<KPP_FIELD(BrokerT, NodeId),
+                          KPP_FIELD(BrokerT, Host),
+                          KPP_FIELD(BrokerT, Port)>;
+  };
+  struct PartitionMetadataT {
+    BE<Error::Type> PartitionErrorCode;
+    BE<int32_t> PartitionId;
+    BE<int32_t> Leader;
+    array_t<S, BE<int32_t>> Replicas;
+    array_t<S, BE<int32_t>> Isr;
+
+    using schema = fields<KPP_FIELD(PartitionMetadataT, PartitionErrorCode),
+                          KPP_FIELD(PartitionMetadataT, PartitionId),
+                          KPP_FIELD(PartitionMetadataT, Leader),
+                          KPP_FIELD(PartitionMetadataT, Replicas),
+                          KPP_FIELD(PartitionMetadataT, Isr)>;
+  };
+  struct TopicMetadataT {
+    BE<Error::Type> TopicErrorCode;
+    string_t<S> TopicName;
+    array_t<S, PartitionMetadataT> PartitionMetadata;
+
+    using schema = fields<KPP_FIELD(TopicMetadataT, TopicErrorCode),
+                          KPP_FIELD(TopicMetadataT, TopicName),
+                          KPP_FIELD(TopicMetadataT, PartitionMetadata)>;
+  };
+  array_t<S, BrokerT> Brokers;
+  array_t<S, TopicMetadataT> TopicMetadata;
+
+  using schema = fields<KPP_FIELD(basic_MetadataResponse, Brokers),
+                        KPP_FIELD(basic_MetadataResponse, TopicMetadata)>;
+};
+using MetadataResponse = basic_MetadataResponse<Owned>;
+using MetadataResponseView = basic_MetadataResponse<Borrowed>;
+
+
+template <typename S>
+struct basic_RequestHeader {
+  BE<int16_t> ApiKey;
+  BE<int16_t> ApiVersion;
+  BE<int32_t> CorrelationId;
+  string_t<S> ClientId;
+
+  using schema = fields<KPP_FIELD(basic_RequestHeader, ApiKey),
+                        KPP_FIELD(basic_RequestHeader, ApiVersion),
+                        KPP_FIELD(basic_RequestHeader, CorrelationId),
+                        KPP_FIELD(basic_RequestHeader, ClientId)>;
+};
+using RequestHeader = basic_RequestHeader<Owned>;
+using RequestHeaderView = basic_RequestHeader<Borrowed>;
+
+struct ResponseHeader {
+  BE<int32_t> CorrelationId;
+
+  using schema = fields<KPP_FIELD(ResponseHeader, CorrelationId)>;
+};
+
+/*
+ * api_key
+ * The ApiKey a message travels under; a response shares its request's key.
+ */
+template <typename T> struct api_key;
+template <typename S> struct api_key<basic_ProduceRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::ProduceRequest> { };
+template <typename S> struct api_key<basic_ProduceResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::ProduceRequest> { };
+template <typename S> struct api_key<basic_FetchRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::FetchRequest> { };
+template <typename S> struct api_key<basic_FetchResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::FetchRequest> { };
+template <typename S> struct api_key<basic_OffsetRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetRequest> { };
+template <typename S> struct api_key<basic_OffsetResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetRequest> { };
+template <typename S> struct api_key<basic_MetadataRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::MetadataRequest> { };
+template <typename S> struct api_key<basic_MetadataResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::MetadataRequest> { };
+template <typename S> struct api_key<basic_OffsetCommitRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetCommitRequest> { };
+template <typename S> struct api_key<basic_OffsetCommitResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetCommitRequest> { };
+template <typename S> struct api_key<basic_OffsetFetchRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetFetchRequest> { };
+template <typename S> struct api_key<basic_OffsetFetchResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::OffsetFetchRequest> { };
+template <typename S> struct api_key<basic_ConsumerMetadataRequest<S>> : std::integral_constant<ApiKey::Type, ApiKey::ConsumerMetadataRequest> { };
+template <typename S> struct api_key<basic_ConsumerMetadataResponse<S>> : std::integral_constant<ApiKey::Type, ApiKey::ConsumerMetadataRequest> { };
+
+/*
+ * RequestMessage, ResponseMessage
+ * The two unions of the grammar, as variants over the message structs.
+ */
+template <typename S>
+using basic_RequestMessage = ::variant::variant<basic_MetadataRequest<S>,
+                                              basic_ProduceRequest<S>,
+                                              basic_FetchRequest<S>,
+                                              basic_OffsetRequest<S>,
+                                              basic_OffsetCommitRequest<S>,
+                                              basic_OffsetFetchRequest<S>,
+                                              basic_ConsumerMetadataRequest<S>>;
+using RequestMessage = basic_RequestMessage<Owned>;
+using RequestMessageView = basic_RequestMessage<Borrowed>;
+
+template <typename S>
+using basic_ResponseMessage = ::variant::variant<basic_MetadataResponse<S>,
+                                               basic_ProduceResponse<S>,
+                                               basic_FetchResponse<S>,
+                                               basic_OffsetResponse<S>,
+                                               basic_OffsetCommitResponse<S>,
+                                               basic_OffsetFetchResponse<S>,
+                                               basic_ConsumerMetadataResponse<S>>;
+using ResponseMessage = basic_ResponseMessage<Owned>;
+using ResponseMessageView = basic_ResponseMessage<Borrowed>;
+
+/*
+ * message_dispatch
+ * ApiKey to alternative mapping for a RequestMessage or ResponseMessage,
+ * kept in a table indexed by key so decoding a frame costs two indexed
+ * loads and one indirect call.
+ */
+template <typename V> struct message_dispatch;
+template <typename... Ts>
+struct message_dispatch<::variant::variant<Ts...>> {
+  using message_t = ::variant::variant<Ts...>;
+  static const size_t npos = sizeof...(Ts);
+  static const size_t key_limit = 64;
+
+  static size_t index(ApiKey::Type key)
+  {
+    static const table_t table;
+    return key >= 0 && static_cast<size_t>(key) < key_limit ? table.slot[key] : npos;
+  }
+
+  template <typename IStream>
+  static bool decode(ApiKey::Type key, IStream & iStream, message_t & msg)
+  {
+    using fn = void (*)(IStream &, message_t &);
+    static constexpr fn table[] = { &decode_one<Ts, IStream>... };
+    const size_t i = index(key);
+    if (i == npos)
+    {
+      msg.reset();
+      set_failed(iStream);
+      return false;
+    }
+    table[i](iStream, msg);
+    return static_cast<bool>(iStream);
+  }
+
+private:
+  struct table_t {
+    uint8_t slot[key_limit];
+
+    table_t()
+    {
+      const ApiKey::Type keys[] = { api_key<Ts>::value... };
+      std::fill(slot, slot + key_limit, static_cast<uint8_t>(npos));
+      for (size_t i = 0; i < sizeof...(Ts); ++i)
+        slot[keys[i]] = static_cast<uint8_t>(i);
+    }
+  };
+
+  template <typename T, typename IStream>
+  static void decode_one(IStream & iStream, message_t & msg)
+  {
+    iStream >> msg.template set<T>();
+  }
+};
+
+/*
+ * decode_message
+ * Decode the body of a frame whose ApiKey is 'key' into the matching
+ * alternative of 'msg'. An unknown key fails the stream and leaves 'msg'
+ * empty. Responses carry no ApiKey on the wire; pass the one their
+ * CorrelationId was sent with.
+ */
+template <typename IStream, typename... Ts>
+bool decode_message(ApiKey::Type key, IStream & iStream, ::variant::variant<Ts...> & msg)
 {
-  oStream << ocr.Topics;
-  return oStream;
+  return message_dispatch<::variant::variant<Ts...>>::decode(key, iStream, msg);
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetResponse & ocr)
+
+// ApiKey of the message held in 'msg'.
+struct api_key_of {
+  template <typename T>
+  ApiKey::Type operator () (const T &) const { return api_key<T>::value; }
+};
+template <typename... Ts>
+ApiKey::Type message_key(const ::variant::variant<Ts...> & msg)
 {
-  iStream >> ocr.Topics;
-  return iStream;
+  return msg.visit(api_key_of());
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetResponse::TopicsT & t)
+
+// Encode whichever message 'msg' holds; an empty variant encodes nothing.
+template <typename OStream>
+struct message_encoder {
+  OStream & oStream;
+
+  template <typename T>
+  void operator () (const T & msg) const { oStream << msg; }
+};
+template <typename OStream, typename T, typename... Ts>
+OStream & operator << (OStream & oStream, const ::variant::variant<T, Ts...> & msg)
 {
-  oStream << t.TopicName;
-  oStream << t.Partitions;
+  if (msg.valid())
+    msg.visit(message_encoder<OStream>{oStream});
   return oStream;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetResponse::TopicsT & t)
+
+/*
+ * decode_bounded
+ * Decode a T from [data, data + size) with every length and count vetted
+ * against 'limits' and the bytes left before anything is allocated. A
+ * malformed or truncated input fails at the first bad prefix, without
+ * exceptions; the result says why, or is status::ok when 'out' is whole.
+ */
+template <typename T>
+buffer::status decode_bounded(const uint8_t * data, size_t size, T & out,
+                              const buffer::limits & limits = buffer::limits())
 {
-  iStream >> t.TopicName;
-  iStream >> t.Partitions;
-  return iStream;
+  buffer::reader iBuf(data, size);
+  iBuf.limit = limits;
+  iBuf >> out;
+  return iBuf.good() ? buffer::status::ok : iBuf.error;
 }
-template <typename charT, typename traits>
-std::basic_ostream<charT,traits> & operator << (std::basic_ostream<charT,traits> & oStream, 
-                                                const OffsetResponse::PartitionOffsetT & p)
+
+/*
+ * Decoded
+ * A message decoded in place from 'frame'. With the Borrowed policy its
+ * strings and bytes point into 'frame', which lives as long as any copy of
+ * the Decoded that refers to it.
+ */
+template <typename T>
+struct Decoded {
+  std::shared_ptr<const std::vector<uint8_t>> frame;
+  T message;
+  bool ok;
+
+  T * operator -> () { return &message; }
+  const T * operator -> () const { return &message; }
+};
+
+/*
+ * decode_view
+ * Decode a T from 'frame' starting at 'offset', typically past the Size
+ * and header fields.
+ */
+template <typename T>
+Decoded<T> decode_view(std::shared_ptr<const std::vector<uint8_t>> frame, size_t offset = 0)
 {
-  oStream << p.Partition;
-  oStream << p.ErrorCode;
-  oStream << p.Offset;
-  return oStream;
+  Decoded<T> decoded;
+  decoded.frame = std::move(frame);
+  const std::vector<uint8_t> & bytes = *decoded.frame;
+  buffer::reader iBuf(bytes.data() + std::min(offset, bytes.size()), bytes.data() + bytes.size());
+  iBuf >> decoded.message;
+  decoded.ok = iBuf.good();
+  return decoded;
 }
-template <typename charT, typename traits>
-std::basic_istream<charT,traits> & operator >> (std::basic_istream<charT,traits> & iStream, 
-                                                OffsetResponse::PartitionOffsetT & p)
+
+/*
+ * ArenaDecoded
+ * A message decoded with one of the Arena policies. The message itself and
+ * its whole tree of arrays, strings and bytes live in 'arena', so dropping
+ * the ArenaDecoded gives it all back at once. Move-only; the arena can be
+ * recycled for the next response with recycle().
+ */
+template <typename T>
+class ArenaDecoded {
+public:
+  bool ok;
+
+  explicit ArenaDecoded(std::unique_ptr<arena::monotonic> a)
+    : ok(false), arena_(a ? std::move(a) : std::unique_ptr<arena::monotonic>(new arena::monotonic)), message_(nullptr)
+  {
+    arena::scope in(*arena_);
+    message_ = new (arena_->allocate(sizeof(T), alignof(T))) T();
+  }
+  ArenaDecoded(ArenaDecoded && other)
+    : ok(other.ok), arena_(std::move(other.arena_)), message_(other.message_)
+  {
+    other.message_ = nullptr;
+  }
+  ArenaDecoded & operator = (ArenaDecoded && other)
+  {
+    std::swap(ok, other.ok);
+    std::swap(arena_, other.arena_);
+    std::swap(message_, other.message_);
+    return *this;
+  }
+  ~ArenaDecoded() { destroy(); }
+
+  T & operator * () { return *message_; }
+  const T & operator * () const { return *message_; }
+  T * operator -> () { return message_; }
+  const T * operator -> () const { return message_; }
+
+  arena::monotonic & arena() { return *arena_; }
+
+  // Drop the message and hand back its arena, reset, for the next decode.
+  std::unique_ptr<arena::monotonic> recycle()
+  {
+    destroy();
+    arena_->reset();
+    return std::move(arena_);
+  }
+
+private:
+  void destroy()
+  {
+    // Containers deallocate into the arena as a no-op; this only runs
+    // element destructors.
+    if (message_)
+      message_->~T();
+    message_ = nullptr;
+  }
+
+  std::unique_ptr<arena::monotonic> arena_;
+  T * message_;
+};
+
+/*
+ * decode_in_arena
+ * Decode a T, normally basic_X<ArenaOwned> or basic_X<ArenaBorrowed>, from
+ * 'iBuf' into 'a' (a fresh arena if null). With ArenaBorrowed, 'iBuf' must
+ * outlive the result as with decode_view.
+ */
+template <typename T>
+ArenaDecoded<T> decode_in_arena(buffer::reader & iBuf, std::unique_ptr<arena::monotonic> a = nullptr)
 {
-  iStream >> p.Partition;
-  iStream >> p.ErrorCode;
-  iStream >> p.Offset;
-  return iStream;
+  ArenaDecoded<T> decoded(std::move(a));
+  arena::scope in(decoded.arena());
+  iBuf >> *decoded;
+  decoded.ok = iBuf.good();
+  return decoded;
 }
 
+/*
+ * encode_frame
+ * Append 'Size Header Message' to 'out'. The size pass runs first, so 'out'
+ * grows exactly once and the body is written straight into place behind
+ * its length prefix.
+ */
+template <typename Header, typename Msg>
+void encode_frame(std::vector<uint8_t> & out, const Header & header, const Msg & msg)
+{
+  const size_t size = encoded_size(header) + encoded_size(msg);
+  const size_t start = out.size();
+  out.resize(start + sizeof(int32_t) + size);
+  buffer::writer oBuf(out.data() + start, out.data() + out.size());
+  oBuf << BE<int32_t>{static_cast<int32_t>(size)};
+  oBuf << header;
+  oBuf << msg;
+}
+template <typename Header, typename Msg>
+std::vector<uint8_t> encode_frame(const Header & header, const Msg & msg)
+{
+  std::vector<uint8_t> out;
+  encode_frame(out, header, msg);
+  return out;
+}
 
-
+/*
+ * encode_frame
+ * Append 'Size Header Message' to 'out' as gather pieces: payloads of at
+ * least out.min_reference bytes are referenced, not copied, and must stay
+ * alive until the frame has been written.
+ */
+template <typename Header, typename Msg>
+void encode_frame(buffer::gather & out, const Header & header, const Msg & msg)
+{
+  const size_t size = encoded_size(header) + encoded_size(msg);
+  out << BE<int32_t>{static_cast<int32_t>(size)};
+  out << header;
+  out << msg;
+}
 
 }
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace kpp {
+
+/*
+ * SegmentStore
+ * Local append-only log of fetched MessageSet entries, kept in their wire
+ * form 'Offset MessageSize Message', so read() hands back a LazyMessageSet
+ * pointing straight into the mapped file and the same iteration, verify()
+ * and decompression run on spooled data as on a live FetchResponse.
+ *
+ * Entries go into segment files named after their first offset
+ * (00000000000000000042.log) in one directory, each preallocated to
+ * segment_bytes and mapped whole. A segment keeps a sparse index: one
+ * (offset, position) pair per index_interval bytes. Lookup picks the
+ * segment by binary search, then the index entry, then scans at most
+ * index_interval bytes of entry headers.
+ *
+ * A compressed wrapper is stored as fetched, under the offset of its last
+ * inner message; read(offset) starts at the entry holding 'offset'.
+ *
+ * The index lives in memory and is rebuilt from the files by open(). A
+ * closed segment is cut down to its entries; the last one is scanned on
+ * open() and ends at its first malformed or corrupt entry, which drops a
+ * torn write after a crash.
+ *
+ * Calls fail with false and error() set to an errno value; each call
+ * starts by clearing it, so error() describes the latest one. Not
+ * thread-safe. A read() stays valid until trim() removes its segment or
+ * the store is closed.
+ */
+class SegmentStore {
+public:
+  struct Config {
+    size_t segment_bytes;
+    size_t index_interval;
+
+    Config() : segment_bytes(256 << 20), index_interval(4096) { }
+  };
+
+  explicit SegmentStore(const Config & config = Config()) : config_(config), error_(0) { }
+
+  SegmentStore(const SegmentStore &) = delete;
+  SegmentStore & operator = (const SegmentStore &) = delete;
+
+  ~SegmentStore() { close(); }
+
+  /*
+   * open
+   * Use 'dir', which must exist, and load the segments already in it.
+   */
+  bool open(const std::string & dir)
+  {
+    close();
+    error_ = 0;
+    dir_ = dir;
+    DIR * d = ::opendir(dir.c_str());
+    if (!d)
+      return set_error(errno);
+    std::vector<int64_t> bases;
+    while (dirent * e = ::readdir(d))
+    {
+      int64_t base;
+      char tail;
+      if (std::strlen(e->d_name) == 24 && std::sscanf(e->d_name, "%20" SCNd64 ".lo%c", &base, &tail) == 2 && tail == 'g')
+        bases.push_back(base);
+    }
+    ::closedir(d);
+    std::sort(bases.begin(), bases.end());
+    for (size_t i = 0; i < bases.size(); ++i)
+      if (!load(bases[i], i + 1 == bases.size()))
+        return false;
+    return true;
+  }
+
+  // Unmap every segment, cutting the last one down to its entries.
+  void close()
+  {
+    if (!segments_.empty())
+      seal(segments_.back());
+    for (auto itor = segments_.begin(); itor != segments_.end(); ++itor)
+      unmap(*itor);
+    segments_.clear();
+  }
+
+  bool empty() const { return segments_.empty() || segments_.front().last < 0; }
+
+  // Offset of the first entry held, or -1 when empty.
+  int64_t start_offset() const { return empty() ? -1 : segments_.front().first; }
+
+  // Offset after the last entry held, or -1 when empty.
+  int64_t next_offset() const { return empty() ? -1 : segments_.back().last + 1; }
+
+  int error() const { return error_; }
+
+  /*
+   * append
+   * Store every complete entry of 'set' that comes after what is already
+   * held; a repeated fetch of the same range only adds what is new. The
+   * bytes are copied as they are, without decoding.
+   */
+  bool append(const LazyMessageSet & set)
+  {
+    error_ = 0;
+    if (dir_.empty())
+      return set_error(EBADF);
+    const size_t entry_header = sizeof(int64_t) + sizeof(int32_t);
+    for (auto itor = set.begin(); itor != set.end(); ++itor)
+    {
+      if (!empty() && itor->offset < next_offset())
+        continue;
+      const uint8_t * entry = itor->message - entry_header;
+      const size_t size = entry_header + itor->size;
+      if (segments_.empty() || segments_.back().size + size > segments_.back().capacity)
+        if (!roll(itor->offset, size))
+          return false;
+      Segment & s = segments_.back();
+      std::memcpy(s.data + s.size, entry, size);
+      index(s, itor->offset, s.size);
+      s.size += size;
+      s.last = itor->offset;
+      s.dirty = true;
+    }
+    return true;
+  }
+
+  /*
+   * read
+   * Entries from the one holding 'offset' to the end of its segment, at
+   * most max_bytes of them; the last may be cut short as in a fetch.
+   * Empty once 'offset' reaches next_offset(). Continue from the result's
+   * next_offset() to cross into the following segment.
+   */
+  LazyMessageSet read(int64_t offset, size_t max_bytes) const
+  {
+    auto s = std::lower_bound(segments_.begin(), segments_.end(), offset,
+                              [](const Segment & seg, int64_t o) { return seg.last < o; });
+    if (s == segments_.end())
+      return LazyMessageSet();
+    const size_t start = find(*s, offset);
+    return LazyMessageSet(s->data + start, std::min(max_bytes, s->size - start));
+  }
+
+  /*
+   * trim
+   * Delete the segments whose entries all come before 'offset'. The
+   * segment being appended to is kept.
+   */
+  bool trim(int64_t offset)
+  {
+    error_ = 0;
+    while (segments_.size() > 1 && segments_.front().last < offset)
+    {
+      Segment & s = segments_.front();
+      unmap(s);
+      if (::unlink(path(s.first).c_str()) != 0)
+        set_error(errno);
+      segments_.erase(segments_.begin());
+    }
+    return error_ == 0;
+  }
+
+  // msync every segment appended to since the last flush().
+  bool flush()
+  {
+    error_ = 0;
+    for (auto itor = segments_.begin(); itor != segments_.end(); ++itor)
+    {
+      if (!itor->dirty)
+        continue;
+      if (::msync(itor->data, itor->size, MS_SYNC) != 0)
+        return set_error(errno);
+      itor->dirty = false;
+    }
+    return true;
+  }
+
+private:
+  struct Mark {
+    int64_t offset;
+    size_t position;
+  };
+
+  struct Segment {
+    int64_t first;
+    int64_t last;       // offset of the last entry, -1 when none
+    int fd;
+    uint8_t * data;
+    size_t size;
+    size_t capacity;
+    std::vector<Mark> marks;
+    bool dirty;         // appended to since the last flush()
+  };
+
+  bool set_error(int error)
+  {
+    error_ = error;
+    return false;
+  }
+
+  std::string path(int64_t base) const
+  {
+    char name[32];
+    std::snprintf(name, sizeof name, "%020" PRId64 ".log", base);
+    return dir_ + "/" + name;
+  }
+
+  void index(Segment & s, int64_t offset, size_t position)
+  {
+    if (s.marks.empty() || position - s.marks.back().position >= config_.index_interval)
+      s.marks.push_back(Mark{offset, position});
+  }
+
+  // Position of the first entry at or past 'offset'.
+  size_t find(const Segment & s, int64_t offset) const
+  {
+    auto mark = std::lower_bound(s.marks.begin(), s.marks.end(), offset,
+                                 [](const Mark & m, int64_t o) { return m.offset < o; });
+    size_t position = mark == s.marks.begin() ? 0 : (mark - 1)->position;
+    LazyMessageSet rest(s.data + position, s.size - position);
+    for (auto itor = rest.begin(); itor != rest.end(); ++itor)
+    {
+      if (itor->offset >= offset)
+        break;
+      position = itor->message + itor->size - s.data;
+    }
+    return position;
+  }
+
+  bool map(Segment & s, size_t capacity)
+  {
+    if (::ftruncate(s.fd, static_cast<off_t>(capacity)) != 0)
+      return set_error(errno);
+    void * p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, s.fd, 0);
+    if (p == MAP_FAILED)
+      return set_error(errno);
+    s.data = static_cast<uint8_t *>(p);
+    s.capacity = capacity;
+    return true;
+  }
+
+  void unmap(Segment & s)
+  {
+    if (s.data)
+      ::munmap(s.data, s.capacity);
+    if (s.fd >= 0)
+      ::close(s.fd);
+    s.data = nullptr;
+    s.fd = -1;
+  }
+
+  // Give a finished segment back its unused preallocation.
+  void seal(Segment & s)
+  {
+    if (s.fd >= 0 && ::ftruncate(s.fd, static_cast<off_t>(s.size)) != 0)
+      set_error(errno);
+  }
+
+  // Start a segment at 'base' large enough for an entry of 'size' bytes.
+  bool roll(int64_t base, size_t size)
+  {
+    if (!segments_.empty())
+      seal(segments_.back());
+    Segment s = {base, -1, -1, nullptr, 0, 0, std::vector<Mark>(), false};
+    s.fd = ::open(path(base).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s.fd < 0)
+      return set_error(errno);
+    if (!map(s, std::max(config_.segment_bytes, size)))
+    {
+      unmap(s);
+      ::unlink(path(base).c_str());
+      return false;
+    }
+    segments_.push_back(std::move(s));
+    return true;
+  }
+
+  // Map an existing segment and rebuild its index.
+  bool load(int64_t base, bool active)
+  {
+    Segment s = {base, -1, -1, nullptr, 0, 0, std::vector<Mark>(), false};
+    s.fd = ::open(path(base).c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (s.fd < 0 || ::fstat(s.fd, &st) != 0)
+    {
+      set_error(errno);
+      unmap(s);
+      return false;
+    }
+    const size_t file_size = static_cast<size_t>(st.st_size);
+    if (file_size == 0)
+    {
+      unmap(s);
+      ::unlink(path(base).c_str());
+      return true;
+    }
+    if (!map(s, active ? std::max(config_.segment_bytes, file_size) : file_size))
+    {
+      unmap(s);
+      return false;
+    }
+    // Smallest valid Message: Crc, MagicByte, Attributes and two lengths.
+    const size_t min_message = 2 * sizeof(int32_t) + 2 * sizeof(int8_t) + sizeof(int32_t);
+    LazyMessageSet entries(s.data, file_size);
+    for (auto itor = entries.begin(); itor != entries.end(); ++itor)
+    {
+      if (itor->size < min_message || itor->offset <= s.last || itor->offset < next_offset() ||
+          (active && !itor->verify()))
+        break;
+      const size_t position = itor->message - s.data - sizeof(int64_t) - sizeof(int32_t);
+      index(s, itor->offset, position);
+      s.size = itor->message + itor->size - s.data;
+      s.last = itor->offset;
+    }
+    if (s.last < 0)
+    {
+      unmap(s);
+      ::unlink(path(base).c_str());
+      return true;
+    }
+    segments_.push_back(std::move(s));
+    return true;
+  }
+
+  Config config_;
+  std::string dir_;
+  std::vector<Segment> segments_;
+  int error_;
+};
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <kpp_protocol.hpp>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+
+namespace kpp {
+
+/*
+ * field_locator
+ * A size pass that also notes where every fixed-width field lands: the
+ * address of each BE<INT> it is given and its offset in the encoding. It
+ * goes member by member, since the counter's shortcuts for fixed-width
+ * runs and arrays would step over the fields without seeing them.
+ */
+struct field_locator : buffer::counter {
+  struct mark {
+    const void * address;
+    size_t offset;
+    size_t width;
+  };
+  std::vector<mark> marks;
+};
+template <typename INT>
+field_locator & operator << (field_locator & oLocate, const BE<INT> & benum)
+{
+  oLocate.marks.push_back(field_locator::mark{&benum, oLocate.count, sizeof(INT)});
+  oLocate.count += sizeof(INT);
+  return oLocate;
+}
+
+/*
+ * RequestTemplate
+ * A request frame, 'Size Header Message', encoded once and sent many
+ * times with only its fixed-width fields rewritten in place in between:
+ * the FetchOffsets of a fetch that keeps polling the same partitions, or
+ * the CorrelationId of each copy. Strings and arrays are not encoded
+ * again, and since every patched field keeps its width, neither is Size.
+ *
+ * After encode(), locate() turns any BE member of the header or message,
+ * found by its address, into a Field handle for set() and get(). So it
+ * must run while the header and message that were encoded are still alive
+ * and unchanged; the handles themselves are offsets and stay valid until
+ * the next encode(). Fields inside a Message are covered by its Crc and
+ * must not be patched.
+ */
+class RequestTemplate {
+public:
+  template <typename INT>
+  struct Field {
+    size_t offset;
+  };
+
+  template <typename Header, typename Msg>
+  void encode(const Header & header, const Msg & msg)
+  {
+    frame_.clear();
+    encode_frame(frame_, header, msg);
+    field_locator oLocate;
+    oLocate.count = sizeof(int32_t);
+    oLocate << header;
+    oLocate << msg;
+    marks_.swap(oLocate.marks);
+    std::sort(marks_.begin(), marks_.end(), before);
+  }
+
+  // Handle of 'member', a field of what was encoded; false if it is not one.
+  template <typename INT>
+  bool locate(const BE<INT> & member, Field<INT> & out) const
+  {
+    const field_locator::mark key = {&member, 0, 0};
+    auto found = std::lower_bound(marks_.begin(), marks_.end(), key, before);
+    if (found == marks_.end() || found->address != &member || found->width != sizeof(INT))
+      return false;
+    out.offset = found->offset;
+    return true;
+  }
+
+  template <typename INT>
+  void set(Field<INT> field, INT value)
+  {
+    uint8_t * p = frame_.data() + field.offset;
+    store_raw(p, BE<INT>{value});
+  }
+
+  template <typename INT>
+  INT get(Field<INT> field) const
+  {
+    const uint8_t * p = frame_.data() + field.offset;
+    BE<INT> benum;
+    load_raw(p, benum);
+    return benum.value;
+  }
+
+  // ApiKey and CorrelationId, where a RequestHeader puts them.
+  static Field<int16_t> api_key() { return Field<int16_t>{sizeof(int32_t)}; }
+  static Field<int32_t> correlation_id() { return Field<int32_t>{sizeof(int32_t) + 2 * sizeof(int16_t)}; }
+
+  bool empty() const { return frame_.empty(); }
+  const uint8_t * data() const { return frame_.data(); }
+  size_t size() const { return frame_.size(); }
+  const std::vector<uint8_t> & frame() const { return frame_; }
+
+private:
+  static bool before(const field_locator::mark & a, const field_locator::mark & b)
+  {
+    return std::less<const void *>()(a.address, b.address);
+  }
+
+  std::vector<uint8_t> frame_;
+  std::vector<field_locator::mark> marks_;
+};
+
+}
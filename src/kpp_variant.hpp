@@ -1,134 +1,330 @@
-#include <iostream>
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
 #include <utility>
 #include <typeinfo>
 #include <type_traits>
-#include <string>
+#include <tuple>
 
 namespace variant {
 
 template <size_t arg1, size_t ... others>
 struct static_max;
- 
+
 template <size_t arg>
 struct static_max<arg>
 {
 	static const size_t value = arg;
 };
- 
+
 template <size_t arg1, size_t arg2, size_t ... others>
 struct static_max<arg1, arg2, others...>
 {
 	static const size_t value = arg1 >= arg2 ? static_max<arg1, others...>::value :
 	static_max<arg2, others...>::value;
 };
- 
+
+/*
+ * index_of
+ * Position of T in Ts..., or sizeof...(Ts) if it is not there.
+ */
+template <typename T, typename... Ts>
+struct index_of;
+
+template <typename T>
+struct index_of<T> : std::integral_constant<size_t, 0> { };
+
+template <typename T, typename... Ts>
+struct index_of<T, T, Ts...> : std::integral_constant<size_t, 0> { };
+
+template <typename T, typename F, typename... Ts>
+struct index_of<T, F, Ts...> : std::integral_constant<size_t, 1 + index_of<T, Ts...>::value> { };
+
+template <bool... Bs>
+struct all_of : std::true_type { };
+
+template <bool B, bool... Bs>
+struct all_of<B, Bs...> : std::integral_constant<bool, B && all_of<Bs...>::value> { };
+
+/*
+ * variant_helper
+ * One entry per alternative, plus a trailing no-op for the empty state, so
+ * every operation is a single indexed call instead of a chain of type
+ * comparisons.
+ */
 template<typename... Ts>
-struct variant_helper;
- 
-template<typename F, typename... Ts>
-struct variant_helper<F, Ts...> {
-	inline static void destroy(size_t id, void * data) 
+struct variant_helper {
+	using destroy_fn = void (*)(void *);
+	using move_fn = void (*)(void *, void *);
+	using copy_fn = void (*)(const void *, void *);
+
+	template <typename T>
+	static void destroy_one(void * data) { reinterpret_cast<T*>(data)->~T(); }
+	template <typename T>
+	static void move_one(void * old_v, void * new_v) { new (new_v) T(std::move(*reinterpret_cast<T*>(old_v))); }
+	template <typename T>
+	static void copy_one(const void * old_v, void * new_v) { new (new_v) T(*reinterpret_cast<const T*>(old_v)); }
+
+	static void destroy_none(void *) { }
+	static void move_none(void *, void *) { }
+	static void copy_none(const void *, void *) { }
+
+	inline static void destroy(size_t id, void * data)
 	{
-		if (id == typeid(F).hash_code())
-			reinterpret_cast<F*>(data)->~F();
-		else
-			variant_helper<Ts...>::destroy(id, data);
+		static constexpr destroy_fn table[] = { &destroy_one<Ts>..., &destroy_none };
+		table[id](data);
 	}
- 
+
 	inline static void move(size_t old_t, void * old_v, void * new_v)
 	{
-		if (old_t == typeid(F).hash_code())
-			new (new_v) F(std::move(*reinterpret_cast<F*>(old_v)));
-		else
-			variant_helper<Ts...>::move(old_t, old_v, new_v);       
+		static constexpr move_fn table[] = { &move_one<Ts>..., &move_none };
+		table[old_t](old_v, new_v);
 	}
- 
+
 	inline static void copy(size_t old_t, const void * old_v, void * new_v)
 	{
-		if (old_t == typeid(F).hash_code())
-			new (new_v) F(*reinterpret_cast<const F*>(old_v));
-		else
-			variant_helper<Ts...>::copy(old_t, old_v, new_v);       
-	}   
+		static constexpr copy_fn table[] = { &copy_one<Ts>..., &copy_none };
+		table[old_t](old_v, new_v);
+	}
 };
- 
-template<> struct variant_helper<>  {
-inline static void destroy(size_t id, void * data) { }
-inline static void move(size_t old_t, void * old_v, void * new_v) { }
-inline static void copy(size_t old_t, const void * old_v, void * new_v) { }
+
+/*
+ * variant_storage
+ * Index and raw storage. When every alternative is trivially copyable the
+ * storage declares no copy, move or destructor at all, so the variant is
+ * trivially copyable too and moves as a plain memcpy.
+ */
+template <bool Trivial, typename... Ts>
+struct variant_storage {
+	static const size_t data_size = static_max<sizeof(Ts)...>::value;
+	static const size_t data_align = static_max<alignof(Ts)...>::value;
+	static const uint8_t npos = sizeof...(Ts);
+
+	using data_t = typename std::aligned_storage<data_size, data_align>::type;
+
+	uint8_t type_index = npos;
+	data_t data;
+
+	void destroy() { type_index = npos; }
 };
- 
-template<typename... Ts>
-struct variant {
-private: 
+
+template <typename... Ts>
+struct variant_storage<false, Ts...> {
 	static const size_t data_size = static_max<sizeof(Ts)...>::value;
 	static const size_t data_align = static_max<alignof(Ts)...>::value;
- 
+	static const uint8_t npos = sizeof...(Ts);
+
 	using data_t = typename std::aligned_storage<data_size, data_align>::type;
- 
 	using helper_t = variant_helper<Ts...>;
-	
-	static inline size_t invalid_type() {
-		return typeid(void).hash_code();
-	}
- 
-	size_t type_id;
+
+	uint8_t type_index = npos;
 	data_t data;
-public: 
-	variant() : type_id(invalid_type()) {   }
- 
-	variant(const variant<Ts...>& old) : type_id(old.type_id)
+
+	variant_storage() { }
+
+	variant_storage(const variant_storage & old) : type_index(old.type_index)
 	{
-		helper_t::copy(old.type_id, &old.data, &data);
+		helper_t::copy(old.type_index, &old.data, &data);
 	}
- 
-	variant(variant<Ts...>&& old) : type_id(old.type_id)
+
+	variant_storage(variant_storage && old) : type_index(old.type_index)
 	{
-		helper_t::move(old.type_id, &old.data, &data);
+		helper_t::move(old.type_index, &old.data, &data);
 	}
- 
-	// Serves as both the move and the copy asignment operator.
-	variant<Ts...>& operator= (variant<Ts...> old)
+
+	variant_storage & operator= (const variant_storage & old)
 	{
-		std::swap(type_id, old.type_id);
-		std::swap(data, old.data);
- 
+		if (this != &old)
+		{
+			destroy();
+			helper_t::copy(old.type_index, &old.data, &data);
+			type_index = old.type_index;
+		}
 		return *this;
 	}
- 
+
+	variant_storage & operator= (variant_storage && old)
+	{
+		if (this != &old)
+		{
+			destroy();
+			helper_t::move(old.type_index, &old.data, &data);
+			type_index = old.type_index;
+		}
+		return *this;
+	}
+
+	~variant_storage() { destroy(); }
+
+	void destroy()
+	{
+		helper_t::destroy(type_index, &data);
+		type_index = npos;
+	}
+};
+
+/*
+ * variant
+ * Tagged union over Ts... with a one-byte compile-time index. A default
+ * constructed variant is empty (valid() is false); get<T>() on the wrong
+ * alternative throws std::bad_cast, and visit() on an empty variant does
+ * the same.
+ */
+template<typename... Ts>
+struct variant : private variant_storage<all_of<std::is_trivially_copyable<Ts>::value...>::value, Ts...> {
+private:
+	using storage_t = variant_storage<all_of<std::is_trivially_copyable<Ts>::value...>::value, Ts...>;
+	using storage_t::type_index;
+	using storage_t::data;
+
+	static_assert(sizeof...(Ts) > 0 && sizeof...(Ts) < 255, "variant needs 1 to 254 alternatives");
+
+	template <typename T>
+	struct alternative {
+		static const size_t value = index_of<T, Ts...>::value;
+		static_assert(value < sizeof...(Ts), "type is not an alternative of this variant");
+	};
+
+	template <typename R, typename T, typename F>
+	static R visit_one(F & f, void * data) { return f(*reinterpret_cast<T*>(data)); }
+	template <typename R, typename T, typename F>
+	static R visit_one_const(F & f, const void * data) { return f(*reinterpret_cast<const T*>(data)); }
+
+	template <typename F>
+	using result_t = decltype(std::declval<F&>()(std::declval<typename std::tuple_element<0, std::tuple<Ts...>>::type &>()));
+
+public:
+	static const size_t npos = sizeof...(Ts);
+
 	template<typename T>
-	void is() {
-		return (type_id == typeid(T).hash_code());
+	bool is() const {
+		return type_index == alternative<T>::value;
 	}
- 
-	void valid() {
-		return (type_id != invalid_type());
+
+	bool valid() const {
+		return type_index != npos;
+	}
+
+	// Position of the held alternative in Ts..., or npos when empty.
+	size_t index() const {
+		return type_index;
 	}
- 
+
 	template<typename T, typename... Args>
-	void set(Args&&... args)
+	T & set(Args&&... args)
 	{
-		// First we destroy the current contents    
-		helper_t::destroy(type_id, &data);      
-		new (&data) T(std::forward<Args>(args)...);
-		type_id = typeid(T).hash_code();
+		// First we destroy the current contents
+		storage_t::destroy();
+		T * value = new (&data) T(std::forward<Args>(args)...);
+		type_index = alternative<T>::value;
+		return *value;
 	}
- 
+
 	template<typename T>
 	T& get()
 	{
 		// It is a dynamic_cast-like behaviour
-		if (type_id == typeid(T).hash_code())
+		if (type_index == alternative<T>::value)
 			return *reinterpret_cast<T*>(&data);
 		else
 			throw std::bad_cast();
-	}   
- 
-	~variant() {
-		helper_t::destroy(type_id, &data);
+	}
+
+	template<typename T>
+	const T& get() const
+	{
+		if (type_index == alternative<T>::value)
+			return *reinterpret_cast<const T*>(&data);
+		else
+			throw std::bad_cast();
+	}
+
+	// Pointer to the held T, or nullptr for any other alternative.
+	template<typename T>
+	T * get_if()
+	{
+		return type_index == alternative<T>::value ? reinterpret_cast<T*>(&data) : nullptr;
+	}
+
+	template<typename T>
+	const T * get_if() const
+	{
+		return type_index == alternative<T>::value ? reinterpret_cast<const T*>(&data) : nullptr;
+	}
+
+	// Back to empty.
+	void reset() {
+		storage_t::destroy();
+	}
+
+	/*
+	 * visit
+	 * Call f with the held alternative through one indexed jump. f must
+	 * accept every alternative, so a missing case is a compile error; all
+	 * calls must return the same type as f(first alternative).
+	 */
+	template <typename F>
+	result_t<F> visit(F && f)
+	{
+		using R = result_t<F>;
+		using fn = R (*)(F &, void *);
+		static constexpr fn table[] = { &visit_one<R, Ts, F>... };
+		if (type_index == npos)
+			throw std::bad_cast();
+		return table[type_index](f, &data);
+	}
+
+	template <typename F>
+	result_t<F> visit(F && f) const
+	{
+		using R = result_t<F>;
+		using fn = R (*)(F &, const void *);
+		static constexpr fn table[] = { &visit_one_const<R, Ts, F>... };
+		if (type_index == npos)
+			throw std::bad_cast();
+		return table[type_index](f, &data);
 	}
 };
- 
- 
- 
-} 
+
+template <typename F, typename... Ts>
+auto visit(F && f, variant<Ts...> & v) -> decltype(v.visit(std::forward<F>(f)))
+{
+	return v.visit(std::forward<F>(f));
+}
+
+template <typename F, typename... Ts>
+auto visit(F && f, const variant<Ts...> & v) -> decltype(v.visit(std::forward<F>(f)))
+{
+	return v.visit(std::forward<F>(f));
+}
+
+/*
+ * overload
+ * Combine lambdas into one visitor:
+ *   visit(overload([](const A &) { ... }, [](const B &) { ... }), v);
+ */
+template <typename... Fs>
+struct overloaded;
+
+template <typename F>
+struct overloaded<F> : F {
+	overloaded(F f) : F(std::move(f)) { }
+	using F::operator();
+};
+
+template <typename F, typename... Fs>
+struct overloaded<F, Fs...> : F, overloaded<Fs...> {
+	overloaded(F f, Fs... fs) : F(std::move(f)), overloaded<Fs...>(std::move(fs)...) { }
+	using F::operator();
+	using overloaded<Fs...>::operator();
+};
+
+template <typename... Fs>
+overloaded<typename std::decay<Fs>::type...> overload(Fs&&... fs)
+{
+	return overloaded<typename std::decay<Fs>::type...>(std::forward<Fs>(fs)...);
+}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <iostream>
+
+
+/*
+ * CHECK
+ * assert() for the tests: kept under NDEBUG, and a failure is reported and
+ * counted rather than aborting, so one run shows every broken check. A
+ * test's main() ends with 'return check_result();'.
+ */
+static int check_failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      ++check_failures; \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+    } \
+  } while (0)
+
+inline int check_result()
+{
+  if (check_failures)
+    std::cerr << check_failures << " check(s) failed" << std::endl;
+  return check_failures ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+#include <kpp_broker.hpp>
+#include <kpp_committer.hpp>
+#include "check.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * OffsetCommitter against a LoopbackBroker: commits coalesce, a commit
+ * that fails is retried by the next flush unless a newer offset was
+ * recorded meanwhile, pending or in flight, and what finally lands is the
+ * newest offset.
+ */
+
+using namespace kpp;
+
+struct Failure {
+  std::string topic;
+  int32_t partition;
+  int64_t offset;
+  int error;
+};
+
+static int64_t committed(Connection & conn, const std::string & group, const std::string & topic, int32_t partition)
+{
+  OffsetFetchRequest request;
+  request.ConsumerGroup.bytes.assign(group.begin(), group.end());
+  request.Topics.contents.resize(1);
+  request.Topics.contents[0].TopicName.bytes.assign(topic.begin(), topic.end());
+  request.Topics.contents[0].Partitions.contents.push_back(BE<int32_t>{partition});
+  OffsetFetchResponse response = conn.call<OffsetFetchResponse>(request).get();
+  if (response.Topics.contents.size() != 1 || response.Topics.contents[0].Partitions.contents.size() != 1)
+    return -2;
+  return response.Topics.contents[0].Partitions.contents[0].Offset.value;
+}
+
+int main()
+{
+  LoopbackBroker broker;
+  CHECK(broker.start());
+  Connection conn;
+  Poller poller;
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  poller.add(conn);
+
+  Connection * coordinator = nullptr;
+  std::vector<Failure> failures;
+  OffsetCommitter::Config config;
+  config.interval = std::chrono::hours(1);
+  OffsetCommitter committer(config,
+    [&coordinator](const std::string &) { return coordinator; },
+    [&failures](const std::string &, const std::string & topic, int32_t partition, int64_t offset, int error) {
+      failures.push_back(Failure{topic, partition, offset, error});
+    });
+
+  // Commits coalesce per partition; tick() waits for the interval.
+  for (int64_t i = 0; i <= 100; ++i)
+    committer.commit("g", "t", static_cast<int32_t>(i % 4), i);
+  CHECK(committer.pending() == 4);
+  CHECK(committer.tick() == 0);
+
+  // No coordinator: every commit fails with ENOTCONN and stays pending.
+  CHECK(committer.flush() == 0);
+  CHECK(failures.size() == 4);
+  CHECK(!failures.empty() && failures[0].error == ENOTCONN);
+  CHECK(committer.pending() == 4);
+  CHECK(!committer.flush_sync(std::chrono::milliseconds(100)));
+  failures.clear();
+
+  // The request fails in flight after a newer offset for partition 0 was
+  // recorded: the newer one is kept, the others are put back as they were.
+  coordinator = &conn;
+  CHECK(committer.flush() == 1);
+  CHECK(committer.pending() == 0);
+  committer.commit("g", "t", 0, 200);
+  conn.close();
+  CHECK(failures.size() == 4);
+  CHECK(committer.pending() == 4);
+
+  // Two requests for one partition fail in flight: the failure of the
+  // older must not bring its offset back over the newer one.
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  committer.commit("g", "t", 2, 300);
+  CHECK(committer.flush() == 1);
+  committer.commit("g", "t", 2, 400);
+  CHECK(committer.flush() == 1);
+  failures.clear();
+  conn.close();
+  CHECK(failures.size() == 5);
+  CHECK(committer.pending() == 4);
+
+  // connect() over an open socket closes it first: the request in flight
+  // on it fails and its offsets are pending again.
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  CHECK(committer.flush() == 1);
+  CHECK(committer.pending() == 0);
+  failures.clear();
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  CHECK(failures.size() == 4);
+  CHECK(committer.pending() == 4);
+
+  // Retried on a working connection, the newest offsets land.
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  std::atomic<bool> run(true);
+  std::thread io([&] {
+    while (run)
+      poller.run_once(50);
+  });
+  CHECK(committer.flush_sync(std::chrono::seconds(5)));
+  CHECK(committer.pending() == 0);
+  CHECK(committed(conn, "g", "t", 0) == 200);
+  CHECK(committed(conn, "g", "t", 1) == 97);
+  CHECK(committed(conn, "g", "t", 2) == 400);
+  CHECK(committed(conn, "g", "t", 3) == 99);
+
+  // Many threads committing at once through handles still end on each
+  // partition's last offset.
+  std::vector<std::thread> workers;
+  for (int w = 0; w < 4; ++w)
+    workers.emplace_back([&committer, w] {
+      const std::string topic = "w" + std::to_string(w);
+      OffsetCommitter::Slot * slots[8];
+      for (int32_t p = 0; p < 8; ++p)
+        slots[p] = committer.slot("g", topic, p);
+      for (int64_t i = 0; i <= 20000; ++i)
+      {
+        committer.commit(slots[i % 8], i);
+        if ((i & 1023) == 0)
+          committer.flush();
+      }
+    });
+  for (auto itor = workers.begin(); itor != workers.end(); ++itor)
+    itor->join();
+  CHECK(committer.flush_sync(std::chrono::seconds(5)));
+  CHECK(committed(conn, "g", "w2", 0) == 20000);
+  CHECK(committed(conn, "g", "w2", 7) == 19999);
+
+  run = false;
+  poller.wake();
+  io.join();
+  poller.remove(conn);
+  broker.stop();
+  return check_result();
+}
@@ -0,0 +1,90 @@
+#include <kpp_compression.hpp>
+#include "check.hpp"
+#include <string>
+#include <vector>
+
+/*
+ * Codec and MessageSetReader: a compressed MessageSet reads back as the
+ * messages it wraps, and a wrapper that inflates beyond the output limit
+ * fails instead of growing its buffer without bound.
+ */
+
+using namespace kpp;
+
+static MessageSet plain(int n, size_t value_size)
+{
+  MessageSet set;
+  for (int i = 0; i < n; ++i)
+  {
+    MessageSet::EntryT entry;
+    entry.Offset.value = i;
+    entry.Message.Value.bytes.assign(value_size, static_cast<uint8_t>(i));
+    entry.Message.Value.null = false;
+    set.Messages.contents.push_back(entry);
+  }
+  return set;
+}
+
+// 'inner' compressed into one wrapper, as a LazyMessageSet body.
+static std::vector<uint8_t> wrapped(Codec & codec, Compression::Type type, const MessageSet & inner)
+{
+  MessageSet outer;
+  outer.Messages.contents.resize(1);
+  CHECK(compress(codec, type, inner, outer.Messages.contents[0].Message));
+  std::vector<uint8_t> wire(encoded_size(outer));
+  buffer::writer oBuf(wire);
+  oBuf << outer;
+  wire.erase(wire.begin(), wire.begin() + sizeof(int32_t));
+  return wire;
+}
+
+static size_t read_all(const std::vector<uint8_t> & wire, Codec & codec, BufferPool & pool,
+                       size_t max_inflated, bool & failed)
+{
+  MessageSetReader reader(LazyMessageSet(wire.data(), wire.size()), codec, pool, max_inflated);
+  LazyMessageSet::Entry entry;
+  size_t n = 0;
+  while (reader.next(entry))
+    n += entry.verify() ? 1 : 0;
+  failed = reader.failed();
+  return n;
+}
+
+static void bounded(Codec & codec, Compression::Type type)
+{
+  BufferPool pool;
+  const MessageSet inner = plain(200, 1000);
+  const size_t inflated = encoded_size(inner) - sizeof(int32_t);
+  const std::vector<uint8_t> wire = wrapped(codec, type, inner);
+  CHECK(wire.size() < inflated);
+
+  bool failed = true;
+  CHECK(read_all(wire, codec, pool, Codec::default_max_output, failed) == 200);
+  CHECK(!failed);
+  CHECK(read_all(wire, codec, pool, inflated, failed) == 200);
+  CHECK(!failed);
+  CHECK(read_all(wire, codec, pool, inflated - 1, failed) == 0);
+  CHECK(failed);
+  CHECK(read_all(wire, codec, pool, 0, failed) == 0);
+  CHECK(failed);
+
+  std::vector<uint8_t> packed, out;
+  CHECK(codec.compress(type, wire.data(), wire.size(), packed));
+  CHECK(codec.decompress(type, packed.data(), packed.size(), out, wire.size()));
+  CHECK(out == wire);
+  CHECK(!codec.decompress(type, packed.data(), packed.size(), out, wire.size() - 1));
+}
+
+int main()
+{
+  Codec codec;
+  const std::vector<uint8_t> bytes(100, 'b');
+  std::vector<uint8_t> out;
+  CHECK(codec.decompress(Compression::None, bytes.data(), bytes.size(), out, bytes.size()));
+  CHECK(!codec.decompress(Compression::None, bytes.data(), bytes.size(), out, bytes.size() - 1));
+  if (Codec::supported(Compression::GZIP))
+    bounded(codec, Compression::GZIP);
+  if (Codec::supported(Compression::Snappy))
+    bounded(codec, Compression::Snappy);
+  return check_result();
+}
@@ -0,0 +1,184 @@
+#include <kpp_broker.hpp>
+#include <kpp_consumer.hpp>
+#include <kpp_producer.hpp>
+#include "check.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Consumer against a LoopbackBroker: every produced message comes back
+ * once and in order under a memory budget smaller than the data, seek()
+ * restarts a partition, and unassign() stops it. Neither a fetch still in
+ * flight nor a batch already buffered from before a reassignment leaks
+ * data from the old offset.
+ */
+
+using namespace kpp;
+
+static const int32_t partitions = 4;
+static const int64_t messages = 20000;
+
+static void produce(Connection & conn, const std::string & topic)
+{
+  Accumulator accumulator(Accumulator::Config(), [](const std::string &, int32_t) { return 0; });
+  const std::string value(100, 'v');
+  for (int64_t i = 0; i < messages; ++i)
+  {
+    const std::string key = std::to_string(i);
+    accumulator.append(topic, static_cast<int32_t>(i % partitions),
+                       BytesView{reinterpret_cast<const uint8_t *>(key.data()), key.size()},
+                       BytesView{reinterpret_cast<const uint8_t *>(value.data()), value.size()});
+  }
+  std::vector<ProduceBatch> batches;
+  accumulator.drain(Accumulator::clock::now(), batches, true);
+  for (auto itor = batches.begin(); itor != batches.end(); ++itor)
+  {
+    ProduceResponse response = conn.call<ProduceResponse>(itor->request).get();
+    for (auto t = response.Topics.contents.begin(); t != response.Topics.contents.end(); ++t)
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+        CHECK(p->ErrorCode.value == Error::NoError);
+  }
+}
+
+// First offset of 'partition' in 'batch', or -1.
+static int64_t first_offset(const FetchBatch & batch, int32_t partition)
+{
+  for (auto t = batch.response->Topics.contents.begin(); t != batch.response->Topics.contents.end(); ++t)
+    for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      if (p->Partition.value == partition && p->MessageSet.begin() != p->MessageSet.end())
+        return p->MessageSet.begin()->offset;
+  return -1;
+}
+
+// Partition 0 of 'topic' is unassigned and assigned again at 1500 while
+// its first fetch from 0 waits to go out; only data from 1500 on arrives.
+static void reassigned_in_flight(LoopbackBroker & broker, const std::string & topic)
+{
+  Connection conn;
+  Poller poller;
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  poller.add(conn);
+  Consumer::Config config;
+  config.max_bytes = 4 << 10;
+  Consumer consumer(config, [](const std::string &, int32_t) { return 0; }, [&conn](int32_t) { return &conn; });
+
+  consumer.assign(topic, 0, 0);
+  consumer.unassign(topic, 0);
+  consumer.assign(topic, 0, 1500);
+
+  std::atomic<bool> run(true);
+  std::thread io([&] {
+    while (run)
+      poller.run_once(10);
+  });
+  int64_t next = 1500;
+  FetchBatch batch;
+  for (int i = 0; i < 5 && consumer.poll(batch, std::chrono::seconds(5)); ++i)
+  {
+    for (auto t = batch.response->Topics.contents.begin(); t != batch.response->Topics.contents.end(); ++t)
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+        for (auto e = p->MessageSet.begin(); e != p->MessageSet.end(); ++e)
+        {
+          CHECK(e->offset == next);
+          next = e->offset + 1;
+        }
+    consumer.release(std::move(batch));
+  }
+  CHECK(next > 1500);
+  CHECK(consumer.position(topic, 0) >= next);
+
+  // Batches buffered before a seek() are cut, not delivered.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  consumer.seek(topic, 0, 3000);
+  CHECK(consumer.poll(batch, std::chrono::seconds(5)));
+  CHECK(first_offset(batch, 0) == 3000);
+  consumer.release(std::move(batch));
+
+  consumer.close();
+  run = false;
+  poller.wake();
+  io.join();
+  poller.remove(conn);
+}
+
+int main()
+{
+  const std::string topic = "consumed";
+  LoopbackBroker broker;
+  broker.create_topic(topic, partitions);
+  CHECK(broker.start());
+
+  Connection conn;
+  Poller poller;
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  poller.add(conn);
+  std::atomic<bool> run(true);
+  std::thread io([&] {
+    while (run)
+      poller.run_once(50);
+  });
+
+  produce(conn, topic);
+
+  Consumer::Config config;
+  config.max_bytes = 16 << 10;
+  config.memory_budget = 100 << 10;
+  Consumer consumer(config, [](const std::string &, int32_t) { return 0; }, [&conn](int32_t) { return &conn; });
+  for (int32_t p = 0; p < partitions; ++p)
+    consumer.assign(topic, p, 0);
+
+  std::vector<int64_t> next(partitions, 0);
+  int64_t received = 0;
+  size_t peak = 0;
+  while (received < messages)
+  {
+    FetchBatch batch;
+    if (!consumer.poll(batch, std::chrono::seconds(5)))
+      break;
+    peak = std::max(peak, consumer.used());
+    for (auto t = batch.response->Topics.contents.begin(); t != batch.response->Topics.contents.end(); ++t)
+      for (auto p = t->Partitions.contents.begin(); p != t->Partitions.contents.end(); ++p)
+      {
+        CHECK(p->ErrorCode.value == Error::NoError);
+        CHECK(p->MessageSet.verify());
+        for (auto e = p->MessageSet.begin(); e != p->MessageSet.end(); ++e)
+        {
+          CHECK(e->offset == next[p->Partition.value]);
+          ++next[p->Partition.value];
+          ++received;
+        }
+      }
+    consumer.release(std::move(batch));
+  }
+  CHECK(received == messages);
+  CHECK(peak <= config.memory_budget + static_cast<size_t>(partitions) * config.max_bytes);
+  for (int32_t p = 0; p < partitions; ++p)
+    CHECK(consumer.position(topic, p) == messages / partitions);
+
+  // After seek(), partition 0 comes back from offset 5.
+  consumer.seek(topic, 0, 5);
+  int64_t restarted = -1;
+  FetchBatch batch;
+  while (restarted < 0 && consumer.poll(batch, std::chrono::seconds(5)))
+  {
+    restarted = first_offset(batch, 0);
+    consumer.release(std::move(batch));
+  }
+  CHECK(restarted == 5);
+
+  consumer.unassign(topic, 1);
+  CHECK(consumer.position(topic, 1) == -1);
+
+  reassigned_in_flight(broker, topic);
+
+  consumer.close();
+  CHECK(!consumer.poll(batch, std::chrono::milliseconds(10)));
+  run = false;
+  poller.wake();
+  io.join();
+  poller.remove(conn);
+  broker.stop();
+  return check_result();
+}
@@ -0,0 +1,75 @@
+#include <kpp_protocol.hpp>
+#include "check.hpp"
+#include <cstring>
+#include <vector>
+
+/*
+ * buffer::gather: a frame gathered into pieces, with any min_reference,
+ * flattens to exactly what encode_frame() writes into one buffer, and
+ * only payloads longer than a fixed-width field are ever referenced.
+ */
+
+using namespace kpp;
+
+static ProduceRequest request()
+{
+  ProduceRequest request;
+  request.RequiredAcks.value = 1;
+  request.Timeout.value = 1500;
+  request.Topics.contents.resize(1);
+  request.Topics.contents[0].TopicName.bytes.assign(3, 't');
+  ProduceRequest::PartitionsT partition;
+  partition.Partition.value = 7;
+  for (size_t n = 0; n < 40; ++n)
+  {
+    MessageSet::EntryT entry;
+    entry.Offset.value = static_cast<int64_t>(n);
+    entry.Message.Key.bytes.assign(n % 5, static_cast<uint8_t>('k' + n));
+    entry.Message.Key.null = n % 5 == 0;
+    entry.Message.Value.bytes.assign(n, static_cast<uint8_t>(n));
+    entry.Message.Value.null = false;
+    partition.MessageSet.Messages.contents.push_back(entry);
+  }
+  request.Topics.contents[0].Partitions.contents.push_back(partition);
+  return request;
+}
+
+static std::vector<uint8_t> flatten(const buffer::gather & oGather)
+{
+  std::vector<buffer::gather::piece> pieces;
+  oGather.pieces(pieces);
+  std::vector<uint8_t> out;
+  for (auto itor = pieces.begin(); itor != pieces.end(); ++itor)
+    out.insert(out.end(), itor->data, itor->data + itor->size);
+  return out;
+}
+
+int main()
+{
+  RequestHeader header;
+  header.ApiKey.value = ApiKey::ProduceRequest;
+  header.CorrelationId.value = 42;
+  header.ClientId.bytes.assign(3, 'c');
+  const ProduceRequest produce = request();
+  const std::vector<uint8_t> expected = encode_frame(header, produce);
+
+  for (size_t min_reference = 0; min_reference <= 17; ++min_reference)
+  {
+    buffer::gather oGather(min_reference);
+    encode_frame(oGather, header, produce);
+    CHECK(oGather.size() == expected.size());
+    // Fields encoded from temporaries must have been copied, so wiping the
+    // stack they lived on cannot reach the result.
+    volatile uint8_t noise[256];
+    std::memset(const_cast<uint8_t *>(noise), 0xa5, sizeof noise);
+    CHECK(flatten(oGather) == expected);
+    if (min_reference >= 9)
+      CHECK(oGather.referenced() > 0);
+  }
+
+  buffer::gather oGather(4096);
+  encode_frame(oGather, header, produce);
+  CHECK(oGather.referenced() == 0);
+  CHECK(flatten(oGather) == expected);
+  return check_result();
+}
@@ -0,0 +1,146 @@
+#include <kpp_metadata.hpp>
+#include "check.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * MetadataCache: lookups after update(), the stale-topic refresh cycle
+ * driven by on_error(), and lookups racing updates and invalidations.
+ */
+
+using namespace kpp;
+
+static String text(const std::string & s)
+{
+  String out;
+  out.bytes.assign(s.begin(), s.end());
+  return out;
+}
+
+// 'topics' topics of 'partitions' partitions each, led alternately by nodes 0 and 1.
+static MetadataResponse response(const std::vector<std::string> & topics, int32_t partitions, int32_t shift)
+{
+  MetadataResponse r;
+  for (int32_t b = 0; b < 2; ++b)
+  {
+    r.Brokers.contents.emplace_back();
+    r.Brokers.contents.back().NodeId.value = b;
+    r.Brokers.contents.back().Host = text("broker-" + std::to_string(b));
+    r.Brokers.contents.back().Port.value = 9092 + b;
+  }
+  for (auto itor = topics.begin(); itor != topics.end(); ++itor)
+  {
+    r.TopicMetadata.contents.emplace_back();
+    MetadataResponse::TopicMetadataT & topic = r.TopicMetadata.contents.back();
+    topic.TopicName = text(*itor);
+    for (int32_t p = 0; p < partitions; ++p)
+    {
+      topic.PartitionMetadata.contents.emplace_back();
+      topic.PartitionMetadata.contents.back().PartitionId.value = p;
+      topic.PartitionMetadata.contents.back().Leader.value = (p + shift) % 2;
+    }
+  }
+  return r;
+}
+
+static std::string topic(int i) { return "topic-" + std::to_string(i); }
+
+static void lookups()
+{
+  MetadataCache cache;
+  CHECK(cache.leader("a", 0) == -1);
+  CHECK(cache.partitions("a") == 0);
+
+  std::vector<std::string> topics;
+  for (int i = 0; i < 50; ++i)
+    topics.push_back(topic(i));
+  cache.update(response(topics, 32, 0));
+  CHECK(cache.leader("topic-3", 4) == 0);
+  CHECK(cache.leader("topic-3", 5) == 1);
+  CHECK(cache.leader("topic-3", 32) == -1);
+  CHECK(cache.leader("topic-50", 0) == -1);
+  CHECK(cache.partitions("topic-49") == 32);
+
+  MetadataCache::Broker broker;
+  CHECK(cache.broker(1, broker) && broker.host == "broker-1" && broker.port == 9093);
+  CHECK(!cache.broker(2, broker));
+}
+
+static void refresh()
+{
+  MetadataCache cache;
+  cache.track("a");
+  cache.track("b");
+  CHECK(cache.needs_refresh());
+  CHECK(cache.refresh_request().Topics.contents.size() == 2);
+
+  cache.update(response({"a", "b"}, 4, 0));
+  CHECK(!cache.needs_refresh());
+  CHECK(cache.refresh_request().Topics.contents.empty());
+
+  // Only leader errors invalidate.
+  CHECK(!cache.on_error("a", 1, Error::OffsetOutOfRange));
+  CHECK(cache.leader("a", 1) == 1);
+  CHECK(cache.on_error("a", 1, Error::NotLeaderForPartition));
+  CHECK(cache.leader("a", 1) == -1);
+  CHECK(cache.leader("a", 0) == 0);
+  CHECK(cache.partitions("a") == 4);
+
+  // The refresh asks for the stale topic alone and leaves the rest alone.
+  MetadataRequest request = cache.refresh_request();
+  CHECK(request.Topics.contents.size() == 1);
+  CHECK(std::string(request.Topics.contents[0].bytes.begin(), request.Topics.contents[0].bytes.end()) == "a");
+  cache.update(response({"a"}, 4, 1));
+  CHECK(!cache.needs_refresh());
+  CHECK(cache.leader("a", 1) == 0);
+  CHECK(cache.leader("b", 1) == 1);
+
+  // A topic that comes back with an error stays stale.
+  MetadataResponse failed = response({"c"}, 0, 0);
+  failed.TopicMetadata.contents[0].TopicErrorCode.value = Error::LeaderNotAvailable;
+  cache.update(failed);
+  CHECK(cache.needs_refresh());
+  CHECK(cache.partitions("c") == 0);
+}
+
+static void concurrent()
+{
+  MetadataCache cache;
+  std::vector<std::string> topics;
+  for (int i = 0; i < 20; ++i)
+    topics.push_back(topic(i));
+  cache.update(response(topics, 16, 0));
+
+  std::atomic<bool> stop(false);
+  std::atomic<int> bad(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; ++r)
+    readers.emplace_back([&cache, &stop, &bad, r] {
+      const std::string name = topic(r);
+      for (int32_t i = 0; !stop.load(); ++i)
+      {
+        const int32_t leader = cache.leader(name, i % 16);
+        if (leader < -1 || leader > 1 || cache.partitions(name) != 16)
+          ++bad;
+      }
+    });
+  for (int i = 0; i < 2000; ++i)
+    if (i % 2)
+      cache.update(response(topics, 16, i));
+    else
+      cache.invalidate(topic(i % 4), i % 16);
+  stop = true;
+  for (auto itor = readers.begin(); itor != readers.end(); ++itor)
+    itor->join();
+  CHECK(bad.load() == 0);
+}
+
+int main()
+{
+  lookups();
+  refresh();
+  concurrent();
+  return check_result();
+}
@@ -0,0 +1,123 @@
+#include <kpp_broker.hpp>
+#include <kpp_client.hpp>
+#include <kpp_metrics.hpp>
+#include "check.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+
+/*
+ * metrics, built with KPP_WITH_METRICS: histogram buckets and percentiles,
+ * error codes by slot with Error::Unknown apart from the out-of-range
+ * ones, counts kept from threads that have exited, and a call() against a
+ * LoopbackBroker recorded from encode through decode.
+ */
+
+using namespace kpp;
+
+static void histogram()
+{
+  for (uint64_t ns = 0; ns < (uint64_t(1) << 40); ns = ns * 3 / 2 + 1)
+  {
+    const size_t b = metrics::Histogram::bucket(ns);
+    CHECK(b < metrics::Histogram::buckets);
+    CHECK(metrics::Histogram::lower(b) <= ns);
+    CHECK(b + 1 == metrics::Histogram::buckets || metrics::Histogram::lower(b + 1) > ns);
+  }
+  metrics::Histogram h;
+  for (uint64_t ns = 1; ns <= 1000; ++ns)
+    h.counts[metrics::Histogram::bucket(ns * 1000)] += 1;
+  CHECK(h.count() == 1000);
+  CHECK(h.percentile(0.5) <= 500000 && h.percentile(0.5) * 5 / 4 >= 500000);
+  CHECK(h.percentile(1.0) <= 1000000 && h.percentile(1.0) * 5 / 4 >= 1000000);
+}
+
+static void error_slots()
+{
+  CHECK(metrics::error_slot(Error::NoError) == 0);
+  CHECK(metrics::error_slot(Error::UnknownTopicOrPartition) == 3);
+  CHECK(metrics::error_slot(Error::Unknown) == metrics::unknown_error);
+  CHECK(metrics::error_slot(-2) == metrics::other_error);
+  CHECK(metrics::error_slot(static_cast<Error::Type>(metrics::errors)) == metrics::other_error);
+  CHECK(metrics::error_name(3) == "3");
+  CHECK(metrics::error_name(metrics::unknown_error) == "unknown");
+  CHECK(metrics::error_name(metrics::other_error) == "other");
+
+  const ApiKey::Type api = ApiKey::OffsetRequest;
+  const metrics::Snapshot before = metrics::snapshot();
+  // Recorded on a thread that is gone by the time of the snapshot.
+  std::thread([api] {
+    metrics::error(api, Error::Unknown);
+    metrics::error(api, Error::Unknown);
+    metrics::error(api, 500);
+    metrics::error(api, -7);
+    metrics::error(api, Error::OffsetOutOfRange);
+    metrics::failed(api);
+  }).join();
+  const metrics::Snapshot after = metrics::snapshot();
+  const metrics::Api & a = after.api[api];
+  const metrics::Api & b = before.api[api];
+  CHECK(a.error_codes[metrics::unknown_error] - b.error_codes[metrics::unknown_error] == 2);
+  CHECK(a.error_codes[metrics::other_error] - b.error_codes[metrics::other_error] == 2);
+  CHECK(a.error_codes[Error::OffsetOutOfRange] - b.error_codes[Error::OffsetOutOfRange] == 1);
+  CHECK(a.failures - b.failures == 1);
+
+  const std::string text = metrics::to_text(after);
+  CHECK(text.find("Offset ") != std::string::npos);
+  CHECK(text.find(" error_unknown=2") != std::string::npos);
+  CHECK(text.find(" error_other=2") != std::string::npos);
+  const std::string json = metrics::to_json(after);
+  CHECK(json.find("\"unknown\":2") != std::string::npos);
+  CHECK(json.find("\"other\":2") != std::string::npos);
+}
+
+// A Produce call() to a partition the broker does not have.
+static void call()
+{
+  LoopbackBroker broker;
+  CHECK(broker.start());
+  Connection conn;
+  Poller poller;
+  CHECK(conn.connect("127.0.0.1", broker.port()));
+  poller.add(conn);
+  std::atomic<bool> run(true);
+  std::thread io([&] {
+    while (run)
+      poller.run_once(50);
+  });
+
+  ProduceRequest request;
+  request.RequiredAcks.value = 1;
+  request.Topics.contents.resize(1);
+  request.Topics.contents[0].TopicName.bytes.assign(5, 't');
+  request.Topics.contents[0].Partitions.contents.resize(1);
+  request.Topics.contents[0].Partitions.contents[0].Partition.value = 9;
+
+  const metrics::Snapshot before = metrics::snapshot();
+  ProduceResponse response = conn.call<ProduceResponse>(request).get();
+  const metrics::Snapshot after = metrics::snapshot();
+  const metrics::Api & a = after.api[ApiKey::ProduceRequest];
+  const metrics::Api & b = before.api[ApiKey::ProduceRequest];
+  CHECK(a.requests - b.requests == 1);
+  CHECK(a.responses - b.responses == 1);
+  CHECK(a.bytes_encoded > b.bytes_encoded);
+  CHECK(a.bytes_decoded > b.bytes_decoded);
+  CHECK(a.round_trip_ns.count() - b.round_trip_ns.count() == 1);
+  CHECK(a.decode_ns.count() - b.decode_ns.count() == 1);
+  CHECK(a.error_codes[Error::UnknownTopicOrPartition] - b.error_codes[Error::UnknownTopicOrPartition] == 1);
+
+  run = false;
+  poller.wake();
+  io.join();
+  poller.remove(conn);
+  broker.stop();
+}
+
+int main()
+{
+  CHECK(metrics::enabled);
+  histogram();
+  error_slots();
+  call();
+  return check_result();
+}
@@ -0,0 +1,157 @@
+#include <kpp_parallel.hpp>
+#include "check.hpp"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+ * WorkPool and decode_parallel: the parallel decode of a response equals
+ * the sequential one, a corrupt message fails it, and many threads running
+ * small jobs and decodes at once on one pool all finish with every task
+ * run exactly once.
+ */
+
+using namespace kpp;
+
+static std::vector<uint8_t> fetch_response(int topics, int partitions)
+{
+  FetchResponse response;
+  response.Topics.contents.resize(topics);
+  for (int t = 0; t < topics; ++t)
+  {
+    FetchResponse::TopicsT & topic = response.Topics.contents[t];
+    topic.TopicName.bytes.assign(5, static_cast<uint8_t>('a' + t));
+    for (int p = 0; p < partitions; ++p)
+    {
+      FetchResponse::PartitionsT partition;
+      partition.Partition.value = p;
+      partition.HighwaterMarkOffset.value = 1000;
+      for (int m = 0; m < (p % 7) * 10; ++m)
+      {
+        MessageSet::EntryT entry;
+        entry.Offset.value = m;
+        entry.Message.Value.bytes.assign(300, static_cast<uint8_t>(m));
+        entry.Message.Value.null = false;
+        partition.MessageSet.Messages.contents.push_back(entry);
+      }
+      topic.Partitions.contents.push_back(partition);
+    }
+  }
+  std::vector<uint8_t> wire(encoded_size(response));
+  buffer::writer oBuf(wire);
+  oBuf << response;
+  return wire;
+}
+
+template <typename T>
+static std::vector<uint8_t> encode(const T & value)
+{
+  std::vector<uint8_t> wire(encoded_size(value));
+  buffer::writer oBuf(wire);
+  oBuf << value;
+  return wire;
+}
+
+static void equals_sequential(WorkPool & pool, const std::vector<uint8_t> & wire)
+{
+  FetchResponse sequential;
+  buffer::reader iSeq(wire);
+  iSeq >> sequential;
+  CHECK(iSeq);
+
+  FetchResponse parallel;
+  buffer::reader iPar(wire);
+  CHECK(decode_parallel(pool, iPar, parallel));
+  CHECK(iPar.remaining() == 0);
+  CHECK(encode(parallel) == encode(sequential));
+  CHECK(encode(parallel) == wire);
+
+  FetchResponseView view;
+  buffer::reader iView(wire);
+  iView >> view;
+  CHECK(verify_parallel(pool, view));
+
+  // Other 'Topics [TopicName [Partitions]]' responses, empty ones included.
+  OffsetFetchResponse offsets;
+  offsets.Topics.contents.resize(2);
+  offsets.Topics.contents[1].Partitions.contents.resize(3);
+  const std::vector<uint8_t> offsets_wire = encode(offsets);
+  OffsetFetchResponse offsets_out;
+  buffer::reader iOffsets(offsets_wire);
+  CHECK(decode_parallel(pool, iOffsets, offsets_out));
+  CHECK(encode(offsets_out) == offsets_wire);
+
+  const std::vector<uint8_t> produce_wire = encode(ProduceResponse());
+  ProduceResponse produce_out;
+  buffer::reader iProduce(produce_wire);
+  CHECK(decode_parallel(pool, iProduce, produce_out));
+}
+
+static void corrupt(WorkPool & pool, const std::vector<uint8_t> & wire)
+{
+  std::vector<uint8_t> bad = wire;
+  const std::vector<uint8_t> value(300, 5);
+  auto at = std::search(bad.begin(), bad.end(), value.begin(), value.end());
+  CHECK(at != bad.end());
+  if (at == bad.end())
+    return;
+  at[150] ^= 1;
+
+  FetchResponse out;
+  buffer::reader iBuf(bad);
+  CHECK(!decode_parallel(pool, iBuf, out));
+  CHECK(!iBuf);
+
+  FetchResponseView view;
+  buffer::reader iView(bad);
+  iView >> view;
+  CHECK(!verify_parallel(pool, view));
+
+  std::vector<uint8_t> cut(wire.begin(), wire.begin() + wire.size() / 2);
+  buffer::reader iCut(cut);
+  CHECK(!decode_parallel(pool, iCut, out));
+}
+
+// Jobs finishing while their callers return is where a Job outliving its
+// stack frame would show, so keep many small ones in flight at once.
+static void stress(WorkPool & pool, const std::vector<uint8_t> & wire)
+{
+  std::atomic<int> bad(0);
+  std::vector<std::thread> callers;
+  for (int c = 0; c < 4; ++c)
+    callers.emplace_back([&pool, &wire, &bad] {
+      for (int i = 0; i < 200; ++i)
+      {
+        std::atomic<size_t> ran(0);
+        const size_t n = 1 + i % 17;
+        pool.parallel_for(n, [&ran](size_t) { ran.fetch_add(1); });
+        if (ran.load() != n)
+          ++bad;
+        if (i % 10 == 0)
+        {
+          FetchResponse out;
+          buffer::reader iBuf(wire);
+          if (!decode_parallel(pool, iBuf, out) || out.Topics.contents.size() != 4)
+            ++bad;
+        }
+      }
+    });
+  for (auto itor = callers.begin(); itor != callers.end(); ++itor)
+    itor->join();
+  CHECK(bad.load() == 0);
+}
+
+int main()
+{
+  const std::vector<uint8_t> wire = fetch_response(4, 48);
+  for (size_t threads = 1; threads <= 4; threads *= 2)
+  {
+    WorkPool pool(threads);
+    CHECK(pool.size() == threads);
+    equals_sequential(pool, wire);
+    corrupt(pool, wire);
+    stress(pool, wire);
+  }
+  return check_result();
+}
@@ -0,0 +1,147 @@
+#include <kpp_partitioner.hpp>
+#include "check.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+ * Partitioner: murmur2 against the Java client's values, hash_n() against
+ * hash() on short, long and null keys, assign() against partition(),
+ * sticky routing of keyless messages, and append() stopping at the
+ * Accumulator's budget.
+ */
+
+using namespace kpp;
+
+static BytesView view(const std::string & s)
+{
+  return BytesView{reinterpret_cast<const uint8_t *>(s.data()), s.size()};
+}
+
+static void java_compatible()
+{
+  // Utils.murmur2() of the Java client.
+  struct { const char * key; int32_t hash; } known[] = {
+    {"21", -973932308},
+    {"foobar", -790332482},
+    {"a-little-bit-long-string", -985981536},
+    {"a-little-bit-longer-string", -1486304829},
+    {"lkjh234lh9fiuh90y23oiuhsafujhadof229phr9h19h89h8", -58897971},
+    {"abc", 479470107},
+  };
+  for (size_t i = 0; i < sizeof known / sizeof known[0]; ++i)
+    CHECK(static_cast<int32_t>(murmur2::hash(known[i].key, std::strlen(known[i].key))) == known[i].hash);
+
+  CHECK(Partitioner::keyed(static_cast<uint32_t>(-973932308), 7) == (-973932308 & 0x7fffffff) % 7);
+}
+
+// Short keys up to 504, then one group of eight mixing a long key with
+// short ones, then keys of 59 to 219 bytes, long enough for hash_n() to
+// run its groups eight lanes at a time; every length modulo 4 occurs.
+static std::vector<std::string> batch_keys()
+{
+  std::vector<std::string> strings;
+  for (int i = 0; i < 1003; ++i)
+  {
+    std::string key = "key-" + std::to_string(i * 7919);
+    if (i < 504)
+      key += std::string(i % 13, 'x');
+    else if (i == 507)
+      key += std::string(400, 'y');
+    else if (i >= 512)
+      key += std::string(48 + (i * 37) % 161, static_cast<char>('a' + i % 26));
+    strings.push_back(key);
+  }
+  return strings;
+}
+
+static void batch()
+{
+  const std::vector<std::string> strings = batch_keys();
+  std::vector<BytesView> keys;
+  for (auto itor = strings.begin(); itor != strings.end(); ++itor)
+    keys.push_back(view(*itor));
+  keys[5] = BytesView{nullptr, 0};
+  keys[505] = BytesView{nullptr, 0};
+  keys[700] = BytesView{nullptr, 0};
+  keys[803] = BytesView{reinterpret_cast<const uint8_t *>(""), 0};
+  keys[804] = BytesView{nullptr, 0};
+
+  std::vector<uint32_t> hashes(keys.size());
+  murmur2::hash_n(keys.data(), keys.size(), hashes.data());
+  for (size_t i = 0; i < keys.size(); ++i)
+    CHECK(hashes[i] == murmur2::hash(keys[i].data, keys[i].size));
+
+#ifdef KPP_MURMUR2_SIMD
+  // The eight-lane kernel itself, on every group, long or not.
+  if (murmur2::accelerated())
+    for (size_t i = 0; i + 8 <= keys.size(); i += 8)
+    {
+      uint32_t lanes[8];
+      murmur2::hash8_avx2(keys.data() + i, lanes);
+      for (size_t lane = 0; lane < 8; ++lane)
+        CHECK(lanes[lane] == hashes[i + lane]);
+    }
+#endif
+
+  Partitioner partitioner;
+  std::vector<int32_t> out(keys.size());
+  partitioner.assign("t", keys.data(), keys.size(), 12, out.data());
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    CHECK(out[i] >= 0 && out[i] < 12);
+    if (keys[i].data)
+      CHECK(out[i] == partitioner.partition("t", keys[i], 12));
+  }
+
+  partitioner.assign("t", keys.data(), keys.size(), 0, out.data());
+  CHECK(out[0] == -1 && out[1002] == -1);
+  CHECK(partitioner.partition("t", keys[0], 0) == -1);
+}
+
+static void sticky()
+{
+  Partitioner::Config config;
+  config.sticky_messages = 3;
+  Partitioner partitioner(config);
+  const BytesView none = {nullptr, 0};
+  const int32_t first = partitioner.partition("u", none, 4);
+  CHECK(partitioner.partition("u", none, 4) == first);
+  CHECK(partitioner.partition("u", none, 4) == first);
+  CHECK(partitioner.partition("u", none, 4) == (first + 1) % 4);
+
+  // An empty key is a key.
+  const BytesView empty = {reinterpret_cast<const uint8_t *>(""), 0};
+  CHECK(partitioner.partition("u", empty, 4) == Partitioner::keyed(murmur2::hash(empty.data, 0), 4));
+}
+
+static void append()
+{
+  Accumulator::Config config;
+  config.memory_budget = 4 << 10;
+  Accumulator accumulator(config, [](const std::string &, int32_t) { return 0; });
+  Partitioner partitioner;
+
+  const std::string value(100, 'v');
+  std::vector<std::string> strings;
+  std::vector<BytesView> keys, values;
+  for (int i = 0; i < 200; ++i)
+    strings.push_back(std::to_string(i));
+  for (int i = 0; i < 200; ++i)
+  {
+    keys.push_back(view(strings[i]));
+    values.push_back(view(value));
+  }
+  CHECK(partitioner.append(accumulator, "t", keys.data(), values.data(), keys.size(), 0) == 0);
+  const size_t taken = partitioner.append(accumulator, "t", keys.data(), values.data(), keys.size(), 8);
+  CHECK(taken > 0 && taken < keys.size());
+}
+
+int main()
+{
+  java_compatible();
+  batch();
+  sticky();
+  append();
+  return check_result();
+}
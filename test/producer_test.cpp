@@ -0,0 +1,71 @@
+#include <kpp_producer.hpp>
+#include "check.hpp"
+#include <string>
+#include <vector>
+
+/*
+ * Accumulator memory budget: it stops taking messages when exhausted and
+ * starts again once drained batches are released, and a message larger
+ * than the whole budget is refused on its own without blocking the rest.
+ */
+
+using namespace kpp;
+
+static BytesView view(const std::string & s)
+{
+  return BytesView{reinterpret_cast<const uint8_t *>(s.data()), s.size()};
+}
+
+static void exhausted()
+{
+  Accumulator::Config config;
+  config.memory_budget = 4 << 10;
+  Accumulator accumulator(config, [](const std::string &, int32_t) { return 0; });
+  const std::string value(100, 'v');
+
+  size_t taken = 0;
+  while (accumulator.append("t", 0, BytesView{nullptr, 0}, view(value)))
+    ++taken;
+  CHECK(taken > 0);
+  CHECK(accumulator.buffered() <= config.memory_budget);
+  // Exhausted: a message that would fit alone is still refused.
+  CHECK(!accumulator.append("t", 1, BytesView{nullptr, 0}, view(std::string(1, 'v'))));
+
+  std::vector<ProduceBatch> out;
+  CHECK(accumulator.drain(Accumulator::clock::now(), out) == 1);
+  CHECK(out.size() == 1 && out[0].messages == taken);
+  CHECK(!accumulator.append("t", 0, BytesView{nullptr, 0}, view(value)));
+  accumulator.release(std::move(out[0]));
+  CHECK(accumulator.buffered() == 0);
+  CHECK(accumulator.append("t", 0, BytesView{nullptr, 0}, view(value)));
+}
+
+static void oversize()
+{
+  Accumulator::Config config;
+  config.memory_budget = 1 << 10;
+  Accumulator accumulator(config, [](const std::string &, int32_t) { return 0; });
+  const std::string huge(2 << 10, 'h');
+  const std::string small(10, 's');
+
+  CHECK(!accumulator.fits(BytesView{nullptr, 0}, view(huge)));
+  CHECK(accumulator.fits(BytesView{nullptr, 0}, view(small)));
+  CHECK(!accumulator.append("t", 0, BytesView{nullptr, 0}, view(huge)));
+  CHECK(accumulator.buffered() == 0);
+  CHECK(accumulator.append("t", 0, BytesView{nullptr, 0}, view(small)));
+
+  // Also with data already buffered.
+  CHECK(!accumulator.append("t", 0, BytesView{nullptr, 0}, view(huge)));
+  CHECK(accumulator.append("t", 0, BytesView{nullptr, 0}, view(small)));
+
+  std::vector<ProduceBatch> out;
+  CHECK(accumulator.drain(Accumulator::clock::now(), out, true) == 1);
+  CHECK(out.size() == 1 && out[0].messages == 2);
+}
+
+int main()
+{
+  exhausted();
+  oversize();
+  return check_result();
+}
@@ -0,0 +1,179 @@
+#include <kpp_segment.hpp>
+#include "check.hpp"
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * SegmentStore: append and read back across segments, reopen, and reopen
+ * after the tail of the last segment was torn by a crash, which must drop
+ * exactly the torn part and let appends carry on from there. A failed
+ * call does not leave its error behind for the next one.
+ */
+
+using namespace kpp;
+
+// Entries 'Offset MessageSize Message' for offsets base .. base + n - 1.
+static std::vector<uint8_t> entries(int64_t base, int n, size_t value_size)
+{
+  MessageSet set;
+  for (int i = 0; i < n; ++i)
+  {
+    MessageSet::EntryT entry;
+    entry.Offset.value = base + i;
+    entry.Message.Value.bytes.assign(value_size, static_cast<uint8_t>(base + i));
+    entry.Message.Value.null = false;
+    set.Messages.contents.push_back(entry);
+  }
+  std::vector<uint8_t> out(encoded_size(set));
+  buffer::writer oBuf(out);
+  oBuf << set;
+  out.erase(out.begin(), out.begin() + sizeof(int32_t));
+  return out;
+}
+
+static bool append(SegmentStore & store, const std::vector<uint8_t> & bytes)
+{
+  return store.append(LazyMessageSet(bytes.data(), bytes.size()));
+}
+
+// Every offset from 'first' to next_offset() reads back, in order and intact.
+static bool replays(const SegmentStore & store, int64_t first)
+{
+  int64_t offset = first;
+  while (offset < store.next_offset())
+  {
+    LazyMessageSet set = store.read(offset, 1 << 20);
+    if (set.begin() == set.end())
+      return false;
+    for (auto itor = set.begin(); itor != set.end(); ++itor)
+    {
+      if (itor->offset != offset || !itor->verify())
+        return false;
+      ++offset;
+    }
+  }
+  return offset == store.next_offset();
+}
+
+static std::string last_segment(const std::string & dir)
+{
+  std::string last;
+  DIR * d = ::opendir(dir.c_str());
+  while (dirent * e = ::readdir(d))
+    if (std::string(e->d_name) > last && e->d_name[0] != '.')
+      last = e->d_name;
+  ::closedir(d);
+  return dir + "/" + last;
+}
+
+static void remove_dir(const std::string & dir)
+{
+  DIR * d = ::opendir(dir.c_str());
+  while (dirent * e = ::readdir(d))
+    if (e->d_name[0] != '.')
+      ::unlink((dir + "/" + e->d_name).c_str());
+  ::closedir(d);
+  ::rmdir(dir.c_str());
+}
+
+// Write 'bytes' at the end of 'file', as a crash mid-append would leave them.
+static void tear(const std::string & file, const std::vector<uint8_t> & bytes)
+{
+  const int fd = ::open(file.c_str(), O_WRONLY | O_APPEND);
+  CHECK(fd >= 0);
+  CHECK(::write(fd, bytes.data(), bytes.size()) == static_cast<ssize_t>(bytes.size()));
+  ::close(fd);
+}
+
+int main()
+{
+  char dir_template[] = "/tmp/kpp_segment_test.XXXXXX";
+  const char * made = ::mkdtemp(dir_template);
+  CHECK(made != nullptr);
+  if (!made)
+    return check_result();
+  const std::string dir = made;
+
+  SegmentStore::Config config;
+  config.segment_bytes = 64 << 10;
+  config.index_interval = 1024;
+  {
+    SegmentStore store(config);
+    CHECK(store.open(dir));
+    CHECK(store.empty());
+    for (int64_t base = 0; base < 5000; base += 100)
+      CHECK(append(store, entries(base, 100, 50 + base % 7)));
+    // A refetch of a range already held only adds what is new.
+    CHECK(append(store, entries(4950, 100, 10)));
+    CHECK(store.start_offset() == 0);
+    CHECK(store.next_offset() == 5050);
+    CHECK(replays(store, 0));
+    CHECK(store.read(5050, 100).begin() == store.read(5050, 100).end());
+    CHECK(store.flush());
+  }
+  {
+    SegmentStore store(config);
+    CHECK(store.open(dir));
+    CHECK(store.next_offset() == 5050);
+    CHECK(replays(store, 0));
+  }
+
+  // A torn entry: its header promises more than made it to disk.
+  std::vector<uint8_t> torn = entries(5050, 1, 200);
+  torn.resize(torn.size() / 2);
+  tear(last_segment(dir), torn);
+  {
+    SegmentStore store(config);
+    CHECK(store.open(dir));
+    CHECK(store.next_offset() == 5050);
+    CHECK(replays(store, 0));
+    CHECK(append(store, entries(5050, 10, 30)));
+    CHECK(store.next_offset() == 5060);
+  }
+  {
+    SegmentStore store(config);
+    CHECK(store.open(dir));
+    CHECK(store.next_offset() == 5060);
+    CHECK(replays(store, 4000));
+  }
+
+  // A complete entry whose bytes did not all reach the disk: bad Crc.
+  std::vector<uint8_t> corrupt = entries(5060, 1, 30);
+  corrupt.back() ^= 1;
+  tear(last_segment(dir), corrupt);
+  // And the zeros of a preallocated segment that was never cut down.
+  tear(last_segment(dir), std::vector<uint8_t>(4096, 0));
+  {
+    SegmentStore store(config);
+    CHECK(store.open(dir));
+    CHECK(store.next_offset() == 5060);
+    CHECK(append(store, entries(5060, 5, 30)));
+    CHECK(replays(store, 5000));
+    CHECK(store.trim(2500));
+    CHECK(store.start_offset() > 0 && store.start_offset() <= 2500);
+    CHECK(replays(store, store.start_offset()));
+
+    // A failed call leaves error() set only until the next one.
+    char name[32];
+    std::snprintf(name, sizeof name, "/%020" PRId64 ".log", store.start_offset());
+    CHECK(::unlink((dir + name).c_str()) == 0);
+    CHECK(!store.trim(store.next_offset()));
+    CHECK(store.error() == ENOENT);
+    CHECK(store.trim(store.next_offset()));
+    CHECK(store.error() == 0);
+    CHECK(append(store, entries(5065, 5, 30)));
+    CHECK(store.flush());
+    CHECK(replays(store, store.start_offset()));
+  }
+
+  remove_dir(dir);
+  return check_result();
+}